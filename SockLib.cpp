@@ -9,6 +9,7 @@
 
 #include <assert.h>
 #include <thread>
+#include <algorithm>
 
 #ifdef _WIN32
 	#include <time.h>
@@ -17,6 +18,11 @@
 	#pragma comment(lib, "ws2_32.lib")
 #else // !_WIN32
 	#include <sys/time.h>
+	#include <fcntl.h>
+	#if defined(__linux__) || defined(ANDROID)
+	#include <sys/eventfd.h>
+	#include <netinet/udp.h>
+	#endif
 	#define StrCmpI					::strcasecmp
 	#define StrCmpNI				::strncasecmp
 #endif // _WIN32
@@ -39,25 +45,17 @@ SOCKLIB_NAMESPACE_BEGIN
 
 std::string SockLib::_libName = SOCKLIB_NAME;
 
-SockLib::SockMap	SockLib::_news;
-SockLib::SockMap	SockLib::_refs;
-SockLib::SockMap	SockLib::_clos;
-SockLib::SockMap	SockLib::_dies;
-
-fd_set	SockLib::_fdr;
-fd_set	SockLib::_fdw;
-fd_set	SockLib::_fde;
-timeval SockLib::_tv;
+thread_local SockLoop* SockLoop::_current = nullptr;
 
 static std::string SOCKLIB_TCP 		= SOCKLIB_NAME ".tcp";
 static std::string SOCKLIB_UDP 		= SOCKLIB_NAME ".udp";
+static std::string SOCKLIB_RUDP 	= SOCKLIB_NAME ".rudp";
 static std::string SOCKLIB_BUF 		= SOCKLIB_NAME ".buf";
 static std::string SOCKLIB_UTIL 	= SOCKLIB_NAME ".util";
 static std::string SOCKLIB_NCAS 	= SOCKLIB_NAME ".nocase";
 
 #if SOCKLIB_TO_LUA
-LuaHelper::Objects	LuaHelper::_objs;
-lua_State* 			SockLib::_luaState = 0;
+thread_local LuaHelper::Objects	LuaHelper::_objs;
 
 #if SOCKLIB_ALG
 static std::string SOCKLIB_RC4 	= SOCKLIB_NAME ".rc4";
@@ -88,22 +86,187 @@ bool SockLib::init()
 //
 void SockLib::cleanup()
 {
+	SockLoop::current()->cleanup();
+	
 #ifdef _WIN32
 	WSACleanup();
 #endif // _WIN32
 }
 
 //----------------------------------------------------------------------------
+// the ref stays in the loop it's added first
 //
+SockLoop* SockLib::loopOf(SockPtr ref)
+{
+	return ref->_loop ? ref->_loop : SockLoop::current();
+}
+
 void SockLib::destroy(SockPtr ref)
+{
+	loopOf(ref)->destroy(ref);
+}
+
+void SockLib::release(SockPtr ref)
+{
+	loopOf(ref)->release(ref);
+}
+
+void SockLib::add(SockPtr ref, int event)
+{
+	loopOf(ref)->add(ref, event);
+}
+
+void SockLib::modify(SockPtr ref, int event)
+{
+	loopOf(ref)->modify(ref, event);
+}
+
+void SockLib::remove(const SockPtr ref)
+{
+	if (ref->_loop)
+		ref->_loop->remove(ref);
+}
+
+bool SockLib::found(const SockPtr ref)
+{
+	return ref->_loop && ref->_loop->found(ref);
+}
+
+void SockLib::update(SockPtr ref)
+{
+	if (ref->_loop)
+		ref->_loop->update(ref);
+}
+
+void SockLib::addPoll(SockPtr ref)
+{
+	loopOf(ref)->addPoll(ref);
+}
+
+void SockLib::removePoll(SockPtr ref)
+{
+	if (ref->_loop)
+		ref->_loop->removePoll(ref);
+}
+
+void SockLib::flushLater(SockPtr ref)
+{
+	loopOf(ref)->flushLater(ref);
+}
+
+void SockLib::poll(u32_t usec)
+{
+	SockLoop::current()->poll(usec);
+}
+
+void SockLib::run(u32_t usec)
+{
+	SockLoop::current()->run(usec);
+}
+
+void SockLib::stop()
+{
+	SockLoop::current()->stop();
+}
+
+void SockLib::post(const std::function<void()>& func)
+{
+	SockLoop::current()->post(func);
+}
+
+void SockLib::wakeup()
+{
+	SockLoop::current()->wakeup();
+}
+
+#if SOCKLIB_TO_LUA
+lua_State* SockLib::luaState()
+{
+	return SockLoop::current()->luaState();
+}
+#endif // SOCKLIB_TO_LUA
+
+///////////////////////////////////////////////////////////////////////////////
+// SockLoop
+//
+
+//----------------------------------------------------------------------------
+//
+SockLoop::SockLoop() : _posts(nullptr), _wakeup(nullptr), _running(false)
+{
+}
+
+SockLoop::~SockLoop()
+{
+	cleanup();
+	if (_current == this)
+		_current = nullptr;
+}
+
+//----------------------------------------------------------------------------
+//
+SockLoop* SockLoop::defaultLoop()
+{
+	static SockLoop loop;
+	return &loop;
+}
+
+SockLoop* SockLoop::current()
+{
+	return _current ? _current : defaultLoop();
+}
+
+void SockLoop::makeCurrent()
+{
+	_current = this;
+}
+
+//----------------------------------------------------------------------------
+//
+void SockLoop::cleanup()
+{
+	_running = false;
+	
+	// ours, not lua's, destroy() would only remove it without lua
+	SockWakeup* w = _wakeup.exchange(nullptr);
+	if (w) {
+		remove(w);
+		beforePoll();
+		delete w;
+	}
+	
+	for (auto& ref : _flushes)
+		ref->_flushDirty = false;
+	_flushes.clear();
+	
+	// no answer is posted here after this
+	Resolver::cancel(this);
+	_resolves.clear();
+	
+	PostNode* node = _posts.exchange(nullptr);
+	while (node) {
+		PostNode* next = node->next;
+		delete node;
+		node = next;
+	}
+	
+#if SOCKLIB_EPOLL
+	if (_epfd >= 0) {
+		::close(_epfd);
+		_epfd = -1;
+	}
+#endif // SOCKLIB_EPOLL
+}
+
+//----------------------------------------------------------------------------
+//
+void SockLoop::destroy(SockPtr ref)
 {
 #if SOCKLIB_TO_LUA
 	// if lua manager it, don't destroy
 	if (!LuaHelper::found(ref)) {
 		ref->close();
-		_dies[ref] = 1;
-		_news.erase(ref);
-		_clos.erase(ref);
+		release(ref);
 	} else {
 		remove(ref);
 	}
@@ -113,153 +276,562 @@ void SockLib::destroy(SockPtr ref)
 }
 
 //----------------------------------------------------------------------------
+// not now, it may be in its own callback
 //
-void SockLib::add(SockPtr ref, int event)
+void SockLoop::release(SockPtr ref)
+{
+	pend(ref, SockLib::PEND_DESTROY);
+}
+
+//----------------------------------------------------------------------------
+//
+void SockLoop::add(SockPtr ref, int event)
 {
+	if (!ref->_loop)
+		ref->_loop = this;
 	ref->_careEvent = event;
-	_news[ref] = event;
-	_clos.erase(ref);
-	_dies.erase(ref);
+	pend(ref, SockLib::PEND_ADD);
 }
 
 //----------------------------------------------------------------------------
 //
-void SockLib::modify(SockPtr ref, int event)
+void SockLoop::modify(SockPtr ref, int event)
 {
 	ref->_careEvent = event;
-	_news[ref] = event;
-	_clos.erase(ref);
-	_dies.erase(ref);
+	pend(ref, SockLib::PEND_ADD);
 }
 
 //----------------------------------------------------------------------------
 //
-void SockLib::remove(const SockPtr ref)
+void SockLoop::remove(const SockPtr ref)
 {
-	_clos[ref] = 1;
-	_news.erase(ref);
-	_dies.erase(ref);
+	pend(ref, SockLib::PEND_REMOVE);
 }
 
 //----------------------------------------------------------------------------
 //
-bool SockLib::found(const SockPtr ref)
+bool SockLoop::found(const SockPtr ref)
+{
+	return ref->_slot >= 0 && _slots[ref->_slot].ref == ref;
+}
+
+//----------------------------------------------------------------------------
+// the last one wins, applied in beforePoll()
+//
+void SockLoop::pend(SockPtr ref, int op)
+{
+	if (ref->_pending == SockLib::PEND_NONE)
+		_pends.push_back(ref);
+	ref->_pending = op;
+}
+
+//----------------------------------------------------------------------------
+//
+void SockLoop::slotIn(SockPtr ref)
+{
+	if (ref->isClosed()) {
+		slotOut(ref);
+		return;
+	}
+	
+	int fd = ref->fd();
+#if SOCKLIB_SLOTMAP
+	int idx = slotOf(fd);
+#else
+	int idx = fd;
+#endif // SOCKLIB_SLOTMAP
+	
+	if (ref->_slot != idx) {
+		slotOut(ref);
+
+		if ((size_t)idx >= _slots.size())
+			_slots.resize(idx + 1);
+		
+		SockLib::SockSlot& slot = _slots[idx];
+		if (slot.ref) { // stale, its fd was closed behind us
+			slot.ref->_slot = -1;
+			--_slotCount;
+		}
+		slot.ref = ref;
+		++slot.gen;
+		++_slotCount;
+		
+		ref->_slot = idx;
+	}
+	
+#if SOCKLIB_EPOLL
+	_epoll_ctl(ref);
+#endif // SOCKLIB_EPOLL
+}
+
+//----------------------------------------------------------------------------
+//
+void SockLoop::slotOut(SockPtr ref)
+{
+	if (ref->_slot < 0)
+		return;
+	
+	SockLib::SockSlot& slot = _slots[ref->_slot];
+	ref->_slot = -1;
+	
+	if (slot.ref != ref)
+		return;
+	
+	slot.ref = nullptr;
+	++slot.gen;
+	--_slotCount;
+	
+#if SOCKLIB_SLOTMAP
+	_slotIds.erase(slot.fd);
+	_slotFree.push_back((int)(&slot - &_slots[0]));
+	slot.fd = -1;
+#endif // SOCKLIB_SLOTMAP
+	
+#if SOCKLIB_EPOLL
+	// a closed fd was already removed by kernel
+	if (ref->_pollEvent >= 0 && !ref->isClosed())
+		::epoll_ctl(_epfd, EPOLL_CTL_DEL, ref->fd(), 0);
+	ref->_pollEvent = -1;
+#endif // SOCKLIB_EPOLL
+}
+
+#if SOCKLIB_SLOTMAP
+//----------------------------------------------------------------------------
+// the index of fd in _slots, a free one if it has none
+//
+int SockLoop::slotOf(int fd)
+{
+	auto it = _slotIds.find(fd);
+	if (it != _slotIds.end())
+		return it->second;
+	
+	int idx;
+	if (!_slotFree.empty()) {
+		idx = _slotFree.back();
+		_slotFree.pop_back();
+	} else {
+		idx = (int)_slots.size();
+		_slots.resize(idx + 1);
+	}
+	
+	_slots[idx].fd = fd;
+	_slotIds[fd] = idx;
+	
+	return idx;
+}
+#endif // SOCKLIB_SLOTMAP
+
+//----------------------------------------------------------------------------
+//
+void SockLoop::update(SockPtr ref)
+{
+#if SOCKLIB_EPOLL
+	if (!ref->_pollDirty) {
+		ref->_pollDirty = true;
+		_upds.push_back(ref);
+	}
+#endif // SOCKLIB_EPOLL
+}
+
+//----------------------------------------------------------------------------
+//
+void SockLoop::addPoll(SockPtr ref)
+{
+	if (!ref->_careOnPoll) {
+		ref->_careOnPoll = true;
+		_polls.push_back(ref);
+	}
+}
+
+//----------------------------------------------------------------------------
+// may be called in dispatch(), so just leave a hole here
+//
+void SockLoop::removePoll(SockPtr ref)
+{
+	if (ref->_careOnPoll) {
+		ref->_careOnPoll = false;
+		for (auto& sk : _polls) {
+			if (sk == ref) {
+				sk = nullptr;
+				_pollsDirty = true;
+				break;
+			}
+		}
+	}
+}
+
+//----------------------------------------------------------------------------
+//
+void SockLoop::flushLater(SockPtr ref)
+{
+	if (!ref->_flushDirty) {
+		ref->_flushDirty = true;
+		_flushes.push_back(ref);
+	}
+}
+
+//----------------------------------------------------------------------------
+// refs are deleted in beforePoll() only, all of them are alive here
+//
+void SockLoop::flushAll()
 {
-	return _refs.find(ref) != _refs.end();
+	// onFlush() may add more
+	for (size_t i = 0; i < _flushes.size(); ++i) {
+		SockPtr ref = _flushes[i];
+		ref->_flushDirty = false;
+		if (!ref->isClosed())
+			ref->onFlush();
+	}
+	_flushes.clear();
 }
 
 //----------------------------------------------------------------------------
 //
-void SockLib::beforePoll()
+void SockLoop::beforePoll()
 {
 #ifdef SOCKLIB_DEBUG
-	bool dirty = !_news.empty() || !_clos.empty() || !_dies.empty();
+	bool dirty = !_pends.empty();
 	if (dirty)
-		DBGLOG("SockLib::beforePoll() { _refs=%u, _news=%u, _clos=%u, _dies=%u\n",
-			(u32_t)_refs.size(), (u32_t)_news.size(), (u32_t)_clos.size(), (u32_t)_dies.size());
+		DBGLOG("SockLoop::beforePoll() { _slotCount=%u, _pends=%u\n", _slotCount, (u32_t)_pends.size());
 #endif // SOCKLIB_DEBUG
 	
-	for (auto& ref : _news) {
-		_refs[ref.first] = ref.second;
+#if SOCKLIB_EPOLL
+	if (_epfd < 0)
+		_epfd = ::epoll_create1(EPOLL_CLOEXEC);
+	
+	// before deleting, they may be in both
+	for (auto& ref : _upds) {
+		ref->_pollDirty = false;
+		if (!ref->isClosed() && found(ref))
+			_epoll_ctl(ref);
 	}
-	_news.clear();
+	_upds.clear();
+#endif // SOCKLIB_EPOLL
 
-	for (auto& ref : _dies) {
-		_refs.erase(ref.first);
-		DBGLOG("SockLib::beforePoll() delete a ref %p\n", ref.first);
-		delete ref.first;
+	size_t n = _pends.size();
+	
+	for (size_t i = 0; i < n; ++i) {
+		SockPtr ref = _pends[i];
+		if (ref->_pending == SockLib::PEND_REMOVE || ref->_pending == SockLib::PEND_DESTROY)
+			slotOut(ref);
 	}
-	_dies.clear();
 	
-	for (auto& ref : _clos) {
-		_refs.erase(ref.first);
+	// after slotOut(), a closed fd may be reused by a new ref
+	for (size_t i = 0; i < n; ++i) {
+		SockPtr ref = _pends[i];
+		if (ref->_pending == SockLib::PEND_ADD)
+			slotIn(ref);
 	}
-	_clos.clear();
 	
+	for (size_t i = 0; i < n; ++i) {
+		SockPtr ref = _pends[i];
+		int op = ref->_pending;
+		ref->_pending = SockLib::PEND_NONE;
+		if (op == SockLib::PEND_DESTROY) {
+			removePoll(ref);
+			DBGLOG("SockLoop::beforePoll() delete a ref %p\n", ref);
+			delete ref;
+		}
+	}
+	
+	_pends.erase(_pends.begin(), _pends.begin() + n);
+	
+	if (_pollsDirty) {
+		_polls.erase(std::remove(_polls.begin(), _polls.end(), nullptr), _polls.end());
+		_pollsDirty = false;
+	}
+
 #ifdef SOCKLIB_DEBUG
 	if (dirty)
-		DBGLOG("SockLib::beforePoll() } _refs=%u, _news=%u, _clos=%u, _dies=%u\n",
-			(u32_t)_refs.size(), (u32_t)_news.size(), (u32_t)_clos.size(), (u32_t)_dies.size());
+		DBGLOG("SockLoop::beforePoll() } _slotCount=%u, _pends=%u\n", _slotCount, (u32_t)_pends.size());
 #endif // SOCKLIB_DEBUG
 }
 
 //----------------------------------------------------------------------------
 //
-void SockLib::poll(u32_t usec)
+void SockLoop::afterPoll()
+{
+	dispatch();
+	flushAll();
+
+	for (auto& it : _ready) {
+		SockPtr sk = it.first;
+		sk->_fireEvent = SockLib::EVT_NONE;
+		// careSend() may changed after onSend()/onConnect()
+		if (!sk->isClosed())
+			update(sk);
+	}
+	_ready.clear();
+}
+
+//----------------------------------------------------------------------------
+// tick() is cached only here, this thread may do other things between polls
+//
+void SockLoop::poll(u32_t usec)
+{
+	bool cached = Util::cacheTick(true);
+	doPoll(usec);
+	Util::cacheTick(cached);
+}
+
+//----------------------------------------------------------------------------
+//
+void SockLoop::doPoll(u32_t usec)
 {
+	makeCurrent();
+	
+	// from the first poll, before any post is taken, so none is missed
+	if (!_wakeup) {
+		SockWakeup* w = new SockWakeup();
+		if (w->create() > 0) {
+			add(w, SockLib::EVT_RECV);
+			_wakeup = w;
+		} else {
+			delete w;
+		}
+	}
+	
+	Util::updateTick();
 	Util::poll();
 	
+	_pool.trim(Util::tick());
+	
+	runPosts();
+	
+	// sent in timers and posts, or out of poll()
+	flushAll();
+	
 	beforePoll();
 	
-	if (_refs.empty() && usec > 0) {
+	i64_t next = Timer::nextTimeout();
+	if (next >= 0 && (usec == SockLib::POLL_FOREVER || next * 1000 < usec))
+		usec = (u32_t)(next * 1000);
+	
+	// nothing can wake us up forever
+	if (!_slotCount) {
+		if (usec > 0 && usec != SockLib::POLL_FOREVER) {
 #ifdef _WIN32
-		Sleep(1);
+			Sleep((usec + 999) / 1000);
 #else
-		usleep(usec ? usec*100 : 1000);
+			struct timespec ts = { (time_t)(usec / 1000000), (long)(usec % 1000000) * 1000 };
+			nanosleep(&ts, nullptr);
 #endif
+			Util::updateTick();
+		}
 		return;
 	}
 	
+#if SOCKLIB_EPOLL
+	_poll_epoll(usec);
+#else
 	int evtcnt = 0;
-	for (SockMap::iterator it = _refs.begin(); it != _refs.end(); ) {
-		evtcnt += _poll_per_FD_SETSIZE(it, evtcnt ? 0 : usec);
+	for (size_t i = 0; i < _slots.size(); ) {
+		evtcnt += _poll_per_FD_SETSIZE(i, evtcnt ? 0 : usec);
 	}
+#endif // SOCKLIB_EPOLL
+	
+	// we may be blocked for a while, timers added in callbacks need it
+	if (usec > 0)
+		Util::updateTick();
 	
 	afterPoll();
 }
 
-int SockLib::_poll_per_FD_SETSIZE(SockMap::iterator& it_begin, u32_t usec)
+//----------------------------------------------------------------------------
+//
+void SockLoop::run(u32_t usec)
 {
-    int maxfd = 0, evtcnt = 0;
-    
-    _tv.tv_sec  = 0;
-    _tv.tv_usec = usec;
-    
-    FD_ZERO(&_fdr);
-    FD_ZERO(&_fdw);
-    FD_ZERO(&_fde);
-
-	int it_count = 0;
+	_running = true;
+	while (_running)
+		poll(usec);
+}
 
-	SockMap::iterator it;
-    for (it = it_begin; it_count < FD_SETSIZE && it != _refs.end(); ++it) {
-        SockPtr sk = it->first;
-		
-		if (sk->isClosed()) {
-			remove(sk);
-			continue;
-		}
+//----------------------------------------------------------------------------
+//
+void SockLoop::stop()
+{
+	_running = false;
+	wakeup();
+}
 
-		++it_count;
-//		std::cout << "it_count=" << it_count << std::endl;
+//----------------------------------------------------------------------------
+// only the first node into an empty stack need to wake up the poll thread
+//
+void SockLoop::post(const std::function<void()>& func)
+{
+	PostNode* node = new PostNode{ func, nullptr };
+	PostNode* head = _posts.load(std::memory_order_relaxed);
+	do {
+		node->next = head;
+	} while (!_posts.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+	
+	if (!head)
+		wakeup();
+}
 
-        int ev = sk->careEvent();
-        
-        if ((ev & SockLib::EVT_RECV) && sk->careRecv())
-            FD_SET(sk->fd(), &_fdr);
-		
-        if ((ev & SockLib::EVT_SEND) && sk->careSend())
-            FD_SET(sk->fd(), &_fdw);
+//----------------------------------------------------------------------------
+//
+void SockLoop::wakeup()
+{
+	SockWakeup* w = _wakeup.load();
+	if (w)
+		w->signal();
+}
 
-        FD_SET(sk->fd(), &_fde);
-        
-        if (maxfd < sk->fd())
-            maxfd = sk->fd();
-    }
-	
-    if (::select(maxfd + 1, &_fdr, &_fdw, &_fde, &_tv) <= 0) {
-		it_begin = it;
-        return 0;
+//----------------------------------------------------------------------------
+// take all at once, and run in the posted order
+//
+void SockLoop::runPosts()
+{
+	PostNode* node = _posts.exchange(nullptr, std::memory_order_acquire);
+	PostNode* list = nullptr;
+	
+	while (node) {
+		PostNode* next = node->next;
+		node->next = list;
+		list = node;
+		node = next;
+	}
+	
+	while (list) {
+		PostNode* next = list->next;
+		if (list->func)
+			list->func();
+		delete list;
+		list = next;
 	}
+}
+
+#if SOCKLIB_EPOLL
+//----------------------------------------------------------------------------
+// register/modify ref in epoll, only when it's interest changed
+//
+void SockLoop::_epoll_ctl(SockPtr ref)
+{
+	int ev = ref->careEvent(), mask = 0;
+	
+	if ((ev & SockLib::EVT_RECV) && ref->careRecv())
+		mask |= EPOLLIN;
+	if ((ev & SockLib::EVT_SEND) && ref->careSend())
+		mask |= EPOLLOUT;
+	
+	if (mask == ref->_pollEvent)
+		return;
+	
+	epoll_event e;
+	memset(&e, 0, sizeof(e));
+	e.events = mask;
+	e.data.u64 = ((u64_t)_slots[ref->_slot].gen << 32) | (u32_t)ref->_slot;
 	
-	it_count = 0;
-    for (it = it_begin; it_count < FD_SETSIZE && it != _refs.end(); ++it) {
-        SockPtr sk = it->first;
+	int op = ref->_pollEvent < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	int r = ::epoll_ctl(_epfd, op, ref->fd(), &e);
+	if (r < 0 && errno == ENOENT)
+		r = ::epoll_ctl(_epfd, EPOLL_CTL_ADD, ref->fd(), &e);
+	else if (r < 0 && errno == EEXIST)
+		r = ::epoll_ctl(_epfd, EPOLL_CTL_MOD, ref->fd(), &e);
+	
+	DBGLOG_IF(r < 0, "SockLoop::_epoll_ctl(fd=%d) failed, errno=%d\n", ref->fd(), errno);
+	
+	ref->_pollEvent = r < 0 ? -1 : mask;
+}
+
+//----------------------------------------------------------------------------
+// epoll_wait() is in msec, usec > 0 wait 1 msec at least
+// SockLib::POLL_FOREVER blocks until some events come
+//
+int SockLoop::_poll_epoll(u32_t usec)
+{
+	size_t max = _slotCount;
+	if (max < 64) max = 64;
+	if (max > 4096) max = 4096;
+	if (_epevs.size() < max)
+		_epevs.resize(max);
+	
+	int timeout = usec == SockLib::POLL_FOREVER ? -1 : (int)((usec + 999) / 1000);
+	int n = ::epoll_wait(_epfd, &_epevs[0], (int)max, timeout);
+	
+	for (int i = 0; i < n; ++i) {
+		const epoll_event& e = _epevs[i];
+		u32_t idx = (u32_t)e.data.u64;
+		u32_t gen = (u32_t)(e.data.u64 >> 32);
 		
-		if (sk->isClosed())
+		// the slot was reused by others
+		if (idx >= _slots.size() || _slots[idx].gen != gen || !_slots[idx].ref)
+			continue;
+		
+		SockPtr sk = _slots[idx].ref;
+		int ev = 0;
+		
+		if (e.events & EPOLLERR)
+			ev |= SockLib::EVT_ERROR;
+		if (e.events & EPOLLOUT)
+			ev |= SockLib::EVT_SEND;
+		// let recv() get the remaining data and 0 on EPOLLHUP
+		if (e.events & (EPOLLIN | EPOLLHUP))
+			ev |= SockLib::EVT_RECV;
+		
+		sk->_fireEvent = ev;
+		_ready.push_back(SockLib::SockEvt(sk, ev));
+	}
+	
+	return n > 0 ? n : 0;
+}
+
+#else
+
+int SockLoop::_poll_per_FD_SETSIZE(size_t& begin, u32_t usec)
+{
+    int maxfd = 0, evtcnt = 0;
+    
+    _tv.tv_sec  = usec / 1000000;
+    _tv.tv_usec = usec % 1000000;
+    
+    FD_ZERO(&_fdr);
+    FD_ZERO(&_fdw);
+    FD_ZERO(&_fde);
+
+	int count = 0;
+	size_t i, end;
+
+    for (i = begin; count < FD_SETSIZE && i < _slots.size(); ++i) {
+        SockPtr sk = _slots[i].ref;
+		
+		if (!sk)
+			continue;
+		
+		if (sk->isClosed()) {
+			remove(sk);
 			continue;
+		}
+
+		++count;
+
+        int ev = sk->careEvent();
+        
+        if ((ev & SockLib::EVT_RECV) && sk->careRecv())
+            FD_SET(sk->fd(), &_fdr);
+		
+        if ((ev & SockLib::EVT_SEND) && sk->careSend())
+            FD_SET(sk->fd(), &_fdw);
 
-		++it_count;
+        FD_SET(sk->fd(), &_fde);
+        
+        if (maxfd < sk->fd())
+            maxfd = sk->fd();
+    }
+	
+	end = i;
+	
+    if (::select(maxfd + 1, &_fdr, &_fdw, &_fde, usec == SockLib::POLL_FOREVER ? nullptr : &_tv) <= 0) {
+		begin = end;
+        return 0;
+	}
+	
+    for (i = begin; i < end; ++i) {
+        SockPtr sk = _slots[i].ref;
+		
+		if (!sk || sk->isClosed())
+			continue;
 
         int ev = 0;
         
@@ -270,30 +842,39 @@ int SockLib::_poll_per_FD_SETSIZE(SockMap::iterator& it_begin, u32_t usec)
         if (FD_ISSET(sk->fd(), &_fdr))
             ev |= SockLib::EVT_RECV;
         
+		if (!ev)
+			continue;
+		
         sk->_fireEvent = ev;
+		_ready.push_back(SockLib::SockEvt(sk, ev));
 
-		if (ev && ev != SockLib::EVT_SEND)
+		if (ev != SockLib::EVT_SEND)
 			++evtcnt;
     }
 	
-	it_begin = it;
+	begin = end;
 
 	return evtcnt;
 }
 
-void SockLib::dispatch()
+#endif // SOCKLIB_EPOLL
+
+void SockLoop::dispatch()
 {
-    if (_refs.empty())
-        return;
+	// _polls may grow in onPoll()
+	for (size_t i = 0; i < _polls.size(); ++i) {
+		SockPtr sk = _polls[i];
+		if (sk && !sk->isClosed() && found(sk))
+			sk->onPoll();
+	}
 
-    for (SockMap::iterator it = _refs.begin(); it != _refs.end(); ++it) {
-        SockPtr sk = it->first;
+    for (auto& it : _ready) {
+        SockPtr sk = it.first;
 		
-		sk->onPoll();
 		if (sk->isClosed())
 			continue;
 
-        int ev = sk->fireEvent();
+        int ev = it.second;
 		
         if (sk->_sockState == SockLib::STA_CONNECTTING) {
             if (ev & SockLib::EVT_ERROR) {
@@ -345,8 +926,12 @@ void SockLib::dispatch()
 static const luaL_Reg SockLib_Reg[] = {
 	{ "tcp", 		SockLib::mylua_tcp },
 	{ "udp", 		SockLib::mylua_udp },
+	{ "rudp", 		SockLib::mylua_rudp },
 	{ "buf", 		SockLib::mylua_buf },
 	{ "poll", 		SockLib::mylua_poll },
+	{ "run", 		SockLib::mylua_run },
+	{ "stop", 		SockLib::mylua_stop },
+	{ "pool", 		SockLib::mylua_pool },
 	{ NULL, 		NULL }
 };
 
@@ -355,6 +940,7 @@ static const luaL_Reg SockTcp_Reg[] = {
 	{ "listen", 	SockTcp::mylua_listen },
 	{ "accept", 	SockTcp::mylua_accept },
 	{ "send", 		SockTcp::mylua_send },
+	{ "sendv", 		SockTcp::mylua_sendv },
 	{ "recv", 		SockTcp::mylua_recv },
 //	{ "inbuf", 		SockTcp::mylua_inbuf },		// __index do it
 //	{ "outbuf", 	SockTcp::mylua_outbuf },	// __index do it
@@ -384,10 +970,27 @@ static const luaL_Reg SockUdp_Reg[] = {
 	{ NULL, 		NULL }
 };
 
+static const luaL_Reg SockRudp_Reg[] = {
+	{ "connect", 	SockRudp::mylua_connect },
+	{ "listen", 	SockRudp::mylua_listen },
+	{ "send", 		SockRudp::mylua_send },
+	{ "close", 		SockRudp::mylua_close },
+	{ "isclosed", 	SockRudp::mylua_isclosed },
+	{ "onevent", 	SockRudp::mylua_onevent },
+	{ "setopt", 	SockRudp::mylua_setopt },
+	{ "peeraddr",	SockRudp::mylua_peeraddr },
+	{ "__index", 	SockRudp::mylua_index },
+	{ "__gc", 		SockRudp::mylua_gc },
+	{ "__tostring", SockRudp::mylua_tostring },
+	{ NULL, 		NULL }
+};
+
 static const luaL_Reg SockBuf_Reg[] = {
 	{ "reset", 		SockBuf::mylua_reset },
 	{ "skip", 		SockBuf::mylua_skip },
 	{ "discard", 	SockBuf::mylua_discard },
+	{ "chain", 		SockBuf::mylua_chain },
+	{ "ring", 		SockBuf::mylua_ring },
 	
 	{ "sub", 		SockBuf::mylua_sub },
 
@@ -448,11 +1051,14 @@ static const luaL_Reg SockUtil_Reg[] = {
 	{ "u32_rshift", 	Util::mylua_u32_rshift },
 	
 	{ "tick",		Util::mylua_tick },
+	{ "usec",		Util::mylua_usec },
+	{ "nsec",		Util::mylua_nsec },
 	{ "urlenc",		Util::mylua_urlenc },
 	{ "urldec",		Util::mylua_urldec },
 	{ "ips2n",		Util::mylua_ips2n },
 	{ "ipn2s",		Util::mylua_ipn2s },
 	{ "ipprobe",	Util::mylua_ipprobe },
+	{ "resolve",	Util::mylua_resolve },
 	{ "settimer", 	Util::mylua_settimer },
 	{ "deltimer", 	Util::mylua_deltimer },
 	{ "htons",		Util::mylua_htons },
@@ -517,6 +1123,8 @@ static const luaL_Reg AlgSHA1_Reg[] = {
 #define SOCKEVT_SEND			"SEND"
 #define SOCKEVT_CLOSE			"CLOSE"
 #define SOCKEVT_POLL			"POLL"
+#define SOCKEVT_FRAME			"FRAME"
+#define SOCKEVT_DRAIN			"DRAIN"
 
 #define SOCKOPT_BLOCKING		"BLOCKING"
 #define SOCKOPT_SENDBUFSIZE		"SENDBUFSIZE"
@@ -524,6 +1132,24 @@ static const luaL_Reg AlgSHA1_Reg[] = {
 #define SOCKOPT_SENDTIMEOUT		"SENDTIMEOUT"
 #define SOCKOPT_RECVTIMEOUT		"RECVTIMEOUT"
 #define SOCKOPT_REUSEADDR		"REUSEADDR"
+#define SOCKOPT_ACCEPTBATCH		"ACCEPTBATCH"
+#define SOCKOPT_FRAME			"FRAME"
+#define SOCKOPT_WATERMARK		"WATERMARK"
+#define SOCKOPT_SENDCAP			"SENDCAP"
+#define SOCKOPT_SENDMODE		"SENDMODE"
+#define SOCKOPT_NODELAY			"NODELAY"
+#define SOCKOPT_CORK			"CORK"
+#define SOCKOPT_QUICKACK		"QUICKACK"
+#define SOCKOPT_CONNTIMEOUT		"CONNTIMEOUT"
+#define SOCKOPT_CONNRACE		"CONNRACE"
+#define SOCKOPT_RECVBATCH		"RECVBATCH"
+#define SOCKOPT_SENDBATCH		"SENDBATCH"
+#define SOCKOPT_GSO				"GSO"
+#define SOCKOPT_GRO				"GRO"
+#define SOCKOPT_WINDOW			"WINDOW"
+#define SOCKOPT_MTU				"MTU"
+#define SOCKOPT_DEADLINK		"DEADLINK"
+#define SOCKOPT_IDLE			"IDLE"
 
 #define SOCKFMT_STR				"STR"
 #define SOCKFMT_HEX				"HEX"
@@ -585,11 +1211,16 @@ int LuaHelper::mylua_index(lua_State* L)
 
 //----------------------------------------------------------------------------
 //
-static int mylua_return_fmt(lua_State* L, const char* fmt, const void* ptr, u32_t len)
+// src: ptr is in it, *BUF is a slice of src then
+//
+static int mylua_return_fmt(lua_State* L, const char* fmt, const void* ptr, u32_t len, SockBuf* src = 0)
 {
 	if (fmt && 0 == StrCmpI(fmt, "*" SOCKFMT_BUF)) {
 		SockBuf* buf = new SockBuf();
-		buf->w(ptr, len);
+		if (src)
+			src->slice(*buf, ptr, len);
+		else
+			buf->w(ptr, len);
 		return LuaHelper::bind<SockBuf>(L, SOCKLIB_BUF, buf);
 	} else if (fmt && 0 == StrCmpI(fmt, "*" SOCKFMT_HEX)) {
 		char* hex = new char[len * 2 + 2];
@@ -635,7 +1266,7 @@ static bool mylua_input_get(lua_State* L, int idx, void*& ptr, u32_t& len)
 		if (buf) {
 			if (!len || len > buf->len())
 				len = buf->len();
-			ptr = (void*)buf->pos();
+			ptr = (void*)buf->pullup(len);
 		}
 	}
 	
@@ -704,12 +1335,13 @@ int SockLib::luaRegLib(lua_State* L, const char* libName)
 	if (!init())
 		return 0;
 	
-	_luaState = L;
+	SockLoop::current()->setLuaState(L);
 
 	_libName = libName ? libName : SOCKLIB_NAME;
 	
 	SOCKLIB_TCP = std::string(libName) + ".tcp";
 	SOCKLIB_UDP = std::string(libName) + ".udp";
+	SOCKLIB_RUDP = std::string(libName) + ".rudp";
 	SOCKLIB_BUF = std::string(libName) + ".buf";
 	SOCKLIB_UTIL = std::string(libName) + ".util";
 	SOCKLIB_NCAS = std::string(libName) + ".nocase";
@@ -733,6 +1365,7 @@ int SockLib::luaRegLib(lua_State* L, const char* libName)
 	#endif
 	LuaHelper::newMetatable(L, SOCKLIB_TCP, SockTcp_Reg);
 	LuaHelper::newMetatable(L, SOCKLIB_UDP, SockUdp_Reg);
+	LuaHelper::newMetatable(L, SOCKLIB_RUDP, SockRudp_Reg);
 	LuaHelper::newMetatable(L, SOCKLIB_BUF, SockBuf_Reg);
 
 	#if SOCKLIB_ALG
@@ -776,7 +1409,9 @@ int SockLib::luaRegLib(lua_State* L, const char* libName)
 		SOCKEVT_POLL,
 		SOCKEVT_RECV,
 		SOCKEVT_SEND,
-		SOCKEVT_CLOSE
+		SOCKEVT_CLOSE,
+		SOCKEVT_FRAME,
+		SOCKEVT_DRAIN
 	};
 	for (int i = 0; i < sizeof(evts)/sizeof(evts[0]); ++i) {
 		lua_pushstring(L, evts[i]);
@@ -798,7 +1433,25 @@ int SockLib::luaRegLib(lua_State* L, const char* libName)
 		SOCKOPT_RECVBUFSIZE,
 		SOCKOPT_SENDTIMEOUT,
 		SOCKOPT_RECVTIMEOUT,
-		SOCKOPT_REUSEADDR
+		SOCKOPT_REUSEADDR,
+		SOCKOPT_ACCEPTBATCH,
+		SOCKOPT_FRAME,
+		SOCKOPT_WATERMARK,
+		SOCKOPT_SENDCAP,
+		SOCKOPT_SENDMODE,
+		SOCKOPT_NODELAY,
+		SOCKOPT_CORK,
+		SOCKOPT_QUICKACK,
+		SOCKOPT_CONNTIMEOUT,
+		SOCKOPT_CONNRACE,
+		SOCKOPT_RECVBATCH,
+		SOCKOPT_SENDBATCH,
+		SOCKOPT_GSO,
+		SOCKOPT_GRO,
+		SOCKOPT_WINDOW,
+		SOCKOPT_MTU,
+		SOCKOPT_DEADLINK,
+		SOCKOPT_IDLE
 	};
 	for (int i = 0; i < sizeof(opts)/sizeof(opts[0]); ++i) {
 		lua_pushstring(L, opts[i]);
@@ -844,6 +1497,13 @@ int SockLib::mylua_udp(lua_State* L)
 	return LuaHelper::create<SockUdp>(L, SOCKLIB_UDP);
 }
 
+//----------------------------------------------------------------------------
+//
+int SockLib::mylua_rudp(lua_State* L)
+{
+	return LuaHelper::create<SockRudp>(L, SOCKLIB_RUDP);
+}
+
 //----------------------------------------------------------------------------
 //
 int SockLib::mylua_buf(lua_State* L)
@@ -863,8 +1523,144 @@ int SockLib::mylua_poll(lua_State* L)
 	return 0;
 }
 
+//----------------------------------------------------------------------------
+//	socklib.run([usec])
+//
+int SockLib::mylua_run(lua_State* L)
+{
+	if (lua_gettop(L) > 0 && lua_isnumber(L, 1)) {
+		run((u32_t)lua_tointeger(L, 1));
+	} else {
+		run();
+	}
+	return 0;
+}
+
+//----------------------------------------------------------------------------
+//	socklib.stop()
+//
+int SockLib::mylua_stop(lua_State* L)
+{
+	(void)L;
+	stop();
+	return 0;
+}
+
+//----------------------------------------------------------------------------
+// socklib.pool([cap, retention]) -> { hits=, misses=, drops=, cached= }
+//
+int SockLib::mylua_pool(lua_State* L)
+{
+	SockPool* pool = SockPool::current();
+	
+	if (lua_gettop(L) >= 1)
+		pool->setCap((u32_t)luaL_checkinteger(L, 1));
+	if (lua_gettop(L) >= 2)
+		pool->setRetention((u32_t)luaL_checkinteger(L, 2));
+	
+	const SockPool::Stats& st = pool->stats();
+	
+	lua_newtable(L);
+	lua_pushnumber(L, (lua_Number)st.hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, (lua_Number)st.misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushnumber(L, (lua_Number)st.drops);
+	lua_setfield(L, -2, "drops");
+	lua_pushnumber(L, (lua_Number)st.cached);
+	lua_setfield(L, -2, "cached");
+	
+	return 1;
+}
+
 #endif // SOCKLIB_TO_LUA
 
+///////////////////////////////////////////////////////////////////////////////
+// SockWakeup
+//
+int SockWakeup::create()
+{
+	if (_fd > 0)
+		return _fd;
+	
+#ifdef _WIN32
+	// select() works with socket only, send to itself
+	SOCKET s = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (s == INVALID_SOCKET)
+		return -1;
+	
+	sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	Util::ips2addr("127.0.0.1", 0, &addr);
+	if (::bind(s, (sockaddr*)&addr, len) != 0 || ::getsockname(s, (sockaddr*)&addr, &len) != 0 ||
+		::connect(s, (sockaddr*)&addr, len) != 0) {
+		::closesocket(s);
+		return -1;
+	}
+	_fd = _wfd = (int)s;
+	setNonBlock(true);
+#elif defined(__linux__) || defined(ANDROID)
+	_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_fd < 0)
+		return -1;
+	_wfd = _fd;
+#else
+	int fds[2];
+	if (::pipe(fds) != 0)
+		return -1;
+	for (int i = 0; i < 2; ++i) {
+		::fcntl(fds[i], F_SETFL, ::fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		::fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	_fd = fds[0];
+	_wfd = fds[1];
+#endif // _WIN32
+	
+	_sockState = SockLib::STA_CONNECTED;
+	return _fd;
+}
+
+void SockWakeup::close()
+{
+#if !defined(_WIN32) && !defined(__linux__) && !defined(ANDROID)
+	if (_wfd >= 0)
+		::close(_wfd);
+#endif
+	_wfd = -1;
+	SockRef::close();
+}
+
+void SockWakeup::signal()
+{
+	if (_wfd < 0)
+		return;
+	
+#ifdef _WIN32
+	char c = 0;
+	::send(_wfd, &c, 1, 0);
+#elif defined(__linux__) || defined(ANDROID)
+	u64_t n = 1;
+	ssize_t r = ::write(_wfd, &n, sizeof(n));
+	(void)r;
+#else
+	// EAGAIN means it's signaled already
+	char c = 0;
+	ssize_t r = ::write(_wfd, &c, 1);
+	(void)r;
+#endif
+}
+
+void SockWakeup::onRecv()
+{
+	char buf[64];
+#ifdef _WIN32
+	while (::recv(_fd, buf, sizeof(buf), 0) > 0) {}
+#else
+	while (::read(_fd, buf, sizeof(buf)) > 0) {}
+#endif
+	_loop->runPosts();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // SockRef
 //
@@ -884,6 +1680,9 @@ void SockRef::close()
 #endif
 
 	_sockState = SockLib::STA_CLOSED;
+	_pollEvent = -1;
+	_noDelayOpt = -1;
+	_corked = false;
 	
 	_fd = -1;
 }
@@ -910,8 +1709,8 @@ int SockRef::ioctl(unsigned long cmd, unsigned long* arg)
 int SockRef::setNonBlock(bool b)
 {
 #if defined(ANDROID) || defined(LINUX)
-	int flags = ::fcntl(m_fd, F_GETFL);
-	::fcntl(fd(), F_SETFL, flags | O_NONBLOCK);
+	int flags = ::fcntl(fd(), F_GETFL);
+	return ::fcntl(fd(), F_SETFL, b ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
 #else
 	unsigned long opt = (b ? 1 : 0);
 	return this->ioctl(FIONBIO, &opt);
@@ -928,12 +1727,56 @@ int SockRef::setReuseAddr(bool b)
 #endif
 }
 
+int SockRef::setReusePort(bool b)
+{
+#ifdef SO_REUSEPORT
+	int opt = (b ? 1 : 0);
+	return setOption(SO_REUSEPORT, (const char*)&opt, sizeof(opt));
+#else
+	return SOCKET_ERROR;
+#endif
+}
+
 int SockRef::setBroadcast(bool b)
 {
 	int opt = (b ? 1 : 0);
 	return setOption(SO_BROADCAST, (const char*)&opt, sizeof(opt));
 }
 
+int SockRef::setNoDelay(bool b)
+{
+	int opt = (b ? 1 : 0);
+	int r = setOption(TCP_NODELAY, (const char*)&opt, sizeof(opt), IPPROTO_TCP);
+	if (r != SOCKET_ERROR)
+		_noDelayOpt = opt;
+	return r;
+}
+
+int SockRef::setCork(bool b)
+{
+	int opt = (b ? 1 : 0);
+#if defined(TCP_CORK)
+	int r = setOption(TCP_CORK, (const char*)&opt, sizeof(opt), IPPROTO_TCP);
+#elif defined(TCP_NOPUSH)
+	int r = setOption(TCP_NOPUSH, (const char*)&opt, sizeof(opt), IPPROTO_TCP);
+#else
+	int r = SOCKET_ERROR;
+#endif
+	if (r != SOCKET_ERROR)
+		_corked = b;
+	return r;
+}
+
+int SockRef::setQuickAck(bool b)
+{
+#ifdef TCP_QUICKACK
+	int opt = (b ? 1 : 0);
+	return setOption(TCP_QUICKACK, (const char*)&opt, sizeof(opt), IPPROTO_TCP);
+#else
+	return SOCKET_ERROR;
+#endif
+}
+
 int SockRef::setRecvTimeout(int seconds)
 {
 	struct timeval tv;
@@ -976,17 +1819,25 @@ int SockRef::getError()
 ///////////////////////////////////////////////////////////////////////////////
 // SockTcp
 //
+#define SOCKTCP_RECV_MIN	(1024 * 4)
+#define SOCKTCP_RECV_MAX	(1024 * 256)
+#define SOCKTCP_IOV_MAX		64
+#define SOCKTCP_FRAME_MAX	(1024 * 1024 * 16)
 
-SockTcp::SockTcp()
+SockTcp::SockTcp() : _recvSize(SOCKTCP_RECV_MIN)
 {
 	_recvBuf = new SockBuf();
 	_sendBuf = new SockBuf();
+	_sendBuf->_owner = this;
 }
 
 //----------------------------------------------------------------------------
 //
 SockTcp::~SockTcp()
 {
+	Resolver::cancel(_resolveId);
+	Util::delTimer(_connTimer);
+	raceStop();
 	delete _recvBuf;
 	delete _sendBuf;
 }
@@ -1006,7 +1857,13 @@ int SockTcp::create()
 //
 void SockTcp::close()
 {
+	Resolver::cancel(_resolveId);
+	_resolveId = 0;
+	Util::delTimer(_connTimer);
+	_connTimer = 0;
+	raceStop();
 	_sendBuf->reset();
+	_noDelay = false;
 	SockRef::close();
 }
 
@@ -1016,113 +1873,303 @@ int SockTcp::connect(const std::string& host, u16_t port)
 {
 	DBGLOG("%s{fd=%d}:connect(%s:%d)\n", SOCKLIB_TCP.c_str(), fd(), host.c_str(), port);
 
-	u32_t ip = Util::ips2n(host);
-	
-	return connect(ip, port);
-}
-
-//----------------------------------------------------------------------------
-//
-int SockTcp::connect(u32_t ip, u16_t port)
-{
-	sockaddr_in addr = { 0 };
-#ifndef _WIN32
-	addr.sin_len		 = sizeof(addr);
-#endif
-	addr.sin_family      = PF_INET;
-	addr.sin_addr.s_addr = ip;
-	addr.sin_port        = htons(port);
-	
-	return connect(&addr);
-}
-
-//----------------------------------------------------------------------------
-//
-int SockTcp::connect(const sockaddr_in* addr)
-{
-	if (fd() <= 0 && create() <= 0)
-		return -1;
+	Resolver::cancel(_resolveId);
+	_resolveId = 0;
 	
+	// once here, what is sent while resolving goes after the connect
 	_sendBuf->reset();
 	_recvBuf->reset();
 	
-	setNonBlock(true);
-
+	int err = 0;
+	Resolver::Addrs addrs;
+	if (Resolver::probe(host, addrs, &err))
+		return onResolve(port, err, addrs);
+	
+	// the fd is there already, so it's not closed while resolving
+	if (fd() <= 0 && create() <= 0)
+		return SOCKET_ERROR;
+	
 	_sockState = SockLib::STA_CONNECTTING;
+	connectTimer();
 	
-	int r = ::connect(fd(), (struct sockaddr*)addr, sizeof(*addr));
+	_resolveId = Resolver::resolve(host, [this, port](int err, const Resolver::Addrs& addrs) {
+		_resolveId = 0;
+		onResolve(port, err, addrs);
+	});
 	
-	if (SOCKET_ERROR == r) {
-		int err = getError();
-	#ifdef _WIN32
-		if (err != WSAEWOULDBLOCK && err != EALREADY) {
-	#else
-		if (err != EWOULDBLOCK && err != EINPROGRESS && err != EALREADY) {
-	#endif
-			_sockState = SockLib::STA_CONNFAILED;
-			onConnect(false);
-			close();
-			onClose();
-		} else {
-			SockLib::add(this, SockLib::EVT_ALL);
-			return r;
-		}
-	} else if (0 == r) {
-		_sockState = SockLib::STA_CONNECTED;
-		SockLib::add(this, SockLib::EVT_ALL);
-		onConnect(true);
-	}
-
-	return r;
+	return SOCKET_ERROR;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockTcp::bind(const std::string& ip, u16_t port)
+int SockTcp::onResolve(u16_t port, int err, const Resolver::Addrs& addrs)
 {
-	u32_t ipn = INADDR_ANY;
-	if (ip.length() > 0)
-		ipn = Util::ips2n(ip);
+	if (err) {
+		DBGLOG("%s{fd=%d}:resolve error: %d\n", SOCKLIB_TCP.c_str(), fd(), err);
+		connectFail();
+		return SOCKET_ERROR;
+	}
 	
-	return bind(ipn, port);
+	if (_raceDelay > 0 && addrs.size() > 1)
+		return raceStart(port, addrs);
+	
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	Util::ipn2addr(addrs[0], port, &addr);
+	
+	return connectTo(&addr);
 }
 
 //----------------------------------------------------------------------------
+// once per connect, from connect(host) or the first connect(addr)
 //
-int SockTcp::bind(u32_t ip, u16_t port)
+void SockTcp::connectTimer()
 {
-	sockaddr_in addr = { 0 };
-#ifndef _WIN32
-	addr.sin_len = sizeof(addr);
-#endif
-	addr.sin_family      = AF_INET;
-	addr.sin_addr.s_addr = ip;
-	addr.sin_port        = htons(port);
+	if (!_connTimeout || _connTimer)
+		return;
 	
-	return bind(&addr);
+	_connTimer = Util::setTimer(_connTimeout, [this](Timer&) {
+		_connTimer = 0;
+		DBGLOG("%s{fd=%d}:connect timeout\n", SOCKLIB_TCP.c_str(), fd());
+		connectFail();
+		return false;
+	}, 1);
 }
 
 //----------------------------------------------------------------------------
+// as dispatch() does for a failed connect
 //
-int SockTcp::bind(const sockaddr_in* addr)
+void SockTcp::connectFail()
 {
-	setReuseAddr(true);
-
-	return ::bind(fd(), (struct sockaddr*)addr, sizeof(*addr));
+	_sockState = SockLib::STA_CONNFAILED;
+	onConnect(false);
+	close();
+	onClose();
 }
 
 //----------------------------------------------------------------------------
+// this one keeps an fd not connected, so it's not closed during the race
 //
-int SockTcp::listen(int n)
+int SockTcp::raceStart(u16_t port, const std::vector<u32_t>& addrs)
 {
-	if (fd() <= 0)
-		return -1;
+	raceStop();
 	
-	DBGLOG("%s{fd=%d}:listen(%d)\n", SOCKLIB_TCP.c_str(), fd(), n);
+	if (fd() <= 0 && create() <= 0)
+		return SOCKET_ERROR;
+	
+	_sockState = SockLib::STA_CONNECTTING;
+	connectTimer();
+	
+	_racePort = port;
+	_raceAddrs.assign(addrs.rbegin(), addrs.rend());
+	
+	_raceTimer = Util::setTimer(_raceDelay, [this](Timer&) {
+		raceNext();
+		return true;
+	});
+	
+	raceNext();
+	
+	return SOCKET_ERROR;
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::raceNext()
+{
+	if (_raceAddrs.empty()) {
+		Util::delTimer(_raceTimer);
+		_raceTimer = 0;
+		return;
+	}
+	
+	u32_t ip = _raceAddrs.back();
+	_raceAddrs.pop_back();
+	
+	DBGLOG("%s{fd=%d}:race(%s:%d)\n", SOCKLIB_TCP.c_str(), fd(), Util::ipn2s(ip).c_str(), _racePort);
+	
+	SockTcp* sk = SockLib::createTcp();
+	sk->_onConnect = [this](SockTcp* sk, bool ok) { onRace(sk, ok); };
+	_races.push_back(sk);
+	
+	sk->connect(ip, _racePort);
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::raceStop()
+{
+	Util::delTimer(_raceTimer);
+	_raceTimer = 0;
+	_raceAddrs.clear();
+	
+	// ours only, without lua destroy() would leave them open
+	for (auto sk : _races) {
+		sk->_onConnect = nullptr;
+		sk->close();
+		SockLib::release(sk);
+	}
+	_races.clear();
+}
+
+//----------------------------------------------------------------------------
+// the winner's fd is moved here, its slot is taken over in beforePoll()
+//
+void SockTcp::onRace(SockTcp* sk, bool ok)
+{
+	auto it = std::find(_races.begin(), _races.end(), sk);
+	if (it == _races.end())
+		return;
+	_races.erase(it);
+	
+	if (!ok) {
+		sk->_onConnect = nullptr;
+		sk->close();
+		SockLib::release(sk);
+		
+		// don't wait for the delay
+		if (!_raceAddrs.empty())
+			raceNext();
+		else if (_races.empty())
+			connectFail();
+		return;
+	}
+	
+	int fd = sk->_fd;
+	sk->_fd = -1;
+	sk->_sockState = SockLib::STA_CLOSED;
+	sk->_onConnect = nullptr;
+	SockLib::release(sk);
+	
+	raceStop();
+	
+	// the placeholder
+	SockRef::close();
+	
+	_fd = fd;
+	_noDelay = false;
+	_sockState = SockLib::STA_CONNECTED;
+	SockLib::add(this, SockLib::EVT_ALL);
+	onConnect(true);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::connect(u32_t ip, u16_t port)
+{
+	sockaddr_in addr = { 0 };
+#ifndef _WIN32
+	addr.sin_len		 = sizeof(addr);
+#endif
+	addr.sin_family      = PF_INET;
+	addr.sin_addr.s_addr = ip;
+	addr.sin_port        = htons(port);
+	
+	return connect(&addr);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::connect(const sockaddr_in* addr)
+{
+	if (fd() <= 0 && create() <= 0)
+		return -1;
+	
+	_sendBuf->reset();
+	_recvBuf->reset();
+	
+	return connectTo(addr);
+}
+
+//----------------------------------------------------------------------------
+// connect(addr) keeping the buffers, for connect(host) when resolved
+//
+int SockTcp::connectTo(const sockaddr_in* addr)
+{
+	if (fd() <= 0 && create() <= 0)
+		return -1;
+	
+	setNonBlock(true);
+
+	_sockState = SockLib::STA_CONNECTTING;
+	connectTimer();
+	
+	int r = ::connect(fd(), (struct sockaddr*)addr, sizeof(*addr));
+	
+	if (SOCKET_ERROR == r) {
+		int err = getError();
+	#ifdef _WIN32
+		if (err != WSAEWOULDBLOCK && err != EALREADY) {
+	#else
+		if (err != EWOULDBLOCK && err != EINPROGRESS && err != EALREADY) {
+	#endif
+			_sockState = SockLib::STA_CONNFAILED;
+			onConnect(false);
+			close();
+			onClose();
+		} else {
+			SockLib::add(this, SockLib::EVT_ALL);
+			return r;
+		}
+	} else if (0 == r) {
+		_sockState = SockLib::STA_CONNECTED;
+		SockLib::add(this, SockLib::EVT_ALL);
+		onConnect(true);
+	}
+
+	return r;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::bind(const std::string& ip, u16_t port)
+{
+	u32_t ipn = INADDR_ANY;
+	if (ip.length() > 0)
+		ipn = Util::ips2n(ip);
+	
+	return bind(ipn, port);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::bind(u32_t ip, u16_t port)
+{
+	sockaddr_in addr = { 0 };
+#ifndef _WIN32
+	addr.sin_len = sizeof(addr);
+#endif
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = ip;
+	addr.sin_port        = htons(port);
+	
+	return bind(&addr);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::bind(const sockaddr_in* addr)
+{
+	setReuseAddr(true);
+
+	return ::bind(fd(), (struct sockaddr*)addr, sizeof(*addr));
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::listen(int n)
+{
+	if (fd() <= 0)
+		return -1;
+	
+	DBGLOG("%s{fd=%d}:listen(%d)\n", SOCKLIB_TCP.c_str(), fd(), n);
 
 	int r = ::listen(fd(), n);
 	
 	if (SOCKET_ERROR != r) {
+		// accept() until EAGAIN
+		if (_acceptBatch > 0)
+			setNonBlock(true);
 		_sockState = SockLib::STA_LISTENED;
 		SockLib::add(this, SockLib::EVT_RECV);
 	}
@@ -1130,6 +2177,47 @@ int SockTcp::listen(int n)
 	return r;
 }
 
+//----------------------------------------------------------------------------
+// sockets are opened here, so errors come back at once, but they are added
+// to the loops in their own threads
+//
+std::vector<SockTcp*> SockTcp::listenShards(const std::vector<SockLoop*>& loops,
+	const std::string& ip, u16_t port, const ON_SHARD_ACCEPT& onAccept, int logs)
+{
+	std::vector<SockTcp*> shards;
+	
+	for (size_t i = 0; i < loops.size(); ++i) {
+		SockTcp* sk = SockLib::createTcp();
+		if (!sk || sk->setReusePort(true) == SOCKET_ERROR || sk->bind(ip, port) == SOCKET_ERROR ||
+			::listen(sk->fd(), logs) == SOCKET_ERROR) {
+			DBGLOG("%s:listenShards(%s:%d) shard %d failed, errno=%d\n", SOCKLIB_TCP.c_str(), ip.c_str(), port, (int)i, errno);
+			delete sk;
+			for (auto& it : shards)
+				delete it;
+			shards.clear();
+			break;
+		}
+		
+		int shard = (int)i;
+		sk->setNonBlock(true);
+		sk->_sockState = SockLib::STA_LISTENED;
+		sk->_onAccept = [onAccept, shard](SockTcp* listener) {
+			onAccept(listener, shard);
+		};
+		shards.push_back(sk);
+	}
+	
+	for (size_t i = 0; i < shards.size(); ++i) {
+		SockLoop* loop = loops[i];
+		SockTcp* sk = shards[i];
+		loop->post([loop, sk] {
+			loop->add(sk, SockLib::EVT_RECV);
+		});
+	}
+	
+	return shards;
+}
+
 //----------------------------------------------------------------------------
 //
 int SockTcp::accept(sockaddr_in* addr)
@@ -1144,9 +2232,58 @@ int SockTcp::accept(sockaddr_in* addr)
 	return ::accept(fd(), (struct sockaddr*)addr, &len);
 }
 
-void SockTcp::acceptfd(int fd)
+//----------------------------------------------------------------------------
+// EINTR/ECONNABORTED: try next, EAGAIN: drained, EMFILE...: try in next poll
+//
+int SockTcp::accept(std::vector<SockTcp*>& socks, int max)
+{
+	int n = 0;
+	
+	while (n < max) {
+		sockaddr_in addr = { 0 };
+		socklen_t len = sizeof(addr);
+		
+	#if defined(__linux__) || defined(ANDROID)
+		int sfd = ::accept4(fd(), (struct sockaddr*)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		bool nonBlocking = true;
+	#else
+		int sfd = (int)::accept(fd(), (struct sockaddr*)&addr, &len);
+		bool nonBlocking = false;
+	#endif
+		
+		if (sfd < 0) {
+			int err = getError();
+			if (err == EINTR || err == ECONNABORTED)
+				continue;
+			DBGLOG_IF(err != EAGAIN && err != EWOULDBLOCK, "%s{fd=%d}:accept() failed, errno=%d\n", SOCKLIB_TCP.c_str(), fd(), err);
+			break;
+		}
+		
+		SockTcp* sk = new SockTcp();
+		sk->acceptfd(sfd, nonBlocking);
+		socks.push_back(sk);
+		++n;
+	}
+	
+	return n;
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::setAcceptBatch(int n)
+{
+	_acceptBatch = n;
+	if (n > 0 && _sockState == SockLib::STA_LISTENED)
+		setNonBlock(true);
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::acceptfd(int fd, bool nonBlocking)
 {
 	_fd = fd;
+	if (!nonBlocking)
+		setNonBlock(true);
 	_sockState = SockLib::STA_ACCEPTED;
 	SockLib::add(this, SockLib::EVT_ALL);
 }
@@ -1160,605 +2297,3251 @@ int SockTcp::send(const void* buf, u32_t len, int flags)
 
 //----------------------------------------------------------------------------
 //
-int SockTcp::recv(void* buf, u32_t len, int flags)
+int SockTcp::writev(const struct iovec* v, int n)
 {
-	return (int)::recv(fd(), (char*)buf, (size_t)len, flags);
+	if (n > SOCKTCP_IOV_MAX)
+		n = SOCKTCP_IOV_MAX;
+	
+#ifdef _WIN32
+	WSABUF bufs[SOCKTCP_IOV_MAX];
+	for (int i = 0; i < n; i++) {
+		bufs[i].buf = (char*)v[i].iov_base;
+		bufs[i].len = (ULONG)v[i].iov_len;
+	}
+	
+	DWORD sent = 0;
+	if (WSASend(fd(), bufs, n, &sent, 0, NULL, NULL) == SOCKET_ERROR)
+		return SOCKET_ERROR;
+	return (int)sent;
+#else
+	return (int)::writev(fd(), v, n);
+#endif
 }
 
 //----------------------------------------------------------------------------
+// pending data must go first, so gather sendBuf() + v into one writev()
 //
-bool SockTcp::careSend() {
-	return _sockState == SockLib::STA_CONNECTTING || _sendBuf->len() > 0;
+int SockTcp::sendv(const struct iovec* v, int n)
+{
+	if (isClosed())
+		return SOCKET_ERROR;
+	
+	u32_t total = 0;
+	for (int i = 0; i < n; i++)
+		total += (u32_t)v[i].iov_len;
+	
+	if (!checkCap(total))
+		return isClosed() ? SOCKET_ERROR : 0;
+	
+	u32_t sent = 0;
+	
+	bool connected = _sockState == SockLib::STA_CONNECTED || _sockState == SockLib::STA_ACCEPTED;
+	
+	if (total && connected && _sendMode != SEND_DEFER) {
+		struct iovec vs[SOCKTCP_IOV_MAX];
+		int c = _sendBuf->iov(vs, SOCKTCP_IOV_MAX);
+		u32_t pending = _sendBuf->len();
+		
+		// too many blocks pending, doSend() does the rest
+		for (int i = 0; i < c; i++)
+			pending -= (u32_t)vs[i].iov_len;
+		
+		if (!pending && c + n <= SOCKTCP_IOV_MAX) {
+			memcpy(vs + c, v, n * sizeof(struct iovec));
+			
+			// errors are left to doSend(), which closes the socket in poll
+			int len = writev(vs, c + n);
+			if (len > 0) {
+				u32_t queued = _sendBuf->len();
+				if ((u32_t)len <= queued) {
+					_sendBuf->discard(len);
+				} else {
+					_sendBuf->discard(queued);
+					sent = len - queued;
+				}
+			}
+		}
+	}
+	
+	// queue what's left
+	u32_t skip = sent;
+	for (int i = 0; i < n; i++) {
+		u32_t l = (u32_t)v[i].iov_len;
+		if (skip >= l) {
+			skip -= l;
+			continue;
+		}
+		_sendBuf->write((const u8_t*)v[i].iov_base + skip, l - skip);
+		skip = 0;
+	}
+	
+	if (_sendMode == SEND_DEFER && connected && _sendBuf->len())
+		SockLib::flushLater(this);
+	
+	if (_sendHigh && _sendBuf->len() >= _sendHigh)
+		_sendFull = true;
+	else
+		checkDrain();
+	
+	return total;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockTcp::getSockAddr(u32_t* ip, u16_t* port)
+int SockTcp::write(const void* data, u32_t len)
 {
-	sockaddr_in addr;
-	int r = getSockAddr(&addr);
-	if (r != SOCKET_ERROR) {
-		Util::addr2ipn(&addr, ip, port);
-	} else {
-		if (ip) *ip = 0;
-		if (port) *port = 0;
+	if (isClosed())
+		return SOCKET_ERROR;
+	
+	if (!checkCap(len))
+		return isClosed() ? SOCKET_ERROR : 0;
+	
+	bool connected = _sockState == SockLib::STA_CONNECTED || _sockState == SockLib::STA_ACCEPTED;
+	
+	// errors are left to doSend(), which closes the socket in poll
+	u32_t sent = 0;
+	if (_sendMode == SEND_DIRECT && connected && !_sendBuf->len()) {
+		int n = this->send(data, len);
+		if (n > 0)
+			sent = n;
+		if (sent == len) {
+			checkDrain();
+			return len;
+		}
 	}
-	return r;
+	
+	_sendBuf->write((const u8_t*)data + sent, len - sent);
+	
+	if (_sendMode == SEND_DEFER && connected)
+		SockLib::flushLater(this);
+	
+	if (_sendHigh && _sendBuf->len() >= _sendHigh)
+		_sendFull = true;
+	
+	return len;
 }
 
-int SockTcp::getSockAddr(std::string& ip, u16_t* port)
+//----------------------------------------------------------------------------
+//
+void SockTcp::setSendLimits(u32_t high, u32_t low, u32_t cap, bool dropOnCap)
 {
-	sockaddr_in addr;
-	int r = getSockAddr(&addr);
-	if (r != SOCKET_ERROR) {
-		Util::addr2ips(&addr, ip, port);
-	} else {
-		ip = "";
-		if (port) *port = 0;
+	_sendHigh = high;
+	_sendLow = low < high ? low : high / 2;
+	_sendCap = cap;
+	_sendDrop = dropOnCap;
+	
+	if (!_sendHigh)
+		_sendFull = false;
+}
+
+//----------------------------------------------------------------------------
+//
+u32_t SockTcp::pending() const
+{
+	return _sendBuf->len();
+}
+
+//----------------------------------------------------------------------------
+// false if len can't be queued, the socket may be closed
+//
+bool SockTcp::checkCap(u32_t len)
+{
+	if (!_sendCap || _sendBuf->len() + len <= _sendCap)
+		return true;
+	
+	DBGLOG("%s{fd=%d}:checkCap() %u + %u over cap, %s\n", SOCKLIB_TCP.c_str(), fd(),
+		_sendBuf->len(), len, _sendDrop ? "drop" : "close");
+	
+	if (!_sendDrop) {
+		close();
+		onClose();
 	}
-	return r;
+	return false;
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::checkDrain()
+{
+	if (_sendFull && _sendBuf->len() <= _sendLow) {
+		_sendFull = false;
+		onDrain();
+	}
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::recv(void* buf, u32_t len, int flags)
+{
+	return (int)::recv(fd(), (char*)buf, (size_t)len, flags);
+}
+
+//----------------------------------------------------------------------------
+//
+bool SockTcp::careSend() {
+	return _sockState == SockLib::STA_CONNECTTING || _sendBuf->len() > 0;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::getSockAddr(u32_t* ip, u16_t* port)
+{
+	sockaddr_in addr;
+	int r = getSockAddr(&addr);
+	if (r != SOCKET_ERROR) {
+		Util::addr2ipn(&addr, ip, port);
+	} else {
+		if (ip) *ip = 0;
+		if (port) *port = 0;
+	}
+	return r;
+}
+
+int SockTcp::getSockAddr(std::string& ip, u16_t* port)
+{
+	sockaddr_in addr;
+	int r = getSockAddr(&addr);
+	if (r != SOCKET_ERROR) {
+		Util::addr2ips(&addr, ip, port);
+	} else {
+		ip = "";
+		if (port) *port = 0;
+	}
+	return r;
+}
+
+int SockTcp::getSockAddr(sockaddr_in* addr)
+{
+	socklen_t addrlen = sizeof(sockaddr_in);
+	return ::getsockname(fd(), (struct sockaddr*)addr, &addrlen);
+}
+
+int SockTcp::getPeerAddr(u32_t* ip, u16_t* port)
+{
+	sockaddr_in addr;
+	int r = getPeerAddr(&addr);
+	if (r != SOCKET_ERROR) {
+		Util::addr2ipn(&addr, ip, port);
+	} else {
+		if (ip) *ip = 0;
+		if (port) *port = 0;
+	}
+	return r;
+}
+
+int SockTcp::getPeerAddr(std::string& ip, u16_t* port)
+{
+	sockaddr_in addr;
+	int r = getSockAddr(&addr);
+	if (r != SOCKET_ERROR) {
+		Util::addr2ips(&addr, ip, port);
+	} else {
+		ip = "";
+		if (port) *port = 0;
+	}
+	return r;
+}
+
+int SockTcp::getPeerAddr(sockaddr_in* addr)
+{
+	socklen_t addrlen = sizeof(sockaddr_in);
+	return ::getpeername(fd(), (struct sockaddr*)addr, &addrlen);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::doSend()
+{
+	int sentLen = 0;
+	while (!isClosed() && _sendBuf->len())
+    {
+		// all blocks in one call when sendBuf is in chain mode
+		struct iovec v[SOCKTCP_IOV_MAX];
+		int c = _sendBuf->iov(v, SOCKTCP_IOV_MAX);
+		u32_t want = 0;
+		for (int i = 0; i < c; i++)
+			want += (u32_t)v[i].iov_len;
+		
+        int len = c > 1 ? this->writev(v, c) : this->send(v[0].iov_base, want);
+        if (len > 0) {
+            _sendBuf->discard(len);
+			sentLen += len;
+			
+			// socket buffer is full
+			if ((u32_t)len < want)
+				break;
+        } else if (len < 0) {
+            int err = this->getError();
+		#ifdef _WIN32
+			if (err != WSAEWOULDBLOCK && err != EALREADY) {
+		#else
+			if (err != EWOULDBLOCK && err != EINPROGRESS && err != EALREADY) {
+		#endif
+                close();
+				onClose();
+                return -1;
+            }
+			break;
+        } else {
+            close();
+			onClose();
+            return -1;
+        }
+    }
+    
+	return sentLen;
+}
+
+//----------------------------------------------------------------------------
+// recv into _recvBuf directly, read more next time if it's filled up
+//
+int SockTcp::doRecv()
+{
+	int  recvLen = 0;
+    
+    while (!isClosed()) {
+		// ring is full, onRecv() takes data out. if it's still full here,
+		// a frame is bigger than the ring and never comes to the end
+		u32_t want = _recvBuf->room();
+		if (!want && !recvLen) {
+			DBGLOG("%s{fd=%d}:doRecv() recv ring is full\n", SOCKLIB_TCP.c_str(), fd());
+			close();
+			onClose();
+			return -1;
+		}
+		if (want > _recvSize)
+			want = _recvSize;
+		
+		u8_t* buf = want ? _recvBuf->reserve(want) : 0;
+		if (!buf)
+			break;
+		
+        int len = this->recv(buf, want);
+        if (len > 0) {
+			_recvBuf->commit(len);
+            recvLen += len;
+			
+			if ((u32_t)len == _recvSize && _recvSize < SOCKTCP_RECV_MAX)
+				_recvSize <<= 1;
+			else if ((u32_t)len < _recvSize / 4 && _recvSize > SOCKTCP_RECV_MIN)
+				_recvSize >>= 1;
+        } else if (len < 0) {
+            int err = getError();
+		#ifdef _WIN32
+			if (err != WSAEWOULDBLOCK && err != EALREADY) {
+		#else
+			if (err != EWOULDBLOCK && err != EINPROGRESS && err != EALREADY) {
+		#endif
+                close();
+				onClose();
+                return -1;
+            }
+			break;
+        } else {
+            close();
+			onClose();
+            return -1;
+        }
+    }
+
+	return recvLen;
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::onConnect(bool ok)
+{
+	DBGLOG("%s{fd=%d}:onConnect(%d)\n", SOCKLIB_TCP.c_str(), fd(), ok);
+	
+	Util::delTimer(_connTimer);
+	_connTimer = 0;
+	
+	if (_onConnect)
+		_onConnect(this, ok);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onConnect >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onConnect);
+		lua_pushboolean(L, ok);
+
+		int result = lua_pcall(L, 1, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onConnect event call error: %d", SOCKLIB_TCP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::onAccept()
+{
+	DBGLOG("%s{fd=%d}:onAccept()\n", SOCKLIB_TCP.c_str(), fd());
+	
+	if (_acceptBatch > 0) {
+		onAcceptBatch();
+		return;
+	}
+	
+	if (_onAccept)
+		_onAccept(this);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onAccept >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onAccept);
+		lua_newtable(L);
+
+		int result = lua_pcall(L, 1, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onAccept event call error: %d", SOCKLIB_TCP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+}
+
+//----------------------------------------------------------------------------
+// one callback for all connections accepted in this poll
+//
+void SockTcp::onAcceptBatch()
+{
+	std::vector<SockTcp*> socks;
+	if (accept(socks, _acceptBatch) <= 0)
+		return;
+	
+	if (_onAcceptBatch) {
+		_onAcceptBatch(this, socks);
+		return;
+	}
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onAccept >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onAccept);
+		lua_createtable(L, (int)socks.size(), 0);
+		for (size_t i = 0; i < socks.size(); ++i) {
+			LuaHelper::bind<SockTcp>(L, SOCKLIB_TCP, socks[i]);
+			lua_rawseti(L, -2, (int)i + 1);
+		}
+
+		int result = lua_pcall(L, 1, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onAccept event call error: %d", SOCKLIB_TCP.c_str(), result);
+		}
+		return;
+	}
+#endif // SOCKLIB_TO_LUA
+
+	// nobody wants them
+	for (auto& sk : socks)
+		SockLib::destroy(sk);
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::onRecv()
+{
+	int len = doRecv();
+	
+	if (isClosed() || len <= 0)
+		return;
+	
+	if (_frameHead && doFrames() < 0)
+		return;
+	
+	if (_onRecv)
+		_onRecv(this);
+
+//	DBGLOG("%s{fd=%d}:onRecv(%d)\n", SOCKLIB_TCP.c_str(), fd(), len);
+	
+#if SOCKLIB_TO_LUA
+	if (_mylua_onRecv >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onRecv);
+		lua_pushinteger(L, len);
+
+		int result = lua_pcall(L, 1, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onRecv event call error: %d", SOCKLIB_TCP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::setFraming(int headBytes, u32_t maxFrame, bool littleEndian)
+{
+	_frameHead = (headBytes == 2 || headBytes == 4) ? (u8_t)headBytes : 0;
+	_frameMax = maxFrame ? maxFrame : SOCKTCP_FRAME_MAX;
+	_frameLE = littleEndian;
+}
+
+//----------------------------------------------------------------------------
+// returns frames handled, -1 if closed
+//
+int SockTcp::doFrames()
+{
+	bool handled = _onFrame != nullptr;
+#if SOCKLIB_TO_LUA
+	handled = handled || _mylua_onFrame >= 0;
+#endif // SOCKLIB_TO_LUA
+	if (!handled)
+		return 0;
+	
+	int frames = 0;
+	
+	while (!isClosed() && _frameHead && _recvBuf->len() >= _frameHead) {
+		// the handlers may change them
+		u32_t head = _frameHead;
+		u32_t total = _recvBuf->len();
+		
+		u8_t h[4];
+		_recvBuf->peek(h, head);
+		
+		u32_t len;
+		if (head == 2)
+			len = _frameLE ? (h[0] | (h[1] << 8)) : ((h[0] << 8) | h[1]);
+		else if (_frameLE)
+			len = h[0] | (h[1] << 8) | (h[2] << 16) | ((u32_t)h[3] << 24);
+		else
+			len = ((u32_t)h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+		
+		if (len > _frameMax) {
+			DBGLOG("%s{fd=%d}:doFrames() frame too big: %u\n", SOCKLIB_TCP.c_str(), fd(), len);
+			close();
+			onClose();
+			return -1;
+		}
+		
+		if (total - head < len)
+			break;
+		
+		if (_onFrame) {
+			SockBuf frame;
+			_recvBuf->slice(frame, head, len);
+			_onFrame(this, frame);
+		}
+		
+	#if SOCKLIB_TO_LUA
+		if (_mylua_onFrame >= 0 && !isClosed()) {
+			SockBuf* frame = new SockBuf();
+			_recvBuf->slice(*frame, head, len);
+			
+			lua_State* L = SockLib::luaState();
+			lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onFrame);
+			LuaHelper::bind<SockBuf>(L, SOCKLIB_BUF, frame);
+
+			int result = lua_pcall(L, 1, 0, 0);
+			if (0 != result) {
+				luaL_error(L, "%s:onFrame event call error: %d", SOCKLIB_TCP.c_str(), result);
+			}
+		}
+	#endif // SOCKLIB_TO_LUA
+		
+		frames++;
+		
+		// recvBuf read by a handler: the stream is its own now
+		if (_recvBuf->len() != total)
+			break;
+		
+		_recvBuf->skip(head + len);
+	}
+	
+	// all taken, views keep the block and next recv gets a new one
+	if (!_recvBuf->len())
+		_recvBuf->discard(0);
+	
+	return isClosed() ? -1 : frames;
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::onSend()
+{
+	int len = doSend();
+	
+	if (isClosed() || len <= 0)
+		return;
+	
+	if (_onSend)
+		_onSend(this);
+
+	DBGLOG("%s{fd=%d}:onSend(%d)\n", SOCKLIB_TCP.c_str(), fd(), len);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onSend >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onSend);
+		lua_pushinteger(L, len);
+
+		int result = lua_pcall(L, 1, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onSend event call error: %d", SOCKLIB_TCP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+	
+	if (!isClosed())
+		checkDrain();
+}
+
+//----------------------------------------------------------------------------
+// SEND_DEFER: what's queued in this pass goes out together, and at once:
+// Nagle would hold it for the ack of the last flush, unless the user chose
+// with setNoDelay(). a cork of the user is lifted for the call and put back
+//
+void SockTcp::onFlush()
+{
+	if (!_sendBuf->len())
+		return;
+	
+	if (!_noDelay && _noDelayOpt < 0) {
+		int opt = 1;
+		setOption(TCP_NODELAY, (const char*)&opt, sizeof(opt), IPPROTO_TCP);
+		_noDelay = true;
+	}
+	
+	bool corked = _corked;
+	if (corked)
+		setCork(false);
+	
+	int r = doSend();
+	
+	if (corked && !isClosed())
+		setCork(true);
+	
+	if (r < 0 || isClosed())
+		return;
+	
+	checkDrain();
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::onDrain()
+{
+	if (_onDrain)
+		_onDrain(this);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onDrain >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onDrain);
+		lua_pushinteger(L, pending());
+
+		int result = lua_pcall(L, 1, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onDrain event call error: %d", SOCKLIB_TCP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::onClose()
+{
+//	DBGLOG("%s{fd=%d}:onClose()\n", SOCKLIB_TCP.c_str(), fd());
+	
+	if (_onClose)
+		_onClose(this);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onClose >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onClose);
+//		lua_newtable(L);
+
+		int result = lua_pcall(L, 0, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onClose event call error: %d", SOCKLIB_TCP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+}
+
+//----------------------------------------------------------------------------
+//
+void SockTcp::onPoll()
+{
+	if (_onPoll)
+		_onPoll(this);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onPoll >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onPoll);
+
+		int result = lua_pcall(L, 0, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onPoll event call error: %d", SOCKLIB_TCP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+}
+
+#if SOCKLIB_TO_LUA
+
+//----------------------------------------------------------------------------
+//
+SockTcp* SockTcp::mylua_this(lua_State* L, int idx)
+{
+	return LuaHelper::get<SockTcp>(L, SOCKLIB_TCP, idx);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_connect(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	
+	if (lua_isnumber(L, 2)) {
+		u32_t ip = (u32_t)lua_tonumber(L, 2);
+		u16_t port = (u16_t)luaL_checkinteger(L, 3);
+		
+		int n = _this->connect(ip, port);
+		
+		lua_pushinteger(L, n);
+	} else {
+		const char* host = luaL_checkstring(L, 2);
+		u16_t port = (u16_t)luaL_checkinteger(L, 3);
+		
+		int n = _this->connect(host, port);
+		
+		lua_pushinteger(L, n);
+	}
+
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+// listen(port)
+// listen(ip, port, logs, reuseport)
+//
+//	reuseport = true to listen the same port in every loop thread,
+//	each lua state gets its share of connections in its own ACCEPT event
+//
+int SockTcp::mylua_listen(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	
+	u16_t port;
+	int logs = 5;
+	const char* ip = 0;
+	bool reuseport = false;
+	
+	if (lua_gettop(L) == 2) {
+		port = (u16_t)luaL_checkinteger(L, 2);
+	} else if (lua_gettop(L) >= 3) {
+		ip = luaL_checkstring(L, 2);
+		port = (u16_t)luaL_checkinteger(L, 3);
+		if (lua_gettop(L) >= 4)
+			logs = (int)luaL_checkinteger(L, 4);
+		if (lua_gettop(L) >= 5)
+			reuseport = lua_toboolean(L, 5) != 0;
+	} else {
+		luaL_error(L, "%s.listen() bad data", SOCKLIB_TCP.c_str());
+		return 1;
+	}
+	
+	int r = _this->create();
+	if (SOCKET_ERROR == r) {
+		lua_pushvalue(L, 1);
+		lua_pushfstring(L, "create socket failed");
+		return 2;
+	}
+	
+	if (reuseport && SOCKET_ERROR == _this->setReusePort(true)) {
+		lua_pushvalue(L, 1);
+		lua_pushfstring(L, "reuseport is not supported");
+		return 2;
+	}
+	
+	if (ip && ip[0]) {
+		r = _this->bind(ip, port);
+		if (SOCKET_ERROR == r) {
+			lua_pushvalue(L, 1);
+			lua_pushfstring(L, "bind %s:%d failed", ip, port);
+			return 2;
+		}
+	} else {
+		r = _this->bind(port);
+		if (SOCKET_ERROR == r) {
+			lua_pushvalue(L, 1);
+			lua_pushfstring(L, "bind port %d failed", port);
+			return 2;
+		}
+	}
+
+	r = _this->listen(logs);
+	
+	if (SOCKET_ERROR == r) {
+		lua_pushvalue(L, 1);
+		lua_pushfstring(L, "listen in port %d failed", port);
+		return 2;
+	} else {
+		lua_pushvalue(L, 1);
+		lua_pushnil(L);
+		return 2;
+	}
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_accept(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	
+	sockaddr_in addr = { 0 };
+	
+	int fd = _this->accept(&addr);
+	
+	if (fd >= 0) {
+		SockTcp* obj = new SockTcp();
+		obj->acceptfd(fd);
+		return LuaHelper::bind<SockTcp>(L, SOCKLIB_TCP, obj);
+	}
+	
+	lua_pushnil(L);
+	
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_inbuf(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	
+	if (lua_istable(L, 1)) {
+//		lua_getfield(L, 1, "inbuf");
+//		if (!lua_isnil(L, -1))
+//			return 1;
+//		lua_pop(L, 1);
+		int r = LuaHelper::bind<SockBuf>(L, SOCKLIB_BUF, _this->recvBuf());
+		if (r) {
+			lua_pushvalue(L, -1);
+			lua_setfield(L, 1, "inbuf");
+		}
+		return r;
+	}
+	
+	return LuaHelper::bind<SockBuf>(L, SOCKLIB_BUF, _this->recvBuf());
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_outbuf(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	
+	if (lua_istable(L, 1)) {
+//		lua_getfield(L, 1, "outbuf");
+//		if (!lua_isnil(L, -1))
+//			return 1;
+//		lua_pop(L, 1);
+		int r = LuaHelper::bind<SockBuf>(L, SOCKLIB_BUF, _this->sendBuf());
+		if (r) {
+			lua_pushvalue(L, -1);
+			lua_setfield(L, 1, "outbuf");
+		}
+		return r;
+	}
+	
+	return LuaHelper::bind<SockBuf>(L, SOCKLIB_BUF, _this->sendBuf());
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_send(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	
+	void* ptr = 0;
+	u32_t len = 0;
+	
+	if (mylua_input_get(L, 2, ptr, len)) {
+		_this->write(ptr, len);
+	} else {
+		luaL_error(L, "%s:send(<unknown data>)", SOCKLIB_TCP.c_str());
+	}
+	
+	lua_pushvalue(L, 1);
+	
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+// tcp:sendv(head, body, ...), strings or bufs, bufs are not consumed
+//
+int SockTcp::mylua_sendv(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	
+	struct iovec v[SOCKTCP_IOV_MAX];
+	int n = 0;
+	
+	for (int i = 2; i <= lua_gettop(L); i++) {
+		if (n >= SOCKTCP_IOV_MAX) {
+			luaL_error(L, "%s:sendv() too many buffers", SOCKLIB_TCP.c_str());
+			return 0;
+		}
+		
+		if (lua_type(L, i) == LUA_TSTRING) {
+			size_t len = 0;
+			v[n].iov_base = (void*)lua_tolstring(L, i, &len);
+			v[n].iov_len = len;
+			n++;
+		} else if (lua_istable(L, i)) {
+			SockBuf* buf = SockBuf::mylua_this(L, i);
+			if (buf && buf->len()) {
+				int c = buf->iov(v + n, SOCKTCP_IOV_MAX - n);
+				u32_t len = 0;
+				for (int k = 0; k < c; k++)
+					len += (u32_t)v[n + k].iov_len;
+				
+				// too many blocks, make it flat
+				if (len < buf->len()) {
+					v[n].iov_base = buf->pos();
+					v[n].iov_len = buf->len();
+					c = 1;
+				}
+				n += c;
+			}
+		} else {
+			luaL_error(L, "%s:sendv(<unknown data>)", SOCKLIB_TCP.c_str());
+			return 0;
+		}
+	}
+	
+	_this->sendv(v, n);
+	
+	lua_pushvalue(L, 1);
+	
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_recv(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	return 0;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_close(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	_this->close();
+	return 0;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_isclosed(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	lua_pushboolean(L, _this->isClosed());
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+//
+static int SockRef_mylua_setopt(lua_State* L, SockRef* _this)
+{
+	int r = -1, n;
+	const char* key = luaL_checkstring(L, 2);
+	
+	if (0 == StrCmpI(key, SOCKOPT_BLOCKING)) {
+		n = lua_gettop(L) >= 3 ? luaL_optint(L, 3, 1) : 1;
+		r = _this->setBroadcast(n != 0);
+	} else if (0 == StrCmpI(key, SOCKOPT_REUSEADDR)) {
+		n = lua_gettop(L) >= 3 ? luaL_optint(L, 3, 1) : 1;
+		r = _this->setReuseAddr(n != 0);
+	} else if (0 == StrCmpI(key, SOCKOPT_NODELAY)) {
+		n = lua_gettop(L) >= 3 ? luaL_optint(L, 3, 1) : 1;
+		r = _this->setNoDelay(n != 0);
+	} else if (0 == StrCmpI(key, SOCKOPT_CORK)) {
+		n = lua_gettop(L) >= 3 ? luaL_optint(L, 3, 1) : 1;
+		r = _this->setCork(n != 0);
+	} else if (0 == StrCmpI(key, SOCKOPT_QUICKACK)) {
+		n = lua_gettop(L) >= 3 ? luaL_optint(L, 3, 1) : 1;
+		r = _this->setQuickAck(n != 0);
+	} else if (lua_gettop(L) >= 3 && lua_isnumber(L, 3)) {
+		n = luaL_optint(L, 3, 0);
+		
+		if (0 == StrCmpI(key, SOCKOPT_SENDBUFSIZE)) {
+			r = _this->setSendBufferSize(n);
+		} else if (0 == StrCmpI(key, SOCKOPT_RECVBUFSIZE)) {
+			r = _this->setRecvBufferSize(n);
+		} else if (0 == StrCmpI(key, SOCKOPT_SENDTIMEOUT)) {
+			r = _this->setSendTimeout(n);
+		} else if (0 == StrCmpI(key, SOCKOPT_RECVTIMEOUT)) {
+			r = _this->setRecvTimeout(n);
+		} else {
+			luaL_error(L, "setopt(BAD_KEY=%s)", key);
+			return 1;
+		}
+	} else {
+		luaL_error(L, "setopt(KEY=%s, bad params)", key);
+		return 1;
+	}
+	
+	DBGLOG("setopt(%s, %d)\n", key, n);
+	
+	//lua_pushboolean(L, r != SOCKET_ERROR);
+	
+	lua_pushvalue(L, 1);
+	
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+//	setopt(OPT.ACCEPTBATCH, n) accept n connections per poll at most, and
+//	ACCEPT event gets them in an array: function(socks) ... end
+//	setopt(OPT.FRAME, 2 or 4, [max], [little_endian]) FRAME event gets
+//	each body of [length][body]: function(buf) ... end
+//	setopt(OPT.WATERMARK, high, [low]) tcp.writable is false from high,
+//	DRAIN event comes at low: function(pending) ... end
+//	setopt(OPT.SENDCAP, bytes, [drop]) send() over it closes the socket,
+//	or drops the data
+//	setopt(OPT.SENDMODE, "POLL" or "DIRECT" or "DEFER") see SockTcp::SEND_*
+//	setopt(OPT.NODELAY / OPT.CORK / OPT.QUICKACK, [0 or 1]) TCP options
+//	setopt(OPT.CONNTIMEOUT, msec) CONNECT event gets false after it
+//	setopt(OPT.CONNRACE, [delay]) connect(host) races the resolved addrs,
+//	one more every delay msec (250), 0 to turn off
+//
+int SockTcp::mylua_setopt(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	const char* key = luaL_checkstring(L, 2);
+	
+	if (0 == StrCmpI(key, SOCKOPT_ACCEPTBATCH)) {
+		_this->setAcceptBatch(luaL_optint(L, 3, 64));
+		lua_pushvalue(L, 1);
+		return 1;
+	} else if (0 == StrCmpI(key, SOCKOPT_FRAME)) {
+		_this->setFraming(luaL_optint(L, 3, 4), (u32_t)luaL_optint(L, 4, 0), lua_toboolean(L, 5) != 0);
+		lua_pushvalue(L, 1);
+		return 1;
+	} else if (0 == StrCmpI(key, SOCKOPT_WATERMARK)) {
+		u32_t high = (u32_t)luaL_checkinteger(L, 3);
+		_this->setSendLimits(high, (u32_t)luaL_optint(L, 4, high / 2), _this->_sendCap, _this->_sendDrop);
+		lua_pushvalue(L, 1);
+		return 1;
+	} else if (0 == StrCmpI(key, SOCKOPT_SENDCAP)) {
+		_this->setSendLimits(_this->_sendHigh, _this->_sendLow, (u32_t)luaL_checkinteger(L, 3), lua_toboolean(L, 4) != 0);
+		lua_pushvalue(L, 1);
+		return 1;
+	} else if (0 == StrCmpI(key, SOCKOPT_SENDMODE)) {
+		const char* mode = luaL_checkstring(L, 3);
+		if (0 == StrCmpI(mode, "DIRECT"))
+			_this->setSendMode(SEND_DIRECT);
+		else if (0 == StrCmpI(mode, "DEFER"))
+			_this->setSendMode(SEND_DEFER);
+		else if (0 == StrCmpI(mode, "POLL"))
+			_this->setSendMode(SEND_POLL);
+		else
+			luaL_error(L, "setopt(%s, %s) bad mode", key, mode);
+		lua_pushvalue(L, 1);
+		return 1;
+	} else if (0 == StrCmpI(key, SOCKOPT_CONNTIMEOUT)) {
+		_this->setConnectTimeout((u32_t)luaL_checkinteger(L, 3));
+		lua_pushvalue(L, 1);
+		return 1;
+	} else if (0 == StrCmpI(key, SOCKOPT_CONNRACE)) {
+		_this->setConnectRace((u32_t)luaL_optint(L, 3, RACE_DELAY));
+		lua_pushvalue(L, 1);
+		return 1;
+	}
+	
+	return SockRef_mylua_setopt(L, _this);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_peeraddr(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+
+	std::string ip;
+	u16_t port;
+	
+	_this->getPeerAddr(ip, &port);
+	
+	lua_pushstring(L, ip.c_str());
+	lua_pushnumber(L, port);
+	
+	return 2;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_sockaddr(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+
+	std::string ip;
+	u16_t port;
+	
+	_this->getSockAddr(ip, &port);
+	
+	lua_pushstring(L, ip.c_str());
+	lua_pushnumber(L, port);
+	
+	return 2;
+}
+
+//----------------------------------------------------------------------------
+//
+#define SAFE_LUA_UNREF(n) \
+	if (n >= 0) { \
+		luaL_unref(L, LUA_REGISTRYINDEX, n); \
+		n = -1; \
+	}
+
+#define SAFE_LUA_REF(n, v) \
+	SAFE_LUA_UNREF(n); n = v;
+	
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_onevent(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	
+	const char* name = luaL_checkstring(L, 2);
+	
+	int handler = -1;
+	if (lua_gettop(L) >= 3) {
+		if (!lua_isfunction(L, -1)) {
+			luaL_error(L, "%s:onevent(%s, func) bad param", SOCKLIB_TCP.c_str(), name);
+			lua_pushvalue(L, 1);
+			return 1;
+		}
+		handler = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	if (StrCmpI(SOCKEVT_CONNECT, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onConnect, handler);
+	} else if (StrCmpI(SOCKEVT_RECV, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onRecv, handler);
+	} else if (StrCmpI(SOCKEVT_SEND, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onSend, handler);
+	} else if (StrCmpI(SOCKEVT_CLOSE, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onClose, handler);
+	} else if (StrCmpI(SOCKEVT_ACCEPT, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onAccept, handler);
+	} else if (StrCmpI(SOCKEVT_POLL, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onPoll, handler);
+		if (handler >= 0)
+			SockLib::addPoll(_this);
+		else
+			SockLib::removePoll(_this);
+	} else if (StrCmpI(SOCKEVT_FRAME, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onFrame, handler);
+	} else if (StrCmpI(SOCKEVT_DRAIN, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onDrain, handler);
+	} else {
+		luaL_error(L, "%s:onEevent(%s) not support!", SOCKLIB_TCP.c_str(), name);
+	}
+
+	DBGLOG("SockTcp::mylua_onevent(%s)\n", name);
+	
+	lua_pushvalue(L, 1);
+
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_index(lua_State* L)
+{
+//	SockTcp* _this = mylua_this(L);
+	const char* key = luaL_checkstring(L, 2);
+
+	DBGLOG("SockTcp::mylua_index(%s)\n", key);
+
+	lua_pushvalue(L, 1);
+	if (int r = LuaHelper::mylua_index_walk(L, key))
+		return r;
+
+	if (0 == NameStrCmp(key, "inbuf")) {
+		return mylua_inbuf(L);
+	} else if (0 == NameStrCmp(key, "outbuf")) {
+		return mylua_outbuf(L);
+	} else if (0 == NameStrCmp(key, "pending")) {
+		lua_pushinteger(L, mylua_this(L)->pending());
+		return 1;
+	} else if (0 == NameStrCmp(key, "writable")) {
+		lua_pushboolean(L, mylua_this(L)->writable());
+		return 1;
+	}
+	
+	lua_pushnil(L);
+	
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_gc(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	
+	if (LuaHelper::found(_this)) {
+		DBGLOG("%s{fd=%d}:mylua_gc() free\n", SOCKLIB_TCP.c_str(), _this->fd());
+		_this->close();
+		LuaHelper::remove(_this);
+		SockLib::destroy(_this);
+	} else {
+		DBGLOG("%s{fd=%d}:mylua_gc()\n", SOCKLIB_TCP.c_str(), _this->fd());
+	}
+	
+	SAFE_LUA_UNREF(_this->_mylua_onConnect);
+	SAFE_LUA_UNREF(_this->_mylua_onRecv);
+	SAFE_LUA_UNREF(_this->_mylua_onSend);
+	SAFE_LUA_UNREF(_this->_mylua_onAccept);
+	SAFE_LUA_UNREF(_this->_mylua_onClose);
+	SAFE_LUA_UNREF(_this->_mylua_onPoll);
+	SAFE_LUA_UNREF(_this->_mylua_onFrame);
+	SAFE_LUA_UNREF(_this->_mylua_onDrain);
+
+	return 0;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockTcp::mylua_tostring(lua_State* L)
+{
+	SockTcp* _this = mylua_this(L);
+	
+	lua_pushfstring(L, "%s{fd=%d}", SOCKLIB_TCP.c_str(), _this->fd());
+	
+	return 1;
+}
+
+#endif // SOCKLIB_TO_LUA
+
+///////////////////////////////////////////////////////////////////////////////
+// SockUdp
+//
+#define SOCKUDP_PACKET_MAX	(1024 * 8)
+#define SOCKUDP_BATCH_MAX	256
+
+#define SOCKUDP_GSO_SEGS	64
+#define SOCKUDP_GSO_MAX		(1024 * 63)	// a GSO send, under the 64KB of IP
+#define SOCKUDP_GRO_MAX		(1024 * 64)	// a GRO read
+#define SOCKUDP_GRO_BATCH	16
+
+#if defined(__linux__) || defined(ANDROID)
+	#define SOCKUDP_MMSG	1
+	#ifndef SOL_UDP
+		#define SOL_UDP		17
+	#endif
+	#ifndef UDP_SEGMENT
+		#define UDP_SEGMENT	103
+	#endif
+	#ifndef UDP_GRO
+		#define UDP_GRO		104
+	#endif
+#else
+	#define SOCKUDP_MMSG	0
+#endif
+
+//----------------------------------------------------------------------------
+//
+SockUdp::SockUdp()
+{
+}
+
+//----------------------------------------------------------------------------
+//
+SockUdp::~SockUdp()
+{
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::create()
+{
+	close();
+	_fd = ::socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	_sendQueue.clear();
+	_sendArena.clear();
+	return _fd;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::bind(const std::string& ip, u16_t port)
+{
+	u32_t ipn = INADDR_ANY;
+	if (ip.length() > 0)
+		ipn = Util::ips2n(ip);
+	
+	return bind(ipn, port);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::bind(u32_t ip, u16_t port)
+{
+	sockaddr_in addr = { 0 };
+#ifndef _WIN32
+	addr.sin_len = sizeof(addr);
+#endif
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = ip;
+	addr.sin_port        = htons(port);
+	
+	int r = bind(&addr);
+	
+	if (SOCKET_ERROR != r) {
+		_sockState = SockLib::STA_BINDED;
+		SockLib::add(this, SockLib::EVT_RECV);
+	}
+	
+	return r;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::bind(const sockaddr_in* addr)
+{
+	setReuseAddr(true);
+
+	return ::bind(fd(), (struct sockaddr*)addr, sizeof(*addr));
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::sendto(const std::string& host, u16_t port, const void* data, u32_t len)
+{
+	DBGLOG("%s{fd=%d}:sendto(%s:%d, %dbytes) free\n", SOCKLIB_UDP.c_str(), fd(), host.c_str(), port, len);
+	
+	u32_t ip = Util::ips2n(host.c_str());
+	
+	return sendto(ip, port, data, len);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::sendto(u32_t ip, u16_t port, const void* data, u32_t len)
+{
+	sockaddr_in addr = { 0 };
+#ifndef _WIN32
+	addr.sin_len	= sizeof(addr);
+#endif
+	addr.sin_family = PF_INET;
+	addr.sin_addr.s_addr = ip;
+	addr.sin_port        = htons(port);
+	
+	return sendto(&addr, data, len);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::sendto(const sockaddr_in* addr, const void* data, u32_t len)
+{
+	if (_gsoSize && len > _gsoSize) {
+		// keep the order
+		if (!_sendQueue.empty())
+			flush();
+		return sendSegments(addr, data, len, _gsoSize);
+	}
+	
+	if (_sendBatch > 0)
+		return queueTo(addr, data, len);
+	
+	return (int)::sendto(fd(), (char*)data, len, 0, (const struct sockaddr*)addr, sizeof(*addr));
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::recvfrom(void* data, u32_t len, u32_t* ip, u16_t* port)
+{
+	sockaddr_in addr;
+	int r = recvfrom(data, len, &addr);
+	if (r > 0) {
+		if (ip) *ip	= addr.sin_addr.s_addr;
+		if (port) *port	= ntohs(addr.sin_port);
+	} else {
+		if (ip) *ip = 0;
+		if (port) *port = 0;
+	}
+	return r;
+}
+
+int SockUdp::recvfrom(void* data, u32_t len, std::string& ip, u16_t* port)
+{
+	sockaddr_in addr;
+	int r = recvfrom(data, len, &addr);
+	if (r > 0) {
+		ip = Util::ipn2s(addr.sin_addr.s_addr);
+		if (port) *port	= ntohs(addr.sin_port);
+	} else {
+		ip = "";
+		if (port) *port = 0;
+	}
+	return r;
+}
+
+int SockUdp::recvfrom(void* data, u32_t len, sockaddr_in* addr)
+{
+	socklen_t addrlen = sizeof(sockaddr_in);
+	if (addr) {
+		return (int)::recvfrom(fd(), (char*)data, len, 0, (struct sockaddr*)addr, &addrlen);
+	} else {
+		sockaddr_in tmp = { 0 };
+		return (int)::recvfrom(fd(), (char*)data, len, 0, (struct sockaddr*)&tmp, &addrlen);
+	}
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::recvBatch(Packets& pkts, int max)
+{
+	pkts.clear();
+	
+	if (max > SOCKUDP_BATCH_MAX)
+		max = SOCKUDP_BATCH_MAX;
+	if (max <= 0)
+		return 0;
+	
+	u32_t size = _packetMax ? _packetMax : SOCKUDP_PACKET_MAX;
+	if (_gro && size < SOCKUDP_GRO_MAX)
+		size = SOCKUDP_GRO_MAX;
+	if (_recvArena.size() < (size_t)size * max)
+		_recvArena.resize((size_t)size * max);
+	u8_t* arena = &_recvArena[0];
+	
+#if SOCKUDP_MMSG
+	struct mmsghdr msgs[SOCKUDP_BATCH_MAX];
+	struct iovec iovs[SOCKUDP_BATCH_MAX];
+	sockaddr_in addrs[SOCKUDP_BATCH_MAX];
+	
+	// UDP_GRO tells the size of the datagrams coalesced
+	typedef char Ctrl[CMSG_SPACE(sizeof(int))];
+	Ctrl ctrls[SOCKUDP_GRO_BATCH];
+	if (_gro && max > SOCKUDP_GRO_BATCH)
+		max = SOCKUDP_GRO_BATCH;
+	
+	memset(msgs, 0, sizeof(msgs[0]) * max);
+	for (int i = 0; i < max; i++) {
+		iovs[i].iov_base = arena + (size_t)size * i;
+		iovs[i].iov_len = size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		if (_gro) {
+			msgs[i].msg_hdr.msg_control = ctrls[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctrls[i]);
+		}
+	}
+	
+	int n = ::recvmmsg(fd(), msgs, max, MSG_DONTWAIT, 0);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : SOCKET_ERROR;
+	
+	for (int i = 0; i < n; i++) {
+		u32_t len = msgs[i].msg_len;
+		u32_t seg = len;
+		
+		if (_gro) {
+			struct msghdr* mh = &msgs[i].msg_hdr;
+			for (struct cmsghdr* cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+				if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+					int gs;
+					memcpy(&gs, CMSG_DATA(cm), sizeof(gs));
+					if (gs > 0)
+						seg = gs;
+				}
+			}
+		}
+		
+		u32_t off = 0;
+		do {
+			Packet p;
+			p.data	= arena + (size_t)size * i + off;
+			p.len	= len - off < seg ? len - off : seg;
+			p.ip	= addrs[i].sin_addr.s_addr;
+			p.port	= ntohs(addrs[i].sin_port);
+			pkts.push_back(p);
+			off += seg;
+		} while (off < len);
+	}
+#else
+	// the first one is ready, the socket may be blocking: read more only
+	// when they are there
+	for (int i = 0; i < max; i++) {
+		if (i > 0) {
+			unsigned long avail = 0;
+			if (this->ioctl(FIONREAD, &avail) == SOCKET_ERROR || !avail)
+				break;
+		}
+		
+		sockaddr_in addr;
+		int r = recvfrom(arena + (size_t)size * i, size, &addr);
+		if (r < 0) {
+			if (i == 0)
+				return SOCKET_ERROR;
+			break;
+		}
+		
+		Packet p;
+		p.data	= arena + (size_t)size * i;
+		p.len	= r;
+		p.ip	= addr.sin_addr.s_addr;
+		p.port	= ntohs(addr.sin_port);
+		pkts.push_back(p);
+	}
+#endif // SOCKUDP_MMSG
+	
+	return (int)pkts.size();
+}
+
+//----------------------------------------------------------------------------
+//
+void SockUdp::setRecvBatch(int n, u32_t maxPacket)
+{
+	_recvBatch = n < SOCKUDP_BATCH_MAX ? n : SOCKUDP_BATCH_MAX;
+	_packetMax = maxPacket;
+	
+	if (n <= 0) {
+		_recvArena.clear();
+		_recvArena.shrink_to_fit();
+		_packets.clear();
+	}
+}
+
+//----------------------------------------------------------------------------
+//
+void SockUdp::setSendBatch(int n)
+{
+	_sendBatch = n < SOCKUDP_BATCH_MAX ? n : SOCKUDP_BATCH_MAX;
+	
+	if (n <= 0 && !_sendQueue.empty())
+		flush();
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::queueTo(const sockaddr_in* addr, const void* data, u32_t len)
+{
+	if (isClosed())
+		return SOCKET_ERROR;
+	
+	enqueue(addr, data, len);
+	
+	if (_sendQueue.size() >= (size_t)(_sendBatch > 0 ? _sendBatch : 1))
+		flush();
+	else if (_sendQueue.size() == 1)
+		SockLib::flushLater(this);
+	
+	return len;
+}
+
+//----------------------------------------------------------------------------
+//
+void SockUdp::enqueue(const sockaddr_in* addr, const void* data, u32_t len)
+{
+	Queued q;
+	q.addr	= *addr;
+	q.off	= (u32_t)_sendArena.size();
+	q.len	= len;
+	
+	_sendArena.insert(_sendArena.end(), (const u8_t*)data, (const u8_t*)data + len);
+	_sendQueue.push_back(q);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::flush()
+{
+	int count = (int)_sendQueue.size();
+	int sent = 0;
+	
+	if (!count || isClosed())
+		return 0;
+	
+	u8_t* arena = &_sendArena[0];
+	
+#if SOCKUDP_MMSG
+	struct mmsghdr msgs[SOCKUDP_BATCH_MAX];
+	struct iovec iovs[SOCKUDP_BATCH_MAX];
+	
+	for (int i = 0; i < count; ) {
+		int n = count - i < SOCKUDP_BATCH_MAX ? count - i : SOCKUDP_BATCH_MAX;
+		
+		memset(msgs, 0, sizeof(msgs[0]) * n);
+		for (int k = 0; k < n; k++) {
+			Queued& q = _sendQueue[i + k];
+			iovs[k].iov_base = arena + q.off;
+			iovs[k].iov_len = q.len;
+			msgs[k].msg_hdr.msg_iov = &iovs[k];
+			msgs[k].msg_hdr.msg_iovlen = 1;
+			msgs[k].msg_hdr.msg_name = &q.addr;
+			msgs[k].msg_hdr.msg_namelen = sizeof(q.addr);
+		}
+		
+		int r = ::sendmmsg(fd(), msgs, n, MSG_DONTWAIT);
+		if (r < 0) {
+			// full: drop the rest as the network would, else skip the bad one
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			i++;
+			continue;
+		}
+		
+		i += r;
+		sent += r;
+	}
+#else
+	for (int i = 0; i < count; i++) {
+		Queued& q = _sendQueue[i];
+		if (::sendto(fd(), (char*)arena + q.off, q.len, 0, (const struct sockaddr*)&q.addr, sizeof(q.addr)) >= 0)
+			sent++;
+	}
+#endif // SOCKUDP_MMSG
+	
+	DBGLOG_IF(sent < count, "%s{fd=%d}:flush() %d of %d dropped\n", SOCKLIB_UDP.c_str(), fd(), count - sent, count);
+	
+	_sendQueue.clear();
+	_sendArena.clear();
+	
+	return sent;
+}
+
+//----------------------------------------------------------------------------
+//
+void SockUdp::onFlush()
+{
+	flush();
+}
+
+//----------------------------------------------------------------------------
+// returns the bytes sent, SOCKET_ERROR if none. stops short when the socket
+// is full, the caller sends the rest; a segment that fails otherwise is
+// dropped and counted as sent, as flush() does
+//
+int SockUdp::sendSegments(const sockaddr_in* addr, const void* data, u32_t len, u32_t size)
+{
+	const u8_t* ptr = (const u8_t*)data;
+	u32_t sent = 0;
+	
+	if (!size || size > len)
+		size = len;
+	
+#if SOCKUDP_MMSG
+	// segments per call: the kernel takes 64 at most, and a 64KB datagram
+	u32_t segs = SOCKUDP_GSO_MAX / (size ? size : 1);
+	if (segs > SOCKUDP_GSO_SEGS)
+		segs = SOCKUDP_GSO_SEGS;
+	
+	while (!_gsoNone && segs > 1 && len - sent > size) {
+		u32_t chunk = len - sent < segs * size ? len - sent : segs * size;
+		
+		struct iovec iov;
+		iov.iov_base = (void*)(ptr + sent);
+		iov.iov_len = chunk;
+		
+		char ctrl[CMSG_SPACE(sizeof(u16_t))];
+		memset(ctrl, 0, sizeof(ctrl));
+		
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_name = (void*)addr;
+		mh.msg_namelen = sizeof(*addr);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = ctrl;
+		mh.msg_controllen = sizeof(ctrl);
+		
+		struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(u16_t));
+		u16_t gs = (u16_t)size;
+		memcpy(CMSG_DATA(cm), &gs, sizeof(gs));
+		
+		int r = (int)::sendmsg(fd(), &mh, MSG_DONTWAIT);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return sent ? (int)sent : SOCKET_ERROR;
+			// no GSO here, or the device can't
+			if (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+				DBGLOG("%s{fd=%d}:sendSegments() no GSO, errno=%d\n", SOCKLIB_UDP.c_str(), fd(), errno);
+				_gsoNone = true;
+				break;
+			}
+			return sent ? (int)sent : SOCKET_ERROR;
+		}
+		sent += r;
+	}
+#endif // SOCKUDP_MMSG
+	
+	while (sent < len) {
+		u32_t chunk = len - sent < size ? len - sent : size;
+		int r = (int)::sendto(fd(), (const char*)ptr + sent, chunk, 0, (const struct sockaddr*)addr, sizeof(*addr));
+		if (r < 0) {
+			int err = getError();
+			// full: the rest is the caller's, else skip the bad one as flush() does
+		#ifdef _WIN32
+			if (err == WSAEWOULDBLOCK)
+		#else
+			if (err == EAGAIN || err == EWOULDBLOCK)
+		#endif
+				return sent ? (int)sent : SOCKET_ERROR;
+			DBGLOG("%s{fd=%d}:sendSegments() %u bytes dropped, errno=%d\n", SOCKLIB_UDP.c_str(), fd(), chunk, err);
+		}
+		sent += chunk;
+	}
+	
+	return sent ? (int)sent : SOCKET_ERROR;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::setGro(bool b)
+{
+#if SOCKUDP_MMSG
+	int opt = (b ? 1 : 0);
+	int r = setOption(UDP_GRO, (const char*)&opt, sizeof(opt), SOL_UDP);
+	if (r == SOCKET_ERROR)
+		return r;
+	
+	_gro = b;
+	if (b && _recvBatch <= 0)
+		setRecvBatch(SOCKUDP_GRO_BATCH);
+	
+	return r;
+#else
+	return SOCKET_ERROR;
+#endif // SOCKUDP_MMSG
+}
+
+//----------------------------------------------------------------------------
+//
+void SockUdp::onRecv()
+{
+	DBGLOG("%s{fd=%d}:onRecv()\n", SOCKLIB_UDP.c_str(), fd());
+	
+	if (_recvBatch > 0) {
+		onRecvBatch();
+		return;
+	}
+	
+	if (_onRecv)
+		_onRecv(this);
+	
+#if SOCKLIB_TO_LUA
+	if (_mylua_onRecv >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onRecv);
+
+		int result = lua_pcall(L, 0, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onRecv event call error: %d", SOCKLIB_UDP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+}
+
+//----------------------------------------------------------------------------
+// one callback for the datagrams read in this poll
+//
+void SockUdp::onRecvBatch()
+{
+	int n = recvBatch(_packets, _recvBatch);
+	if (n <= 0)
+		return;
+	
+	if (_onRecvBatch)
+		_onRecvBatch(this, _packets);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onRecv >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onRecv);
+		
+		// flat, no table per datagram: {data, ip, port, data, ip, port, ...}
+		lua_createtable(L, n * 3, 0);
+		for (int i = 0; i < n; i++) {
+			const Packet& p = _packets[i];
+			lua_pushlstring(L, (const char*)p.data, p.len);
+			lua_rawseti(L, -2, i * 3 + 1);
+			lua_pushnumber(L, p.ip);
+			lua_rawseti(L, -2, i * 3 + 2);
+			lua_pushinteger(L, p.port);
+			lua_rawseti(L, -2, i * 3 + 3);
+		}
+		lua_pushinteger(L, n);
+
+		int result = lua_pcall(L, 2, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onRecv event call error: %d", SOCKLIB_UDP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+}
+
+//----------------------------------------------------------------------------
+//
+void SockUdp::onSend()
+{
+	if (_onSend)
+		_onSend(this);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onSend >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onSend);
+
+		int result = lua_pcall(L, 0, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onSend event call error: %d", SOCKLIB_UDP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+}
+
+//----------------------------------------------------------------------------
+//
+void SockUdp::onClose()
+{
+	DBGLOG("%s{fd=%d}:onClose()\n", SOCKLIB_UDP.c_str(), fd());
+	
+	if (_onClose)
+		_onClose(this);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onClose >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onClose);
+
+		int result = lua_pcall(L, 0, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onClose event call error: %d", SOCKLIB_UDP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+}
+
+//----------------------------------------------------------------------------
+//
+void SockUdp::onPoll()
+{
+	if (_onPoll)
+		_onPoll(this);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onPoll >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onPoll);
+
+		int result = lua_pcall(L, 0, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onPoll event call error: %d", SOCKLIB_UDP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
+}
+
+#if SOCKLIB_TO_LUA
+//----------------------------------------------------------------------------
+//
+SockUdp* SockUdp::mylua_this(lua_State* L, int idx)
+{
+	return LuaHelper::get<SockUdp>(L, SOCKLIB_UDP, idx);
+}
+
+//----------------------------------------------------------------------------
+// bind(port)
+// listen(ip, port)
+//
+int SockUdp::mylua_bind(lua_State* L)
+{
+	SockUdp* _this = mylua_this(L);
+	
+	u16_t port;
+	const char* ip = 0;
+	
+	if (lua_gettop(L) == 2) {
+		port = (u16_t)luaL_checkinteger(L, 2);
+	} else if (lua_gettop(L) >= 3) {
+		ip = luaL_checkstring(L, 2);
+		port = (u16_t)luaL_checkinteger(L, 3);
+	} else {
+		luaL_error(L, "%s.bind() bad data", SOCKLIB_UDP.c_str());
+		return 1;
+	}
+	
+	int r = _this->create();
+	if (SOCKET_ERROR == r) {
+		lua_pushvalue(L, 1);
+		lua_pushfstring(L, "create socket failed");
+		return 2;
+	}
+	
+	if (ip && ip[0]) {
+		r = _this->bind(ip, port);
+		if (SOCKET_ERROR == r) {
+			lua_pushvalue(L, 1);
+			lua_pushfstring(L, "bind %s:%d failed", ip, port);
+			return 2;
+		}
+	} else {
+		r = _this->bind(port);
+		if (SOCKET_ERROR == r) {
+			lua_pushvalue(L, 1);
+			lua_pushfstring(L, "bind port %d failed", port);
+			return 2;
+		}
+	}
+
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 2;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::mylua_sendto(lua_State* L)
+{
+	SockUdp* _this = mylua_this(L);
+	
+	const char* host = 0;
+	u32_t ip = 0;
+	
+	if (lua_isnumber(L, 2))
+		ip = (u32_t)lua_tonumber(L, 2);
+	else
+		host = luaL_checkstring(L, 2);
+	
+	u16_t port = (u16_t)luaL_checkinteger(L, 3);
+	
+	void* ptr = 0;
+	u32_t len = 0;
+	
+	int n = 0;
+	
+	if (mylua_input_get(L, 4, ptr, len)) {
+		if (ip > 0)
+			n = _this->sendto((u32_t)ip, port, ptr, len);
+		else if (host && host[0])
+			n = _this->sendto(std::string(host), port, ptr, len);
+	}
+	
+	lua_pushinteger(L, n);
+
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::mylua_recvfrom(lua_State* L)
+{
+	SockUdp* _this = mylua_this(L);
+	
+	std::string ip;
+	u16_t port;
+	
+	char buf[1024 * 8];
+	buf[0] = 0;
+	
+	int len = _this->recvfrom(buf, sizeof(buf), ip, &port);
+	if (len > 0)
+		buf[len] = 0;
+	
+	const char* fmt = 0;
+	if (lua_gettop(L) >= 2)
+		fmt = luaL_checkstring(L, 2);
+
+	int n = mylua_return_fmt(L, fmt, buf, len > 0 ? len : 0);
+	
+	if (n == 1) {
+		lua_pushnumber(L, len);
+	}
+	lua_pushstring(L, ip.c_str());
+	lua_pushnumber(L, port);
+	
+	return n + 2;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::mylua_close(lua_State* L)
+{
+	SockUdp* _this = mylua_this(L);
+	_this->close();
+	
+	return 0;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::mylua_onevent(lua_State* L)
+{
+	SockUdp* _this = mylua_this(L);
+	
+	const char* name = luaL_checkstring(L, 2);
+	
+	int handler = -1;
+	if (lua_gettop(L) >= 3) {
+		if (!lua_isfunction(L, -1)) {
+			luaL_error(L, "%s:onevent(%s, func) bad param", SOCKLIB_UDP.c_str(), name);
+			lua_pushvalue(L, 1);
+			return 1;
+		}
+		handler = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	if (StrCmpI(SOCKEVT_RECV, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onRecv, handler);
+	} else if (StrCmpI(SOCKEVT_SEND, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onSend, handler);
+	} else if (StrCmpI(SOCKEVT_CLOSE, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onClose, handler);
+	} else if (StrCmpI(SOCKEVT_POLL, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onPoll, handler);
+		if (handler >= 0)
+			SockLib::addPoll(_this);
+		else
+			SockLib::removePoll(_this);
+	} else {
+		luaL_error(L, "%s:onevent(%s) not support!", SOCKLIB_UDP.c_str(), name);
+	}
+	
+	lua_pushvalue(L, 1);
+	
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+//	setopt(OPT.RECVBATCH, n, [max_packet]) read n datagrams per poll at most,
+//	RECV event gets them in one flat array: function(pkts, n) ... end, with
+//	pkts[i*3-2], pkts[i*3-1], pkts[i*3] = data, ip (number), port
+//	setopt(OPT.SENDBATCH, n) sendto() queues, the queue goes out together
+//	at the end of the poll or once n queued, 0 to send at once
+//	setopt(OPT.GSO, size) sendto() of more than size bytes goes out as
+//	datagrams of size bytes, 0 to turn off
+//	setopt(OPT.GRO, [0 or 1]) read coalesced datagrams, turns RECVBATCH on,
+//	returns self, false if the kernel has no GRO
+//
+int SockUdp::mylua_setopt(lua_State* L)
+{
+	SockUdp* _this = mylua_this(L);
+	const char* key = luaL_checkstring(L, 2);
+	
+	if (0 == StrCmpI(key, SOCKOPT_RECVBATCH)) {
+		_this->setRecvBatch(luaL_optint(L, 3, 64), (u32_t)luaL_optint(L, 4, 0));
+		lua_pushvalue(L, 1);
+		return 1;
+	} else if (0 == StrCmpI(key, SOCKOPT_SENDBATCH)) {
+		_this->setSendBatch(luaL_optint(L, 3, 64));
+		lua_pushvalue(L, 1);
+		return 1;
+	} else if (0 == StrCmpI(key, SOCKOPT_GSO)) {
+		_this->setGso((u32_t)luaL_optint(L, 3, 0));
+		lua_pushvalue(L, 1);
+		return 1;
+	} else if (0 == StrCmpI(key, SOCKOPT_GRO)) {
+		int n = lua_gettop(L) >= 3 ? luaL_optint(L, 3, 1) : 1;
+		int r = _this->setGro(n != 0);
+		DBGLOG("setopt(%s, %d) = %d\n", key, n, r);
+		lua_pushvalue(L, 1);
+		lua_pushboolean(L, r != SOCKET_ERROR);
+		return 2;
+	}
+	
+	return SockRef_mylua_setopt(L, _this);
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::mylua_gc(lua_State* L)
+{
+	SockUdp* _this = mylua_this(L);
+	
+	if (LuaHelper::found(_this)) {
+		DBGLOG("%s{fd=%d}:mylua_gc() free\n", SOCKLIB_UDP.c_str(), _this->fd());
+		_this->close();
+		LuaHelper::remove(_this);
+		SockLib::destroy(_this);
+	} else {
+		DBGLOG("%s{fd=%d}:mylua_gc()\n", SOCKLIB_UDP.c_str(), _this->fd());
+	}
+	
+	SAFE_LUA_UNREF(_this->_mylua_onRecv);
+	SAFE_LUA_UNREF(_this->_mylua_onSend);
+	SAFE_LUA_UNREF(_this->_mylua_onClose);
+	SAFE_LUA_UNREF(_this->_mylua_onPoll);
+
+	return 0;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::mylua_tostring(lua_State* L)
+{
+	SockUdp* _this = mylua_this(L);
+	
+	lua_pushfstring(L, "%s{fd=%d}", SOCKLIB_UDP.c_str(), _this->fd());
+	
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockUdp::mylua_index(lua_State* L)
+{
+	const char* key = luaL_checkstring(L, 2);
+
+	DBGLOG("SockUdp:mylua_index(%s)\n", key);
+
+	lua_pushvalue(L, 1);
+	if (int r = LuaHelper::mylua_index_walk(L, key))
+		return r;
+	
+	lua_pushnil(L);
+	
+	return 1;
+}
+
+#endif // SOCKLIB_TO_LUA
+
+///////////////////////////////////////////////////////////////////////////////
+// SockRudp
+//
+#define SOCKRUDP_OVERHEAD		24
+#define SOCKRUDP_MTU			1400
+#define SOCKRUDP_WND_SND		32
+#define SOCKRUDP_WND_RCV		128		// a message is less segments than it
+#define SOCKRUDP_RTO_DEF		200
+#define SOCKRUDP_RTO_MIN		100
+#define SOCKRUDP_RTO_NODELAY	30
+#define SOCKRUDP_RTO_MAX		60000
+#define SOCKRUDP_INTERVAL		10
+#define SOCKRUDP_DEADLINK		20
+#define SOCKRUDP_IDLE			30000
+#define SOCKRUDP_THRESH_INIT	2
+#define SOCKRUDP_THRESH_MIN		2
+#define SOCKRUDP_PROBE_INIT		7000
+#define SOCKRUDP_PROBE_LIMIT	120000
+#define SOCKRUDP_FASTACK_LIMIT	5
+#define SOCKRUDP_RECV_BATCH		64
+
+#define SOCKRUDP_ASK_SEND		1
+#define SOCKRUDP_ASK_TELL		2
+
+static inline i32_t rudp_diff(u32_t later, u32_t earlier)
+{
+	return (i32_t)(later - earlier);
+}
+
+// little endian on the wire, as KCP
+static inline u8_t* rudp_enc32(u8_t* p, u32_t v)
+{
+	p[0] = (u8_t)v; p[1] = (u8_t)(v >> 8); p[2] = (u8_t)(v >> 16); p[3] = (u8_t)(v >> 24);
+	return p + 4;
+}
+
+static inline u32_t rudp_dec32(const u8_t* p)
+{
+	return (u32_t)p[0] | ((u32_t)p[1] << 8) | ((u32_t)p[2] << 16) | ((u32_t)p[3] << 24);
+}
+
+//----------------------------------------------------------------------------
+//
+SockRudp::SockRudp()
+	: _mtu(SOCKRUDP_MTU), _mss(SOCKRUDP_MTU - SOCKRUDP_OVERHEAD)
+	, _ssthresh(SOCKRUDP_THRESH_INIT), _rto(SOCKRUDP_RTO_DEF), _minRto(SOCKRUDP_RTO_MIN)
+	, _sndWnd(SOCKRUDP_WND_SND), _rcvWnd(SOCKRUDP_WND_RCV), _rmtWnd(SOCKRUDP_WND_RCV)
+	, _interval(SOCKRUDP_INTERVAL), _deadLink(SOCKRUDP_DEADLINK), _idle(SOCKRUDP_IDLE)
+{
+	memset(&_peer, 0, sizeof(_peer));
+}
+
+//----------------------------------------------------------------------------
+//
+SockRudp::~SockRudp()
+{
+	close();
+}
+
+//----------------------------------------------------------------------------
+//
+int SockRudp::connect(const std::string& host, u16_t port, u32_t conv)
+{
+	Resolver::cancel(_resolveId);
+	_resolveId = 0;
+	
+	int err = 0;
+	Resolver::Addrs addrs;
+	if (Resolver::probe(host, addrs, &err))
+		return err ? SOCKET_ERROR : connect(addrs[0], port, conv);
+	
+	_resolveId = Resolver::resolve(host, [this, port, conv](int err, const Resolver::Addrs& addrs) {
+		_resolveId = 0;
+		if (err || connect(addrs[0], port, conv) == SOCKET_ERROR)
+			onConnect(false);
+	});
+	
+	return 0;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockRudp::connect(u32_t ip, u16_t port, u32_t conv)
+{
+	if (create() <= 0 || bind((u32_t)INADDR_ANY, 0) == SOCKET_ERROR)
+		return SOCKET_ERROR;
+	
+	Util::ipn2addr(ip, port, &_peer);
+	
+	while (!conv)
+		conv = (u32_t)Util::nsec() ^ (u32_t)(size_t)this;
+	_conv = conv;
+	
+	// STA_BINDED till the answer, the poller knows nothing of it
+	_connecting = true;
+	start();
+	
+	_synSend = true;
+	_synTs = (u32_t)Util::tick() + _rto;
+	SockLib::flushLater(this);
+	
+	return 0;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockRudp::listen(const std::string& ip, u16_t port)
+{
+	if (create() <= 0 || bind(ip, port) == SOCKET_ERROR)
+		return SOCKET_ERROR;
+	
+	_listener = true;
+	
+	return 0;
 }
 
-int SockTcp::getSockAddr(sockaddr_in* addr)
+//----------------------------------------------------------------------------
+//
+int SockRudp::send(const void* data, u32_t len, bool reliable)
 {
-	socklen_t addrlen = sizeof(sockaddr_in);
-	return ::getsockname(fd(), (struct sockaddr*)addr, &addrlen);
+	if (isClosed() || _listener)
+		return SOCKET_ERROR;
+	
+	if (!reliable) {
+		if (len > _mss)
+			return SOCKET_ERROR;
+		_unreQueue.push_back(std::string((const char*)data, len));
+		SockLib::flushLater(this);
+		return len;
+	}
+	
+	u32_t count = len <= _mss ? 1 : (len + _mss - 1) / _mss;
+	if (count >= SOCKRUDP_WND_RCV)
+		return SOCKET_ERROR;
+	
+	const char* ptr = (const char*)data;
+	for (u32_t i = 0; i < count; i++) {
+		u32_t size = len > _mss ? _mss : len;
+		
+		Seg seg = Seg();
+		seg.data.assign(ptr, size);
+		seg.frg = (u8_t)(count - i - 1);
+		_sndQueue.push_back(std::move(seg));
+		
+		ptr += size;
+		len -= size;
+	}
+	
+	SockLib::flushLater(this);
+	
+	return (int)(ptr - (const char*)data);
 }
 
-int SockTcp::getPeerAddr(u32_t* ip, u16_t* port)
+//----------------------------------------------------------------------------
+//
+void SockRudp::setArq(int interval, int resend, bool nodelay, bool nocwnd)
 {
-	sockaddr_in addr;
-	int r = getPeerAddr(&addr);
-	if (r != SOCKET_ERROR) {
-		Util::addr2ipn(&addr, ip, port);
-	} else {
-		if (ip) *ip = 0;
-		if (port) *port = 0;
-	}
-	return r;
+	if (interval > 0)
+		_interval = interval < 5 ? 5 : (interval > 5000 ? 5000 : interval);
+	if (resend >= 0)
+		_fastResend = resend;
+	
+	_nodelay = nodelay;
+	_nocwnd = nocwnd;
+	_minRto = nodelay ? SOCKRUDP_RTO_NODELAY : SOCKRUDP_RTO_MIN;
 }
 
-int SockTcp::getPeerAddr(std::string& ip, u16_t* port)
+//----------------------------------------------------------------------------
+//
+void SockRudp::setWindow(u32_t sndWnd, u32_t rcvWnd)
 {
-	sockaddr_in addr;
-	int r = getSockAddr(&addr);
-	if (r != SOCKET_ERROR) {
-		Util::addr2ips(&addr, ip, port);
-	} else {
-		ip = "";
-		if (port) *port = 0;
-	}
-	return r;
+	if (sndWnd > 0)
+		_sndWnd = sndWnd;
+	// the peer's messages must fit in
+	if (rcvWnd > 0)
+		_rcvWnd = rcvWnd < SOCKRUDP_WND_RCV ? SOCKRUDP_WND_RCV : rcvWnd;
 }
 
-int SockTcp::getPeerAddr(sockaddr_in* addr)
+//----------------------------------------------------------------------------
+//
+int SockRudp::setMtu(u32_t mtu)
 {
-	socklen_t addrlen = sizeof(sockaddr_in);
-	return ::getpeername(fd(), (struct sockaddr*)addr, &addrlen);
+	if (mtu < 50 || mtu < SOCKRUDP_OVERHEAD)
+		return SOCKET_ERROR;
+	
+	_mtu = mtu;
+	_mss = mtu - SOCKRUDP_OVERHEAD;
+	
+	return 0;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockTcp::doSend()
+void SockRudp::getPeerAddr(std::string& ip, u16_t* port)
 {
-	int sentLen = 0;
-	while (!isClosed() && _sendBuf->len())
-    {
-        int len = this->send(_sendBuf->pos(), _sendBuf->len());
-        if (len > 0) {
-            _sendBuf->discard(len);
-			sentLen += len;
-        } else if (len < 0) {
-            int err = this->getError();
-		#ifdef _WIN32
-			if (err != WSAEWOULDBLOCK && err != EALREADY) {
-		#else
-			if (err != EWOULDBLOCK && err != EINPROGRESS && err != EALREADY) {
-		#endif
-                close();
-				onClose();
-                return -1;
-            }
-        } else {
-            close();
-			onClose();
-            return -1;
-        }
-    }
-    
-	return sentLen;
+	Util::addr2ips(&_peer, ip, port);
 }
 
 //----------------------------------------------------------------------------
+// tell the peer, then go
 //
-int SockTcp::doRecv()
+void SockRudp::close()
 {
-	int  recvLen = 0;
-    u8_t buf[1024 * 8];
-    
-    while (!isClosed()) {
-        int len = this->recv(buf, sizeof(buf));
-        if (len > 0) {
-            recvLen += _recvBuf->write(buf, len);
-        } else if (len < 0) {
-            int err = getError();
-		#ifdef _WIN32
-			if (err != WSAEWOULDBLOCK && err != EALREADY) {
-		#else
-			if (err != EWOULDBLOCK && err != EINPROGRESS && err != EALREADY) {
-		#endif
-                close();
-				onClose();
-                return -1;
-            }
-			break;
-        } else {
-            close();
-			onClose();
-            return -1;
-        }
-    }
-
-	return recvLen;
+	Resolver::cancel(_resolveId);
+	_resolveId = 0;
+	
+	bool connected = _sockState == SockLib::STA_CONNECTED || _sockState == SockLib::STA_ACCEPTED;
+	
+	if (connected && !_listener && fd() > 0) {
+		Seg seg = Seg();
+		seg.conv = _conv;
+		seg.cmd = CMD_FIN;
+		seg.una = _rcvNxt;
+		
+		_out.clear();
+		emit(seg, 0, 0);
+		emitOut();
+		transport()->flush();
+	}
+	
+	detach();
 }
 
 //----------------------------------------------------------------------------
+// new session: counters from zero, output() arms the timer
 //
-void SockTcp::onConnect(bool ok)
+void SockRudp::start()
 {
-	DBGLOG("%s{fd=%d}:onConnect(%d)\n", SOCKLIB_TCP.c_str(), fd(), ok);
+	_sndUna = _sndNxt = _rcvNxt = 0;
+	_srtt = _rttval = 0;
+	_rto = SOCKRUDP_RTO_DEF;
+	_ssthresh = SOCKRUDP_THRESH_INIT;
+	_rmtWnd = SOCKRUDP_WND_RCV;
+	_cwnd = 1;
+	_incr = 0;
+	_probe = _probeTs = _probeWait = 0;
+	_synSend = false;
+	_synTries = 0;
+	_rcvTs = (u32_t)Util::tick();
+	_keepTs = _rcvTs + _idle / 4;
 	
-	if (_onConnect)
-		_onConnect(this, ok);
-
-#if SOCKLIB_TO_LUA
-	if (_mylua_onConnect >= 0) {
-		lua_State* L = SockLib::luaState();
-		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onConnect);
-		lua_pushboolean(L, ok);
+	Util::delTimer(_timer);
+	_timer = 0;
+}
 
-		int result = lua_pcall(L, 1, 0, 0);
-		if (0 != result) {
-			luaL_error(L, "%s:onConnect event call error: %d", SOCKLIB_TCP.c_str(), result);
-		}
+//----------------------------------------------------------------------------
+// no more timer, queues or socket, the peer is not told
+//
+void SockRudp::detach()
+{
+	Util::delTimer(_timer);
+	_timer = 0;
+	_connecting = false;
+	
+	_sndQueue.clear();
+	_sndBuf.clear();
+	_rcvQueue.clear();
+	_rcvBuf.clear();
+	_acks.clear();
+	_unreQueue.clear();
+	_out.clear();
+	
+	if (_parent) {
+		// the socket is the listener's
+		_parent->_sessions.erase(peerKey(&_peer));
+		_parent = nullptr;
+		_sockState = SockLib::STA_CLOSED;
+		_fd = -1;
+		return;
 	}
-#endif // SOCKLIB_TO_LUA
+	
+	// sessions go with the listener's socket, without onClose()
+	std::unordered_map<u64_t, SockRudp*> sessions;
+	sessions.swap(_sessions);
+	for (auto& it : sessions)
+		it.second->detach();
+	
+	_listener = false;
+	SockUdp::close();
 }
 
 //----------------------------------------------------------------------------
+// the peer closed or is lost
 //
-void SockTcp::onAccept()
+void SockRudp::dead()
 {
-	DBGLOG("%s{fd=%d}:onAccept()\n", SOCKLIB_TCP.c_str(), fd());
+	DBGLOG("%s{fd=%d}:dead(conv=%u)\n", SOCKLIB_RUDP.c_str(), fd(), _conv);
 	
-	if (_onAccept)
-		_onAccept(this);
-
-#if SOCKLIB_TO_LUA
-	if (_mylua_onAccept >= 0) {
-		lua_State* L = SockLib::luaState();
-		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onAccept);
-		lua_newtable(L);
+	detach();
+	onClose();
+}
 
-		int result = lua_pcall(L, 1, 0, 0);
-		if (0 != result) {
-			luaL_error(L, "%s:onAccept event call error: %d", SOCKLIB_TCP.c_str(), result);
+//----------------------------------------------------------------------------
+//
+void SockRudp::update()
+{
+	u32_t now = (u32_t)Util::tick();
+	
+	if (_connecting && rudp_diff(now, _synTs) >= 0) {
+		if (++_synTries >= _deadLink) {
+			detach();
+			onConnect(false);
+			return;
+		}
+		_synSend = true;
+		u32_t wait = _rto << (_synTries < 4 ? _synTries : 4);
+		_synTs = now + (wait < 1000 ? wait : 1000);
+	} else if (!_connecting && _idle) {
+		if (rudp_diff(now, _rcvTs + _idle) >= 0) {
+			dead();
+			return;
+		}
+		if (rudp_diff(now, _keepTs) >= 0) {
+			_probe |= SOCKRUDP_ASK_SEND;
+			_keepTs = now + _idle / 4;
 		}
 	}
-#endif // SOCKLIB_TO_LUA
+	
+	output();
 }
 
 //----------------------------------------------------------------------------
+// one timer for what is due first, as ikcp_check(): the next SYN, a resend,
+// a window probe or the idle check, no sooner than interval
 //
-void SockTcp::onRecv()
+void SockRudp::schedule()
 {
-	int len = doRecv();
+	if (isClosed() || _listener)
+		return;
 	
-	if (isClosed() || len <= 0)
+	u32_t now = (u32_t)Util::tick();
+	i32_t wait = -1;
+	
+	auto due = [&wait, now](u32_t ts) {
+		i32_t d = rudp_diff(ts, now);
+		if (wait < 0 || d < wait)
+			wait = d < 0 ? 0 : d;
+	};
+	
+	if (_connecting) {
+		due(_synTs);
+	} else if (_idle) {
+		due(_keepTs);
+		due(_rcvTs + _idle);
+	}
+	for (auto& s : _sndBuf)
+		due(s.resendts);
+	if (_rmtWnd == 0 && _probeWait)
+		due(_probeTs);
+	
+	if (wait < 0)
 		return;
+	if (wait < (i32_t)_interval)
+		wait = _interval;
 	
-	if (_onRecv)
-		_onRecv(this);
-
-//	DBGLOG("%s{fd=%d}:onRecv(%d)\n", SOCKLIB_TCP.c_str(), fd(), len);
+	// the armed one comes first
+	u32_t ts = now + wait;
+	if (_timer && rudp_diff(ts, _timerTs) >= 0)
+		return;
 	
-#if SOCKLIB_TO_LUA
-	if (_mylua_onRecv >= 0) {
-		lua_State* L = SockLib::luaState();
-		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onRecv);
-		lua_pushinteger(L, len);
+	Util::delTimer(_timer);
+	_timerTs = ts;
+	_timer = Util::setTimer(wait, [this](Timer&) {
+		_timer = 0;
+		update();
+		return false;
+	});
+}
 
-		int result = lua_pcall(L, 1, 0, 0);
-		if (0 != result) {
-			luaL_error(L, "%s:onRecv event call error: %d", SOCKLIB_TCP.c_str(), result);
-		}
-	}
-#endif // SOCKLIB_TO_LUA
+//----------------------------------------------------------------------------
+//
+u16_t SockRudp::wndUnused() const
+{
+	u32_t n = (u32_t)_rcvQueue.size();
+	return n < _rcvWnd ? (u16_t)(_rcvWnd - n < 0xffff ? _rcvWnd - n : 0xffff) : 0;
 }
 
 //----------------------------------------------------------------------------
+// one segment into _out, _out goes as a datagram when the next one won't fit
 //
-void SockTcp::onSend()
+void SockRudp::emit(const Seg& seg, const void* data, u32_t len)
 {
-	int len = doSend();
+	if (_out.size() + SOCKRUDP_OVERHEAD + len > _mtu)
+		emitOut();
 	
-	if (isClosed() || len <= 0)
-		return;
+	u8_t h[SOCKRUDP_OVERHEAD];
+	u8_t* p = rudp_enc32(h, seg.conv);
+	*p++ = seg.cmd;
+	*p++ = seg.frg;
+	*p++ = (u8_t)seg.wnd;
+	*p++ = (u8_t)(seg.wnd >> 8);
+	p = rudp_enc32(p, seg.ts);
+	p = rudp_enc32(p, seg.sn);
+	p = rudp_enc32(p, seg.una);
+	rudp_enc32(p, len);
 	
-	if (_onSend)
-		_onSend(this);
-
-	DBGLOG("%s{fd=%d}:onSend(%d)\n", SOCKLIB_TCP.c_str(), fd(), len);
+	_out.append((const char*)h, SOCKRUDP_OVERHEAD);
+	if (len)
+		_out.append((const char*)data, len);
+}
 
-#if SOCKLIB_TO_LUA
-	if (_mylua_onSend >= 0) {
-		lua_State* L = SockLib::luaState();
-		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onSend);
-		lua_pushinteger(L, len);
+//----------------------------------------------------------------------------
+//
+void SockRudp::emitOut()
+{
+	if (_out.empty())
+		return;
+	
+	transport()->enqueue(&_peer, _out.data(), (u32_t)_out.size());
+	_out.clear();
+}
 
-		int result = lua_pcall(L, 1, 0, 0);
-		if (0 != result) {
-			luaL_error(L, "%s:onSend event call error: %d", SOCKLIB_TCP.c_str(), result);
+//----------------------------------------------------------------------------
+// send what is due: SYN, acks, window probes, unreliable data, new and
+// retransmitted segments, all in as few datagrams as they fit
+//
+void SockRudp::output()
+{
+	if (isClosed() || _listener)
+		return;
+	
+	u32_t now = (u32_t)Util::tick();
+	
+	Seg seg = Seg();
+	seg.conv = _conv;
+	seg.wnd = wndUnused();
+	seg.una = _rcvNxt;
+	
+	if (_synSend) {
+		_synSend = false;
+		seg.cmd = CMD_SYN;
+		emit(seg, 0, 0);
+	}
+	
+	seg.cmd = CMD_ACK;
+	for (auto& ack : _acks) {
+		seg.sn = ack.first;
+		seg.ts = ack.second;
+		emit(seg, 0, 0);
+	}
+	_acks.clear();
+	seg.sn = seg.ts = 0;
+	
+	// the peer's window is full, ask it now and then
+	if (_rmtWnd == 0) {
+		if (_probeWait == 0) {
+			_probeWait = SOCKRUDP_PROBE_INIT;
+			_probeTs = now + _probeWait;
+		} else if (rudp_diff(now, _probeTs) >= 0) {
+			_probeWait += _probeWait / 2;
+			if (_probeWait > SOCKRUDP_PROBE_LIMIT)
+				_probeWait = SOCKRUDP_PROBE_LIMIT;
+			_probeTs = now + _probeWait;
+			_probe |= SOCKRUDP_ASK_SEND;
 		}
+	} else {
+		_probeTs = 0;
+		_probeWait = 0;
 	}
-#endif // SOCKLIB_TO_LUA
+	
+	if (_probe & SOCKRUDP_ASK_SEND) {
+		seg.cmd = CMD_WASK;
+		emit(seg, 0, 0);
+	}
+	if (_probe & SOCKRUDP_ASK_TELL) {
+		seg.cmd = CMD_WINS;
+		emit(seg, 0, 0);
+	}
+	_probe = 0;
+	
+	seg.cmd = CMD_UNRE;
+	seg.ts = now;
+	for (auto& data : _unreQueue)
+		emit(seg, data.data(), (u32_t)data.size());
+	_unreQueue.clear();
+	
+	bool connected = _sockState == SockLib::STA_CONNECTED || _sockState == SockLib::STA_ACCEPTED;
+	bool lost = false, change = false, deadLink = false;
+	
+	u32_t cwnd = _sndWnd < _rmtWnd ? _sndWnd : _rmtWnd;
+	if (!_nocwnd && _cwnd < cwnd)
+		cwnd = _cwnd;
+	
+	if (connected) {
+		// into the window
+		while (!_sndQueue.empty() && rudp_diff(_sndNxt, _sndUna + cwnd) < 0) {
+			Seg& s = _sndQueue.front();
+			s.conv		= _conv;
+			s.cmd		= CMD_PUSH;
+			s.sn		= _sndNxt++;
+			s.resendts	= now;
+			s.rto		= _rto;
+			s.fastack	= 0;
+			s.xmit		= 0;
+			_sndBuf.push_back(std::move(s));
+			_sndQueue.pop_front();
+		}
+		
+		u32_t resent = _fastResend > 0 ? _fastResend : 0xffffffff;
+		u32_t rtomin = _nodelay ? 0 : (_rto >> 3);
+		
+		for (auto& s : _sndBuf) {
+			bool need = false;
+			
+			if (s.xmit == 0) {
+				need = true;
+				s.rto = _rto;
+				s.resendts = now + s.rto + rtomin;
+			} else if (rudp_diff(now, s.resendts) >= 0) {
+				// timeout
+				need = true;
+				s.rto += _nodelay ? s.rto / 2 : (s.rto > _rto ? s.rto : _rto);
+				if (s.rto > SOCKRUDP_RTO_MAX)
+					s.rto = SOCKRUDP_RTO_MAX;
+				s.resendts = now + s.rto;
+				lost = true;
+			} else if (s.fastack >= resent && s.xmit <= SOCKRUDP_FASTACK_LIMIT) {
+				// later ones are acked
+				need = true;
+				s.fastack = 0;
+				s.resendts = now + s.rto;
+				change = true;
+			}
+			
+			if (need) {
+				s.xmit++;
+				s.ts = now;
+				s.wnd = seg.wnd;
+				s.una = _rcvNxt;
+				emit(s, s.data.data(), (u32_t)s.data.size());
+				if (s.xmit >= _deadLink)
+					deadLink = true;
+			}
+		}
+	}
+	
+	emitOut();
+	transport()->flush();
+	
+	if (deadLink) {
+		dead();
+		return;
+	}
+	
+	if (change) {
+		u32_t inflight = _sndNxt - _sndUna;
+		_ssthresh = inflight / 2;
+		if (_ssthresh < SOCKRUDP_THRESH_MIN)
+			_ssthresh = SOCKRUDP_THRESH_MIN;
+		_cwnd = _ssthresh + (_fastResend > 0 ? _fastResend : 0);
+		_incr = _cwnd * _mss;
+	}
+	
+	if (lost) {
+		_ssthresh = cwnd / 2;
+		if (_ssthresh < SOCKRUDP_THRESH_MIN)
+			_ssthresh = SOCKRUDP_THRESH_MIN;
+		_cwnd = 1;
+		_incr = _mss;
+	}
+	
+	if (_cwnd < 1) {
+		_cwnd = 1;
+		_incr = _mss;
+	}
+	
+	schedule();
 }
 
 //----------------------------------------------------------------------------
 //
-void SockTcp::onClose()
+void SockRudp::updateAck(i32_t rtt)
 {
-//	DBGLOG("%s{fd=%d}:onClose()\n", SOCKLIB_TCP.c_str(), fd());
+	if (_srtt == 0) {
+		_srtt = rtt;
+		_rttval = rtt / 2;
+	} else {
+		i32_t delta = rtt - (i32_t)_srtt;
+		if (delta < 0)
+			delta = -delta;
+		_rttval = (3 * _rttval + delta) / 4;
+		_srtt = (7 * _srtt + rtt) / 8;
+		if (_srtt < 1)
+			_srtt = 1;
+	}
 	
-	if (_onClose)
-		_onClose(this);
-
-#if SOCKLIB_TO_LUA
-	if (_mylua_onClose >= 0) {
-		lua_State* L = SockLib::luaState();
-		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onClose);
-//		lua_newtable(L);
+	u32_t rto = _srtt + (_interval > 4 * _rttval ? _interval : 4 * _rttval);
+	_rto = rto < _minRto ? _minRto : (rto > SOCKRUDP_RTO_MAX ? SOCKRUDP_RTO_MAX : rto);
+}
 
-		int result = lua_pcall(L, 0, 0, 0);
-		if (0 != result) {
-			luaL_error(L, "%s:onClose event call error: %d", SOCKLIB_TCP.c_str(), result);
-		}
-	}
-#endif // SOCKLIB_TO_LUA
+//----------------------------------------------------------------------------
+//
+void SockRudp::parseUna(u32_t una)
+{
+	while (!_sndBuf.empty() && rudp_diff(una, _sndBuf.front().sn) > 0)
+		_sndBuf.pop_front();
+	
+	_sndUna = _sndBuf.empty() ? _sndNxt : _sndBuf.front().sn;
 }
 
 //----------------------------------------------------------------------------
 //
-void SockTcp::onPoll()
+void SockRudp::parseAck(u32_t sn)
 {
-	if (_onPoll)
-		_onPoll(this);
-
-#if SOCKLIB_TO_LUA
-	if (_mylua_onPoll >= 0) {
-		lua_State* L = SockLib::luaState();
-		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onPoll);
-
-		int result = lua_pcall(L, 0, 0, 0);
-		if (0 != result) {
-			luaL_error(L, "%s:onPoll event call error: %d", SOCKLIB_TCP.c_str(), result);
+	if (rudp_diff(sn, _sndUna) < 0 || rudp_diff(sn, _sndNxt) >= 0)
+		return;
+	
+	for (auto it = _sndBuf.begin(); it != _sndBuf.end(); ++it) {
+		if (it->sn == sn) {
+			_sndBuf.erase(it);
+			break;
 		}
+		if (rudp_diff(sn, it->sn) < 0)
+			break;
 	}
-#endif // SOCKLIB_TO_LUA
+	
+	_sndUna = _sndBuf.empty() ? _sndNxt : _sndBuf.front().sn;
 }
 
-#if SOCKLIB_TO_LUA
+//----------------------------------------------------------------------------
+// segments before the latest acked one were skipped once more
+//
+void SockRudp::parseFastack(u32_t sn)
+{
+	if (rudp_diff(sn, _sndUna) < 0 || rudp_diff(sn, _sndNxt) >= 0)
+		return;
+	
+	for (auto& s : _sndBuf) {
+		if (rudp_diff(sn, s.sn) < 0)
+			break;
+		if (sn != s.sn)
+			s.fastack++;
+	}
+}
 
 //----------------------------------------------------------------------------
 //
-SockTcp* SockTcp::mylua_this(lua_State* L, int idx)
+void SockRudp::parseData(Seg& seg)
 {
-	return LuaHelper::get<SockTcp>(L, SOCKLIB_TCP, idx);
+	u32_t sn = seg.sn;
+	
+	if (rudp_diff(sn, _rcvNxt + _rcvWnd) >= 0 || rudp_diff(sn, _rcvNxt) < 0)
+		return;
+	
+	// in order of sn, from the tail as most come in order
+	auto it = _rcvBuf.end();
+	while (it != _rcvBuf.begin()) {
+		auto prev = it - 1;
+		if (prev->sn == sn)
+			return;
+		if (rudp_diff(sn, prev->sn) > 0)
+			break;
+		it = prev;
+	}
+	_rcvBuf.insert(it, std::move(seg));
+	
+	while (!_rcvBuf.empty() && _rcvBuf.front().sn == _rcvNxt && _rcvQueue.size() < _rcvWnd) {
+		_rcvQueue.push_back(std::move(_rcvBuf.front()));
+		_rcvBuf.pop_front();
+		_rcvNxt++;
+	}
 }
 
 //----------------------------------------------------------------------------
+// whole messages in _rcvQueue to onMessage()
 //
-int SockTcp::mylua_connect(lua_State* L)
+void SockRudp::deliver()
 {
-	SockTcp* _this = mylua_this(L);
+	bool recover = _rcvQueue.size() >= _rcvWnd;
 	
-	if (lua_isnumber(L, 2)) {
-		u32_t ip = (u32_t)lua_tonumber(L, 2);
-		u16_t port = (u16_t)luaL_checkinteger(L, 3);
-		
-		int n = _this->connect(ip, port);
-		
-		lua_pushinteger(L, n);
-	} else {
-		const char* host = luaL_checkstring(L, 2);
-		u16_t port = (u16_t)luaL_checkinteger(L, 3);
+	while (!isClosed() && !_rcvQueue.empty()) {
+		u32_t frg = _rcvQueue.front().frg;
+		if (_rcvQueue.size() < frg + 1)
+			break;
 		
-		int n = _this->connect(host, port);
+		_msg.clear();
+		for (u32_t i = 0; i <= frg; i++) {
+			_msg.append(_rcvQueue.front().data);
+			_rcvQueue.pop_front();
+		}
 		
-		lua_pushinteger(L, n);
+		onMessage((const u8_t*)_msg.data(), (u32_t)_msg.size(), true);
 	}
-
-	return 1;
+	
+	if (isClosed())
+		return;
+	
+	while (!_rcvBuf.empty() && _rcvBuf.front().sn == _rcvNxt && _rcvQueue.size() < _rcvWnd) {
+		_rcvQueue.push_back(std::move(_rcvBuf.front()));
+		_rcvBuf.pop_front();
+		_rcvNxt++;
+	}
+	
+	// tell the peer the window opens again
+	if (recover && _rcvQueue.size() < _rcvWnd)
+		_probe |= SOCKRUDP_ASK_TELL;
 }
 
 //----------------------------------------------------------------------------
-// listen(port)
-// listen(ip, port, logs)
+// a datagram of the peer, returns < 0 if it is not ours or broken
 //
-int SockTcp::mylua_listen(lua_State* L)
+int SockRudp::input(const u8_t* data, u32_t size)
 {
-	SockTcp* _this = mylua_this(L);
+	u32_t now = (u32_t)Util::tick();
+	u32_t prevUna = _sndUna;
+	u32_t maxack = 0;
+	bool acked = false;
 	
-	u16_t port;
-	int logs = 5;
-	const char* ip = 0;
+	if (size < SOCKRUDP_OVERHEAD)
+		return -1;
 	
-	if (lua_gettop(L) == 2) {
-		port = (u16_t)luaL_checkinteger(L, 2);
-	} else if (lua_gettop(L) >= 3) {
-		ip = luaL_checkstring(L, 2);
-		port = (u16_t)luaL_checkinteger(L, 3);
-		if (lua_gettop(L) >= 4)
-			logs = (int)luaL_checkinteger(L, 4);
-	} else {
-		luaL_error(L, "%s.listen() bad data", SOCKLIB_TCP.c_str());
-		return 1;
+	while (size >= SOCKRUDP_OVERHEAD && !isClosed()) {
+		Seg seg = Seg();
+		seg.conv	= rudp_dec32(data);
+		seg.cmd		= data[4];
+		seg.frg		= data[5];
+		seg.wnd		= (u16_t)(data[6] | (data[7] << 8));
+		seg.ts		= rudp_dec32(data + 8);
+		seg.sn		= rudp_dec32(data + 12);
+		seg.una		= rudp_dec32(data + 16);
+		u32_t len	= rudp_dec32(data + 20);
+		
+		data += SOCKRUDP_OVERHEAD;
+		size -= SOCKRUDP_OVERHEAD;
+		
+		if (seg.conv != _conv)
+			return -1;
+		if (size < len)
+			return -2;
+		if (seg.cmd < CMD_PUSH || seg.cmd > CMD_FIN)
+			return -3;
+		
+		_rcvTs = now;
+		_keepTs = now + _idle / 4;
+		
+		// the answer, or anything of the peer if the answer is lost
+		if (_connecting) {
+			_connecting = false;
+			_sockState = SockLib::STA_CONNECTED;
+			onConnect(true);
+			if (isClosed())
+				return 0;
+		}
+		
+		_rmtWnd = seg.wnd;
+		parseUna(seg.una);
+		
+		switch (seg.cmd) {
+		case CMD_SYN:
+			// answer it, again if the answer is lost
+			if (_parent)
+				_synSend = true;
+			break;
+			
+		case CMD_ACK:
+			if (rudp_diff(now, seg.ts) >= 0)
+				updateAck(rudp_diff(now, seg.ts));
+			parseAck(seg.sn);
+			if (!acked || rudp_diff(seg.sn, maxack) > 0)
+				maxack = seg.sn;
+			acked = true;
+			break;
+			
+		case CMD_PUSH:
+			if (rudp_diff(seg.sn, _rcvNxt + _rcvWnd) < 0) {
+				_acks.push_back(std::make_pair(seg.sn, seg.ts));
+				if (rudp_diff(seg.sn, _rcvNxt) >= 0) {
+					seg.data.assign((const char*)data, len);
+					parseData(seg);
+				}
+			}
+			break;
+			
+		case CMD_UNRE:
+			onMessage(data, len, false);
+			break;
+			
+		case CMD_WASK:
+			_probe |= SOCKRUDP_ASK_TELL;
+			break;
+			
+		case CMD_WINS:
+			break;
+			
+		case CMD_FIN:
+			dead();
+			return 0;
+		}
+		
+		data += len;
+		size -= len;
 	}
 	
-	int r = _this->create();
-	if (SOCKET_ERROR == r) {
-		lua_pushvalue(L, 1);
-		lua_pushfstring(L, "create socket failed");
-		return 2;
-	}
+	if (isClosed())
+		return 0;
 	
-	if (ip && ip[0]) {
-		r = _this->bind(ip, port);
-		if (SOCKET_ERROR == r) {
-			lua_pushvalue(L, 1);
-			lua_pushfstring(L, "bind %s:%d failed", ip, port);
-			return 2;
+	if (acked)
+		parseFastack(maxack);
+	
+	// the congestion window grows with what is acked
+	if (rudp_diff(_sndUna, prevUna) > 0 && _cwnd < _rmtWnd) {
+		u32_t mss = _mss;
+		if (_cwnd < _ssthresh) {
+			_cwnd++;
+			_incr += mss;
+		} else {
+			if (_incr < mss)
+				_incr = mss;
+			_incr += (mss * mss) / _incr + (mss / 16);
+			if ((_cwnd + 1) * mss <= _incr)
+				_cwnd = (_incr + mss - 1) / mss;
 		}
-	} else {
-		r = _this->bind(port);
-		if (SOCKET_ERROR == r) {
-			lua_pushvalue(L, 1);
-			lua_pushfstring(L, "bind port %d failed", port);
-			return 2;
+		if (_cwnd > _rmtWnd) {
+			_cwnd = _rmtWnd;
+			_incr = _rmtWnd * mss;
 		}
 	}
-
-	r = _this->listen(logs);
 	
-	if (SOCKET_ERROR == r) {
-		lua_pushvalue(L, 1);
-		lua_pushfstring(L, "listen in port %d failed", port);
-		return 2;
-	} else {
-		lua_pushvalue(L, 1);
-		lua_pushnil(L);
-		return 2;
-	}
+	deliver();
+	
+	// acks, and what the window lets go, at the end of this poll
+	if (!isClosed())
+		SockLib::flushLater(this);
+	
+	return 0;
 }
 
 //----------------------------------------------------------------------------
+// datagrams to the session, a listener finds it by the peer's address
 //
-int SockTcp::mylua_accept(lua_State* L)
+void SockRudp::onRecv()
 {
-	SockTcp* _this = mylua_this(L);
-	
-	sockaddr_in addr = { 0 };
-	
-	int fd = _this->accept(&addr);
+	int n = recvBatch(_packets, SOCKRUDP_RECV_BATCH);
 	
-	if (fd >= 0) {
-		SockTcp* obj = new SockTcp();
-		obj->acceptfd(fd);
-		return LuaHelper::bind<SockTcp>(L, SOCKLIB_TCP, obj);
+	for (int i = 0; i < n && !isClosed(); i++) {
+		const Packet& p = _packets[i];
+		
+		if (!_listener) {
+			if (p.ip == _peer.sin_addr.s_addr && p.port == ntohs(_peer.sin_port))
+				input(p.data, p.len);
+			continue;
+		}
+		
+		if (p.len < SOCKRUDP_OVERHEAD)
+			continue;
+		
+		sockaddr_in addr;
+		Util::ipn2addr(p.ip, p.port, &addr);
+		
+		auto it = _sessions.find(peerKey(&addr));
+		SockRudp* sk = it != _sessions.end() ? it->second : nullptr;
+		
+		u32_t conv = rudp_dec32(p.data);
+		bool syn = p.data[4] == CMD_SYN;
+		
+		if (sk && sk->_conv != conv) {
+			if (!syn)
+				continue;
+			// the peer connects again from the same port
+			sk->dead();
+			sk = nullptr;
+		}
+		
+		if (!sk) {
+			bool wanted = _onAccept != nullptr;
+#if SOCKLIB_TO_LUA
+			wanted = wanted || _mylua_onAccept >= 0;
+#endif // SOCKLIB_TO_LUA
+			if (!syn || !wanted)
+				continue;
+			
+			sk = new SockRudp();
+			sk->_parent		= this;
+			sk->_fd			= _fd;
+			sk->_loop		= _loop;
+			sk->_peer		= addr;
+			sk->_conv		= conv;
+			sk->_mtu		= _mtu;
+			sk->_mss		= _mss;
+			sk->_sndWnd		= _sndWnd;
+			sk->_rcvWnd		= _rcvWnd;
+			sk->_interval	= _interval;
+			sk->_fastResend	= _fastResend;
+			sk->_deadLink	= _deadLink;
+			sk->_idle		= _idle;
+			sk->_nodelay	= _nodelay;
+			sk->_nocwnd		= _nocwnd;
+			sk->_minRto		= _minRto;
+			sk->_sockState	= SockLib::STA_ACCEPTED;
+			sk->start();
+			_sessions[peerKey(&addr)] = sk;
+			
+			onSession(sk);
+			if (isClosed() || sk->isClosed())
+				continue;
+		}
+		
+		sk->input(p.data, p.len);
 	}
-	
-	lua_pushnil(L);
-	
-	return 1;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockTcp::mylua_inbuf(lua_State* L)
+void SockRudp::onFlush()
 {
-	SockTcp* _this = mylua_this(L);
+	if (_listener)
+		SockUdp::flush();
+	else
+		output();
+}
+
+//----------------------------------------------------------------------------
+//
+void SockRudp::onConnect(bool ok)
+{
+	DBGLOG("%s{fd=%d}:onConnect(%d)\n", SOCKLIB_RUDP.c_str(), fd(), ok);
 	
-	if (lua_istable(L, 1)) {
-//		lua_getfield(L, 1, "inbuf");
-//		if (!lua_isnil(L, -1))
-//			return 1;
-//		lua_pop(L, 1);
-		int r = LuaHelper::bind<SockBuf>(L, SOCKLIB_BUF, _this->recvBuf());
-		if (r) {
-			lua_pushvalue(L, -1);
-			lua_setfield(L, 1, "inbuf");
+	if (_onConnect)
+		_onConnect(this, ok);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onConnect >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onConnect);
+		lua_pushboolean(L, ok);
+
+		int result = lua_pcall(L, 1, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onConnect event call error: %d", SOCKLIB_RUDP.c_str(), result);
 		}
-		return r;
 	}
-	
-	return LuaHelper::bind<SockBuf>(L, SOCKLIB_BUF, _this->recvBuf());
+#endif // SOCKLIB_TO_LUA
 }
 
 //----------------------------------------------------------------------------
+// _onAccept owns sk, or lua does
 //
-int SockTcp::mylua_outbuf(lua_State* L)
+void SockRudp::onSession(SockRudp* sk)
 {
-	SockTcp* _this = mylua_this(L);
+	DBGLOG("%s{fd=%d}:onSession(conv=%u)\n", SOCKLIB_RUDP.c_str(), fd(), sk->_conv);
 	
-	if (lua_istable(L, 1)) {
-//		lua_getfield(L, 1, "outbuf");
-//		if (!lua_isnil(L, -1))
-//			return 1;
-//		lua_pop(L, 1);
-		int r = LuaHelper::bind<SockBuf>(L, SOCKLIB_BUF, _this->sendBuf());
-		if (r) {
-			lua_pushvalue(L, -1);
-			lua_setfield(L, 1, "outbuf");
+	if (_onAccept) {
+		_onAccept(this, sk);
+		return;
+	}
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onAccept >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onAccept);
+		LuaHelper::bind<SockRudp>(L, SOCKLIB_RUDP, sk);
+
+		int result = lua_pcall(L, 1, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onAccept event call error: %d", SOCKLIB_RUDP.c_str(), result);
 		}
-		return r;
 	}
-	
-	return LuaHelper::bind<SockBuf>(L, SOCKLIB_BUF, _this->sendBuf());
+#endif // SOCKLIB_TO_LUA
 }
 
 //----------------------------------------------------------------------------
 //
-int SockTcp::mylua_send(lua_State* L)
+void SockRudp::onMessage(const u8_t* data, u32_t len, bool reliable)
 {
-	SockTcp* _this = mylua_this(L);
-	
-	void* ptr = 0;
-	u32_t len = 0;
-	
-	if (mylua_input_get(L, 2, ptr, len)) {
-		_this->sendBuf()->w(ptr, len);
-	} else {
-		luaL_error(L, "%s:send(<unknown data>)", SOCKLIB_TCP.c_str());
+	if (_onMessage)
+		_onMessage(this, data, len, reliable);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onRecv >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onRecv);
+		lua_pushlstring(L, (const char*)data, len);
+		lua_pushboolean(L, reliable);
+
+		int result = lua_pcall(L, 2, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onRecv event call error: %d", SOCKLIB_RUDP.c_str(), result);
+		}
 	}
-	
-	lua_pushvalue(L, 1);
-	
-	return 1;
+#endif // SOCKLIB_TO_LUA
 }
 
 //----------------------------------------------------------------------------
 //
-int SockTcp::mylua_recv(lua_State* L)
+void SockRudp::onClose()
 {
-	SockTcp* _this = mylua_this(L);
-	return 0;
+	DBGLOG("%s{fd=%d}:onClose()\n", SOCKLIB_RUDP.c_str(), fd());
+	
+	if (_onClose)
+		_onClose(this);
+
+#if SOCKLIB_TO_LUA
+	if (_mylua_onClose >= 0) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onClose);
+
+		int result = lua_pcall(L, 0, 0, 0);
+		if (0 != result) {
+			luaL_error(L, "%s:onClose event call error: %d", SOCKLIB_RUDP.c_str(), result);
+		}
+	}
+#endif // SOCKLIB_TO_LUA
 }
 
+#if SOCKLIB_TO_LUA
 //----------------------------------------------------------------------------
 //
-int SockTcp::mylua_close(lua_State* L)
+SockRudp* SockRudp::mylua_this(lua_State* L, int idx)
 {
-	SockTcp* _this = mylua_this(L);
-	_this->close();
-	return 0;
+	return LuaHelper::get<SockRudp>(L, SOCKLIB_RUDP, idx);
 }
 
 //----------------------------------------------------------------------------
+// connect(host or ip, port, [conv])
 //
-int SockTcp::mylua_isclosed(lua_State* L)
+int SockRudp::mylua_connect(lua_State* L)
 {
-	SockTcp* _this = mylua_this(L);
-	lua_pushboolean(L, _this->isClosed());
+	SockRudp* _this = mylua_this(L);
+	
+	u16_t port = (u16_t)luaL_checkinteger(L, 3);
+	u32_t conv = (u32_t)luaL_optnumber(L, 4, 0);
+	int n;
+	
+	if (lua_isnumber(L, 2))
+		n = _this->connect((u32_t)lua_tonumber(L, 2), port, conv);
+	else
+		n = _this->connect(luaL_checkstring(L, 2), port, conv);
+	
+	lua_pushinteger(L, n);
+	
 	return 1;
 }
 
 //----------------------------------------------------------------------------
+// listen(port)
+// listen(ip, port)
 //
-static int SockRef_mylua_setopt(lua_State* L, SockRef* _this)
+int SockRudp::mylua_listen(lua_State* L)
 {
-	int r = -1, n;
-	const char* key = luaL_checkstring(L, 2);
+	SockRudp* _this = mylua_this(L);
 	
-	if (0 == StrCmpI(key, SOCKOPT_BLOCKING)) {
-		n = lua_gettop(L) >= 3 ? luaL_optint(L, 3, 1) : 1;
-		r = _this->setBroadcast(n != 0);
-	} else if (0 == StrCmpI(key, SOCKOPT_REUSEADDR)) {
-		n = lua_gettop(L) >= 3 ? luaL_optint(L, 3, 1) : 1;
-		r = _this->setReuseAddr(n != 0);
-	} else if (lua_gettop(L) >= 3 && lua_isnumber(L, 3)) {
-		n = luaL_optint(L, 3, 0);
-		
-		if (0 == StrCmpI(key, SOCKOPT_SENDBUFSIZE)) {
-			r = _this->setSendBufferSize(n);
-		} else if (0 == StrCmpI(key, SOCKOPT_RECVBUFSIZE)) {
-			r = _this->setRecvBufferSize(n);
-		} else if (0 == StrCmpI(key, SOCKOPT_SENDTIMEOUT)) {
-			r = _this->setSendTimeout(n);
-		} else if (0 == StrCmpI(key, SOCKOPT_RECVTIMEOUT)) {
-			r = _this->setRecvTimeout(n);
-		} else {
-			luaL_error(L, "setopt(BAD_KEY=%s)", key);
-			return 1;
-		}
+	u16_t port;
+	const char* ip = "";
+	
+	if (lua_gettop(L) == 2) {
+		port = (u16_t)luaL_checkinteger(L, 2);
+	} else if (lua_gettop(L) >= 3) {
+		ip = luaL_checkstring(L, 2);
+		port = (u16_t)luaL_checkinteger(L, 3);
 	} else {
-		luaL_error(L, "setopt(KEY=%s, bad params)", key);
+		luaL_error(L, "%s.listen() bad data", SOCKLIB_RUDP.c_str());
 		return 1;
 	}
 	
-	DBGLOG("setopt(%s, %d)\n", key, n);
-	
-	//lua_pushboolean(L, r != SOCKET_ERROR);
+	if (SOCKET_ERROR == _this->listen(ip, port)) {
+		lua_pushvalue(L, 1);
+		lua_pushfstring(L, "listen %s:%d failed", ip, port);
+		return 2;
+	}
 	
 	lua_pushvalue(L, 1);
-	
-	return 1;
-}
-
-//----------------------------------------------------------------------------
-//
-int SockTcp::mylua_setopt(lua_State* L)
-{
-	SockTcp* _this = mylua_this(L);
-	return SockRef_mylua_setopt(L, _this);
+	lua_pushnil(L);
+	return 2;
 }
 
 //----------------------------------------------------------------------------
+// send(data, [len], [reliable]) reliable by default, send(data, false) too
 //
-int SockTcp::mylua_peeraddr(lua_State* L)
+int SockRudp::mylua_send(lua_State* L)
 {
-	SockTcp* _this = mylua_this(L);
-
-	std::string ip;
-	u16_t port;
+	SockRudp* _this = mylua_this(L);
 	
-	_this->getPeerAddr(ip, &port);
+	void* ptr = 0;
+	u32_t len = 0;
+	bool reliable = true;
+	
+	if (lua_isboolean(L, 3)) {
+		reliable = lua_toboolean(L, 3) != 0;
+		lua_settop(L, 2);
+	} else if (lua_gettop(L) >= 4) {
+		reliable = lua_toboolean(L, 4) != 0;
+		lua_settop(L, 3);
+	}
 	
-	lua_pushstring(L, ip.c_str());
-	lua_pushnumber(L, port);
+	if (mylua_input_get(L, 2, ptr, len)) {
+		lua_pushinteger(L, _this->send(ptr, len, reliable));
+	} else {
+		luaL_error(L, "%s:send(<unknown data>)", SOCKLIB_RUDP.c_str());
+		lua_pushinteger(L, SOCKET_ERROR);
+	}
 	
-	return 2;
+	return 1;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockTcp::mylua_sockaddr(lua_State* L)
+int SockRudp::mylua_close(lua_State* L)
 {
-	SockTcp* _this = mylua_this(L);
-
-	std::string ip;
-	u16_t port;
-	
-	_this->getSockAddr(ip, &port);
-	
-	lua_pushstring(L, ip.c_str());
-	lua_pushnumber(L, port);
+	SockRudp* _this = mylua_this(L);
+	_this->close();
 	
-	return 2;
+	return 0;
 }
 
 //----------------------------------------------------------------------------
 //
-#define SAFE_LUA_UNREF(n) \
-	if (n >= 0) { \
-		luaL_unref(L, LUA_REGISTRYINDEX, n); \
-		n = -1; \
-	}
+int SockRudp::mylua_isclosed(lua_State* L)
+{
+	SockRudp* _this = mylua_this(L);
+	lua_pushboolean(L, _this->isClosed());
+	return 1;
+}
 
-#define SAFE_LUA_REF(n, v) \
-	SAFE_LUA_UNREF(n); n = v;
-	
 //----------------------------------------------------------------------------
+//	CONNECT: function(ok), ACCEPT: function(session),
+//	RECV: function(data, reliable), CLOSE: function()
 //
-int SockTcp::mylua_onevent(lua_State* L)
+int SockRudp::mylua_onevent(lua_State* L)
 {
-	SockTcp* _this = mylua_this(L);
+	SockRudp* _this = mylua_this(L);
 	
 	const char* name = luaL_checkstring(L, 2);
 	
 	int handler = -1;
 	if (lua_gettop(L) >= 3) {
 		if (!lua_isfunction(L, -1)) {
-			luaL_error(L, "%s:onevent(%s, func) bad param", SOCKLIB_TCP.c_str(), name);
+			luaL_error(L, "%s:onevent(%s, func) bad param", SOCKLIB_RUDP.c_str(), name);
 			lua_pushvalue(L, 1);
 			return 1;
 		}
@@ -1767,44 +5550,92 @@ int SockTcp::mylua_onevent(lua_State* L)
 
 	if (StrCmpI(SOCKEVT_CONNECT, name) == 0) {
 		SAFE_LUA_REF(_this->_mylua_onConnect, handler);
+	} else if (StrCmpI(SOCKEVT_ACCEPT, name) == 0) {
+		SAFE_LUA_REF(_this->_mylua_onAccept, handler);
 	} else if (StrCmpI(SOCKEVT_RECV, name) == 0) {
 		SAFE_LUA_REF(_this->_mylua_onRecv, handler);
-	} else if (StrCmpI(SOCKEVT_SEND, name) == 0) {
-		SAFE_LUA_REF(_this->_mylua_onSend, handler);
 	} else if (StrCmpI(SOCKEVT_CLOSE, name) == 0) {
 		SAFE_LUA_REF(_this->_mylua_onClose, handler);
-	} else if (StrCmpI(SOCKEVT_ACCEPT, name) == 0) {
-		SAFE_LUA_REF(_this->_mylua_onAccept, handler);
-	} else if (StrCmpI(SOCKEVT_POLL, name) == 0) {
-		SAFE_LUA_REF(_this->_mylua_onPoll, handler);
 	} else {
-		luaL_error(L, "%s:onEevent(%s) not support!", SOCKLIB_TCP.c_str(), name);
+		luaL_error(L, "%s:onevent(%s) not support!", SOCKLIB_RUDP.c_str(), name);
 	}
-
-	DBGLOG("SockTcp::mylua_onevent(%s)\n", name);
 	
 	lua_pushvalue(L, 1);
+	
+	return 1;
+}
 
+//----------------------------------------------------------------------------
+//	setopt(OPT.NODELAY, nodelay, [interval], [resend], [nocwnd]) as KCP's
+//	ikcp_nodelay(), e.g. 1, 10, 2, 1 for low latency
+//	setopt(OPT.WINDOW, snd, [rcv]) in segments
+//	setopt(OPT.MTU, bytes) of a datagram
+//	setopt(OPT.DEADLINK, n) a segment sent n times closes the session
+//	setopt(OPT.IDLE, ms) no input for ms closes the session, 0 off
+//	sessions of a listener take its options when they come
+//
+int SockRudp::mylua_setopt(lua_State* L)
+{
+	SockRudp* _this = mylua_this(L);
+	const char* key = luaL_checkstring(L, 2);
+	
+	if (0 == StrCmpI(key, SOCKOPT_NODELAY)) {
+		_this->setArq(luaL_optint(L, 4, 0), luaL_optint(L, 5, -1), luaL_optint(L, 3, 1) != 0, luaL_optint(L, 6, 0) != 0);
+	} else if (0 == StrCmpI(key, SOCKOPT_WINDOW)) {
+		_this->setWindow((u32_t)luaL_checkinteger(L, 3), (u32_t)luaL_optint(L, 4, 0));
+	} else if (0 == StrCmpI(key, SOCKOPT_MTU)) {
+		if (SOCKET_ERROR == _this->setMtu((u32_t)luaL_checkinteger(L, 3)))
+			luaL_error(L, "%s:setopt(%s) bad mtu", SOCKLIB_RUDP.c_str(), key);
+	} else if (0 == StrCmpI(key, SOCKOPT_DEADLINK)) {
+		_this->setDeadLink((u32_t)luaL_checkinteger(L, 3));
+	} else if (0 == StrCmpI(key, SOCKOPT_IDLE)) {
+		_this->setIdle((u32_t)luaL_checkinteger(L, 3));
+	} else {
+		return SockRef_mylua_setopt(L, _this);
+	}
+	
+	lua_pushvalue(L, 1);
 	return 1;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockTcp::mylua_index(lua_State* L)
+int SockRudp::mylua_peeraddr(lua_State* L)
+{
+	SockRudp* _this = mylua_this(L);
+
+	std::string ip;
+	u16_t port;
+	
+	_this->getPeerAddr(ip, &port);
+	
+	lua_pushstring(L, ip.c_str());
+	lua_pushnumber(L, port);
+	
+	return 2;
+}
+
+//----------------------------------------------------------------------------
+//
+int SockRudp::mylua_index(lua_State* L)
 {
-//	SockTcp* _this = mylua_this(L);
 	const char* key = luaL_checkstring(L, 2);
 
-	DBGLOG("SockTcp::mylua_index(%s)\n", key);
+	DBGLOG("SockRudp::mylua_index(%s)\n", key);
 
 	lua_pushvalue(L, 1);
 	if (int r = LuaHelper::mylua_index_walk(L, key))
 		return r;
-
-	if (0 == NameStrCmp(key, "inbuf")) {
-		return mylua_inbuf(L);
-	} else if (0 == NameStrCmp(key, "outbuf")) {
-		return mylua_outbuf(L);
+	
+	if (0 == NameStrCmp(key, "pending")) {
+		lua_pushinteger(L, mylua_this(L)->pending());
+		return 1;
+	} else if (0 == NameStrCmp(key, "rtt")) {
+		lua_pushinteger(L, mylua_this(L)->rtt());
+		return 1;
+	} else if (0 == NameStrCmp(key, "conv")) {
+		lua_pushnumber(L, mylua_this(L)->conv());
+		return 1;
 	}
 	
 	lua_pushnil(L);
@@ -1814,36 +5645,34 @@ int SockTcp::mylua_index(lua_State* L)
 
 //----------------------------------------------------------------------------
 //
-int SockTcp::mylua_gc(lua_State* L)
+int SockRudp::mylua_gc(lua_State* L)
 {
-	SockTcp* _this = mylua_this(L);
+	SockRudp* _this = mylua_this(L);
 	
 	if (LuaHelper::found(_this)) {
-		DBGLOG("%s{fd=%d}:mylua_gc() free\n", SOCKLIB_TCP.c_str(), _this->fd());
+		DBGLOG("%s{fd=%d}:mylua_gc() free\n", SOCKLIB_RUDP.c_str(), _this->fd());
 		_this->close();
 		LuaHelper::remove(_this);
 		SockLib::destroy(_this);
 	} else {
-		DBGLOG("%s{fd=%d}:mylua_gc()\n", SOCKLIB_TCP.c_str(), _this->fd());
+		DBGLOG("%s{fd=%d}:mylua_gc()\n", SOCKLIB_RUDP.c_str(), _this->fd());
 	}
 	
 	SAFE_LUA_UNREF(_this->_mylua_onConnect);
-	SAFE_LUA_UNREF(_this->_mylua_onRecv);
-	SAFE_LUA_UNREF(_this->_mylua_onSend);
 	SAFE_LUA_UNREF(_this->_mylua_onAccept);
+	SAFE_LUA_UNREF(_this->_mylua_onRecv);
 	SAFE_LUA_UNREF(_this->_mylua_onClose);
-	SAFE_LUA_UNREF(_this->_mylua_onPoll);
 
 	return 0;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockTcp::mylua_tostring(lua_State* L)
+int SockRudp::mylua_tostring(lua_State* L)
 {
-	SockTcp* _this = mylua_this(L);
+	SockRudp* _this = mylua_this(L);
 	
-	lua_pushfstring(L, "%s{fd=%d}", SOCKLIB_TCP.c_str(), _this->fd());
+	lua_pushfstring(L, "%s{fd=%d, conv=%d}", SOCKLIB_RUDP.c_str(), _this->fd(), (int)_this->conv());
 	
 	return 1;
 }
@@ -1851,567 +5680,927 @@ int SockTcp::mylua_tostring(lua_State* L)
 #endif // SOCKLIB_TO_LUA
 
 ///////////////////////////////////////////////////////////////////////////////
-// SockUdp
+// SockBuf
 //
+#define SOCKBUF_BLOCK_SIZE	(1024 * 4)
+#define SOCKBUF_CHAIN_SIZE	(1024 * 16)
 
-//----------------------------------------------------------------------------
-//
-SockUdp::SockUdp()
+SockBuf::SockBuf()
+	: _ptr(0), _max(0), _pos_r(0), _pos_w(0), _owner(0)
+	, _chain(false), _ring(false), _shared(0), _view(false)
+	, _head(0), _tail(0), _spare(0), _size(0)
 {
 }
 
-//----------------------------------------------------------------------------
-//
-SockUdp::~SockUdp()
+SockBuf::~SockBuf()
 {
+	dropBlock();
+	chainReset();
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::create()
+int SockBuf::write(const void* data, u32_t bytes)
 {
-	close();
-	_fd = ::socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	return _fd;
+	if (!data || !bytes)
+		return 0;
+	
+	if (_chain)
+		return chainWrite(data, bytes);
+	if (_ring)
+		return ringWrite(data, bytes);
+
+	u8_t* ptr = reserve(bytes);
+	if (!ptr)
+		return 0;
+	
+	memcpy(ptr, data, bytes);
+	commit(bytes);
+
+//	DBGLOG("SockBuf::write()\n")
+
+	return bytes;
 }
 
 //----------------------------------------------------------------------------
+// keep one more byte for '\0' at the tail
 //
-int SockUdp::bind(const std::string& ip, u16_t port)
+u8_t* SockBuf::reserve(u32_t bytes)
 {
-	u32_t ipn = INADDR_ANY;
-	if (ip.length() > 0)
-		ipn = Util::ips2n(ip);
+	if (_ring)
+		return bytes <= room() ? _ptr + (_pos_w & (_max - 1)) : 0;
 	
-	return bind(ipn, port);
+	if (_chain) {
+		if (_tail && _tail->cap - _tail->w >= bytes)
+			return _tail->data + _tail->w;
+		
+		Seg* seg = segNew(bytes);
+		if (!seg) return 0;
+		
+		if (_tail)
+			_tail->next = seg;
+		else
+			_head = seg;
+		_tail = seg;
+		
+		return seg->data;
+	}
+	
+	// a view can't write on others' data
+	if (_view && !unshare(bytes))
+		return 0;
+	
+	// check enough
+	if ((_pos_w + bytes) >= _max) {
+		// data of slices can't be moved
+		if (_shared && !unshare(bytes))
+			return 0;
+		
+		if (_pos_r > 0) {
+			memmove(_ptr, _ptr + _pos_r, _pos_w - _pos_r);
+			_pos_w -= _pos_r;
+			_pos_r = 0;
+		}
+		
+		if ((_pos_w + bytes) >= _max) {
+			u32_t max = _pos_w + bytes;
+			max = ((max + SOCKBUF_BLOCK_SIZE) / SOCKBUF_BLOCK_SIZE) * SOCKBUF_BLOCK_SIZE;
+			
+			SockPool* pool = SockPool::current();
+			u8_t* ptr = (u8_t*)pool->alloc(max);
+			
+			if (!ptr) return 0;
+			
+			if (_ptr) {
+				memcpy(ptr, _ptr, _pos_w);
+				pool->release(_ptr, _max);
+			}
+			
+			_ptr = ptr;
+			_max = max;
+		}
+	}
+	
+	return _ptr + _pos_w;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::bind(u32_t ip, u16_t port)
+void SockBuf::commit(u32_t bytes)
 {
-	sockaddr_in addr = { 0 };
-#ifndef _WIN32
-	addr.sin_len = sizeof(addr);
-#endif
-	addr.sin_family      = AF_INET;
-	addr.sin_addr.s_addr = ip;
-	addr.sin_port        = htons(port);
-	
-	int r = bind(&addr);
+	if (_chain) {
+		if (!bytes || !_tail || _tail->w + bytes > _tail->cap)
+			return;
+		
+		if (_owner && !_size)
+			SockLib::update(_owner);
+		
+		_tail->w += bytes;
+		_tail->data[_tail->w] = 0;
+		_size += bytes;
+		return;
+	}
 	
-	if (SOCKET_ERROR != r) {
-		_sockState = SockLib::STA_BINDED;
-		SockLib::add(this, SockLib::EVT_RECV);
+	if (_ring) {
+		if (!bytes || bytes > room())
+			return;
+		
+		if (_owner && _pos_w == _pos_r)
+			SockLib::update(_owner);
+		
+		_pos_w += bytes;
+		_ptr[_pos_w & (_max - 1)] = 0;
+		return;
 	}
 	
-	return r;
+	if (!bytes || _pos_w + bytes >= _max)
+		return;
+	
+	// owner wants to send now
+	if (_owner && _pos_w == _pos_r)
+		SockLib::update(_owner);
+	
+	_pos_w += bytes;
+	_ptr[_pos_w] = 0;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::bind(const sockaddr_in* addr)
+int SockBuf::read(void* data, u32_t bytes)
 {
-	setReuseAddr(true);
+//	DBGLOG("SockBuf::read()\n");
 
-	return ::bind(fd(), (struct sockaddr*)addr, sizeof(*addr));
+	bytes = peek(data, bytes);
+	consume(bytes);
+	return bytes;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::sendto(const std::string& host, u16_t port, const void* data, u32_t len)
+int SockBuf::peek(void* data, u32_t bytes)
 {
-	DBGLOG("%s{fd=%d}:sendto(%s:%d, %dbytes) free\n", SOCKLIB_UDP.c_str(), fd(), host.c_str(), port, len);
-	
-	u32_t ip = Util::ips2n(host.c_str());
+//	DBGLOG("SockBuf::peek()\n");
 	
-	return sendto(ip, port, data, len);
+	if (data && bytes) {
+		if (bytes > len())
+			bytes = len();
+		peekAt(data, bytes);
+		return bytes;
+	}
+
+	return 0;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::sendto(u32_t ip, u16_t port, const void* data, u32_t len)
+void SockBuf::reset()
 {
-	sockaddr_in addr = { 0 };
-#ifndef _WIN32
-	addr.sin_len	= sizeof(addr);
-#endif
-	addr.sin_family = PF_INET;
-	addr.sin_addr.s_addr = ip;
-	addr.sin_port        = htons(port);
+	// keep the capacity of ring
+	if (_ring) {
+		_pos_r = _pos_w = 0;
+		_ptr[0] = 0;
+		return;
+	}
 	
-	return sendto(&addr, data, len);
-}
+	dropBlock();
+	_pos_r = _pos_w = 0;
+	
+	chainReset();
 
-//----------------------------------------------------------------------------
-//
-int SockUdp::sendto(const sockaddr_in* addr, const void* data, u32_t len)
-{
-	return (int)::sendto(fd(), (char*)data, len, 0, (const struct sockaddr*)addr, sizeof(*addr));
+//	DBGLOG("SockBuf::reset()\n");
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::recvfrom(void* data, u32_t len, u32_t* ip, u16_t* port)
+SockBuf& SockBuf::discard(u32_t bytes)
 {
-	sockaddr_in addr;
-	int r = recvfrom(data, len, &addr);
-	if (r > 0) {
-		if (ip) *ip	= addr.sin_addr.s_addr;
-		if (port) *port	= ntohs(addr.sin_port);
-	} else {
-		if (ip) *ip = 0;
-		if (port) *port = 0;
+	if (bytes > len())
+		bytes = len();
+	
+	if (_ring) {
+		consume(bytes);
+		return *this;
+	}
+	
+	if (_chain) {
+		chainConsume(bytes);
+		
+		// drained, keep one normal block only
+		if (!_size) {
+			if (_spare) {
+				segFree(_spare);
+				_spare = 0;
+			}
+			if (_head && _head->cap + sizeof(Seg) > SOCKBUF_CHAIN_SIZE) {
+				segFree(_head);
+				_head = _tail = 0;
+			}
+		}
+		return *this;
+	}
+	
+	_pos_r += bytes;
+	
+	// slices keep the block
+	if (_pos_r >= _pos_w && _shared) {
+		dropBlock();
+		_pos_r = _pos_w = 0;
+		return *this;
 	}
-	return r;
-}
 
-int SockUdp::recvfrom(void* data, u32_t len, std::string& ip, u16_t* port)
-{
-	sockaddr_in addr;
-	int r = recvfrom(data, len, &addr);
-	if (r > 0) {
-		ip = Util::ipn2s(addr.sin_addr.s_addr);
-		if (port) *port	= ntohs(addr.sin_port);
-	} else {
-		ip = "";
-		if (port) *port = 0;
+	if (_pos_r >= _pos_w && _ptr) {
+		_pos_w = 0;
+		_pos_r = 0;
+		_ptr[0] = 0;
+		
+		if (_max > SOCKBUF_BLOCK_SIZE) {
+			SockPool* pool = SockPool::current();
+			pool->release(_ptr, _max);
+			_max = SOCKBUF_BLOCK_SIZE;
+			_ptr = (u8_t*) pool->alloc(_max);
+			if (!_ptr)
+				_max = 0;
+		}
 	}
-	return r;
+	return *this;
 }
 
-int SockUdp::recvfrom(void* data, u32_t len, sockaddr_in* addr)
+//----------------------------------------------------------------------------
+// switch the storage, data is kept
+//
+void SockBuf::setChain(bool b)
 {
-	socklen_t addrlen = sizeof(sockaddr_in);
-	if (addr) {
-		return (int)::recvfrom(fd(), (char*)data, len, 0, (struct sockaddr*)addr, &addrlen);
+	if (b == _chain)
+		return;
+	
+	if (_ring)
+		setRing(0);
+	
+	// data is there, no need to notify owner again
+	SockRef* owner = _owner;
+	_owner = 0;
+	
+	if (b) {
+		u8_t* ptr = _ptr;
+		u32_t bytes = len();
+		
+		_chain = true;
+		write(ptr + _pos_r, bytes);
+		
+		dropBlock();
+		_pos_r = _pos_w = 0;
 	} else {
-		sockaddr_in tmp = { 0 };
-		return (int)::recvfrom(fd(), (char*)data, len, 0, (struct sockaddr*)&tmp, &addrlen);
+		u32_t bytes = _size;
+		u8_t* ptr = pullup(bytes);
+		
+		_chain = false;
+		write(ptr, bytes);
+		
+		chainReset();
 	}
+	
+	_owner = owner;
 }
 
 //----------------------------------------------------------------------------
 //
-void SockUdp::onRecv()
+int SockBuf::iov(struct iovec* v, int n) const
 {
-	DBGLOG("%s{fd=%d}:onRecv()\n", SOCKLIB_UDP.c_str(), fd());
+	int i = 0;
 	
-	if (_onRecv)
-		_onRecv(this);
+	if (_ring) {
+		u32_t off = _pos_r & (_max - 1);
+		u32_t l = len();
+		while (l && i < n) {
+			u32_t part = _max - off;
+			if (part > l) part = l;
+			v[i].iov_base = (char*)_ptr + off;
+			v[i].iov_len = part;
+			l -= part;
+			off = 0;
+			i++;
+		}
+		return i;
+	}
 	
-#if SOCKLIB_TO_LUA
-	if (_mylua_onRecv >= 0) {
-		lua_State* L = SockLib::luaState();
-		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onRecv);
-
-		int result = lua_pcall(L, 0, 0, 0);
-		if (0 != result) {
-			luaL_error(L, "%s:onRecv event call error: %d", SOCKLIB_UDP.c_str(), result);
+	if (!_chain) {
+		if (n > 0 && len()) {
+			v[0].iov_base = (char*)_ptr + _pos_r;
+			v[0].iov_len = len();
+			i = 1;
 		}
+		return i;
 	}
-#endif // SOCKLIB_TO_LUA
+	
+	for (Seg* seg = _head; seg && i < n; seg = seg->next) {
+		if (seg->w > seg->r) {
+			v[i].iov_base = (char*)seg->data + seg->r;
+			v[i].iov_len = seg->w - seg->r;
+			i++;
+		}
+	}
+	return i;
 }
 
 //----------------------------------------------------------------------------
+// chain mode: copy the first bytes into a new head block if they're split
 //
-void SockUdp::onSend()
+u8_t* SockBuf::pullup(u32_t bytes) const
 {
-	if (_onSend)
-		_onSend(this);
-
-#if SOCKLIB_TO_LUA
-	if (_mylua_onSend >= 0) {
-		lua_State* L = SockLib::luaState();
-		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onSend);
-
-		int result = lua_pcall(L, 0, 0, 0);
-		if (0 != result) {
-			luaL_error(L, "%s:onSend event call error: %d", SOCKLIB_UDP.c_str(), result);
+	if (_ring) {
+		u32_t off = _pos_r & (_max - 1);
+		u32_t l = len();
+		
+		// rotate to 0 if it wraps, or '\0' can't follow the data
+		if (off + bytes > _max || (bytes == l && off + l == _max)) {
+			std::rotate(_ptr, _ptr + off, _ptr + _max);
+			_pos_r = 0;
+			_pos_w = l;
+			_ptr[l] = 0;
+			off = 0;
 		}
+		return _ptr + off;
 	}
-#endif // SOCKLIB_TO_LUA
+	
+	if (!_chain)
+		return _ptr + _pos_r;
+	
+	if (bytes > _size)
+		bytes = _size;
+	
+	// skip empty blocks left by reserve()
+	while (_head && _head->r == _head->w && _head->next) {
+		Seg* seg = _head;
+		_head = seg->next;
+		segFree(seg);
+	}
+	
+	if (!_head)
+		return 0;
+	
+	if (_head->w - _head->r >= bytes)
+		return _head->data + _head->r;
+	
+	Seg* seg = segNew(bytes);
+	if (!seg) return 0;
+	
+	// move bytes into the new block, the blocks drained are freed
+	u32_t left = bytes;
+	while (left) {
+		Seg* h = _head;
+		u32_t n = h->w - h->r;
+		if (n > left) n = left;
+		
+		memcpy(seg->data + seg->w, h->data + h->r, n);
+		seg->w += n;
+		h->r += n;
+		left -= n;
+		
+		if (h->r == h->w) {
+			_head = h->next;
+			if (_tail == h)
+				_tail = _head;
+			segFree(h);
+		}
+	}
+	seg->data[seg->w] = 0;
+	
+	seg->next = _head;
+	_head = seg;
+	if (!_tail)
+		_tail = seg;
+	
+	return seg->data;
 }
 
 //----------------------------------------------------------------------------
 //
-void SockUdp::onClose()
+// a block of SOCKBUF_CHAIN_SIZE at least, with room for bytes
+//
+SockBuf::Seg* SockBuf::segNew(u32_t bytes)
 {
-	DBGLOG("%s{fd=%d}:onClose()\n", SOCKLIB_UDP.c_str(), fd());
+	u32_t size = bytes + sizeof(Seg);
+	if (size < SOCKBUF_CHAIN_SIZE)
+		size = SOCKBUF_CHAIN_SIZE;
 	
-	if (_onClose)
-		_onClose(this);
+	Seg* seg = (Seg*) SockPool::current()->alloc(size);
+	if (seg) {
+		seg->next = 0;
+		seg->r = seg->w = 0;
+		seg->cap = size - sizeof(Seg);
+		seg->data[0] = 0;
+	}
+	return seg;
+}
 
-#if SOCKLIB_TO_LUA
-	if (_mylua_onClose >= 0) {
-		lua_State* L = SockLib::luaState();
-		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onClose);
+void SockBuf::segFree(Seg* seg)
+{
+	SockPool::current()->release(seg, seg->cap + sizeof(Seg));
+}
 
-		int result = lua_pcall(L, 0, 0, 0);
-		if (0 != result) {
-			luaL_error(L, "%s:onClose event call error: %d", SOCKLIB_UDP.c_str(), result);
+//----------------------------------------------------------------------------
+// fill the tail block, then append new ones
+//
+int SockBuf::chainWrite(const void* data, u32_t bytes)
+{
+	const u8_t* p = (const u8_t*)data;
+	u32_t left = bytes;
+	
+	if (_owner && !_size)
+		SockLib::update(_owner);
+	
+	while (left) {
+		if (!_tail || _tail->w == _tail->cap) {
+			Seg* seg = segNew(0);
+			if (!seg) break;
+			
+			if (_tail)
+				_tail->next = seg;
+			else
+				_head = seg;
+			_tail = seg;
 		}
+		
+		u32_t n = _tail->cap - _tail->w;
+		if (n > left) n = left;
+		
+		memcpy(_tail->data + _tail->w, p, n);
+		_tail->w += n;
+		_tail->data[_tail->w] = 0;
+		_size += n;
+		p += n;
+		left -= n;
 	}
-#endif // SOCKLIB_TO_LUA
+	
+	return bytes - left;
 }
 
 //----------------------------------------------------------------------------
+// capacity is rounded up to power of 2, false if data can't fit in
 //
-void SockUdp::onPoll()
+bool SockBuf::setRing(u32_t capacity)
 {
-	if (_onPoll)
-		_onPoll(this);
-
-#if SOCKLIB_TO_LUA
-	if (_mylua_onPoll >= 0) {
-		lua_State* L = SockLib::luaState();
-		lua_rawgeti(L, LUA_REGISTRYINDEX, _mylua_onPoll);
-
-		int result = lua_pcall(L, 0, 0, 0);
-		if (0 != result) {
-			luaL_error(L, "%s:onPoll event call error: %d", SOCKLIB_UDP.c_str(), result);
+	if (!capacity) {
+		if (_ring) {
+			u32_t l = len();
+			u8_t* ptr = pullup(l);
+			
+			// as flat, one byte for '\0' is there
+			memmove(_ptr, ptr, l);
+			_ptr[l] = 0;
+			_pos_r = 0;
+			_pos_w = l;
+			_ring = false;
 		}
+		return true;
 	}
-#endif // SOCKLIB_TO_LUA
+	
+	u32_t max = SockPool::CLASS_MIN;
+	while (max < capacity && max < 0x80000000)
+		max <<= 1;
+	
+	if (len() >= max)
+		return false;
+	
+	if (_chain)
+		setChain(false);
+	
+	SockPool* pool = SockPool::current();
+	u8_t* ptr = (u8_t*)pool->alloc(max);
+	if (!ptr)
+		return false;
+	
+	u32_t l = len();
+	if (l) {
+		iovec v[2];
+		int c = iov(v, 2);
+		memcpy(ptr, v[0].iov_base, v[0].iov_len);
+		if (c > 1)
+			memcpy(ptr + v[0].iov_len, v[1].iov_base, v[1].iov_len);
+	}
+	ptr[l] = 0;
+	
+	dropBlock();
+	
+	_ptr = ptr;
+	_max = max;
+	_pos_r = 0;
+	_pos_w = l;
+	_ring = true;
+	
+	return true;
 }
 
-#if SOCKLIB_TO_LUA
 //----------------------------------------------------------------------------
 //
-SockUdp* SockUdp::mylua_this(lua_State* L, int idx)
+int SockBuf::slice(SockBuf& dst, u32_t from, u32_t bytes)
 {
-	return LuaHelper::get<SockUdp>(L, SOCKLIB_UDP, idx);
+	if (from > len() || bytes > len() - from)
+		return 0;
+	return slice(dst, pullup(from + bytes) + from, bytes);
 }
 
 //----------------------------------------------------------------------------
-// bind(port)
-// listen(ip, port)
+// copy if not in our flat block, e.g. chain or ring mode
 //
-int SockUdp::mylua_bind(lua_State* L)
+int SockBuf::slice(SockBuf& dst, const void* ptr, u32_t bytes)
 {
-	SockUdp* _this = mylua_this(L);
-	
-	u16_t port;
-	const char* ip = 0;
-	
-	if (lua_gettop(L) == 2) {
-		port = (u16_t)luaL_checkinteger(L, 2);
-	} else if (lua_gettop(L) >= 3) {
-		ip = luaL_checkstring(L, 2);
-		port = (u16_t)luaL_checkinteger(L, 3);
-	} else {
-		luaL_error(L, "%s.bind() bad data", SOCKLIB_UDP.c_str());
-		return 1;
-	}
+	dst.reset();
 	
-	int r = _this->create();
-	if (SOCKET_ERROR == r) {
-		lua_pushvalue(L, 1);
-		lua_pushfstring(L, "create socket failed");
-		return 2;
-	}
+	const u8_t* p = (const u8_t*)ptr;
+	if (_chain || _ring || !_ptr || !p || p < _ptr || p + bytes > _ptr + _pos_w)
+		return dst.write(ptr, bytes);
 	
-	if (ip && ip[0]) {
-		r = _this->bind(ip, port);
-		if (SOCKET_ERROR == r) {
-			lua_pushvalue(L, 1);
-			lua_pushfstring(L, "bind %s:%d failed", ip, port);
-			return 2;
-		}
-	} else {
-		r = _this->bind(port);
-		if (SOCKET_ERROR == r) {
-			lua_pushvalue(L, 1);
-			lua_pushfstring(L, "bind port %d failed", port);
-			return 2;
-		}
-	}
-
-	lua_pushvalue(L, 1);
-	lua_pushnil(L);
-	return 2;
+	if (!_shared) {
+		_shared = new Shared;
+		_shared->refs = 1;
+		_shared->ptr = _ptr;
+		_shared->max = _max;
+	}
+	_shared->refs++;
+	
+	dst._shared = _shared;
+	dst._view = true;
+	dst._ptr = _ptr;
+	dst._max = _max;
+	dst._pos_r = (u32_t)(p - _ptr);
+	dst._pos_w = dst._pos_r + bytes;
+	
+	return bytes;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::mylua_sendto(lua_State* L)
+bool SockBuf::unshare(u32_t bytes)
 {
-	SockUdp* _this = mylua_this(L);
+	if (!_shared)
+		return true;
 	
-	const char* host = 0;
-	u32_t ip = 0;
+	// the last one, take the block back
+	if (_shared->refs == 1) {
+		delete _shared;
+		_shared = 0;
+		_view = false;
+		return true;
+	}
 	
-	if (lua_isnumber(L, 2))
-		ip = (u32_t)lua_tonumber(L, 2);
-	else
-		host = luaL_checkstring(L, 2);
+	u32_t l = len();
+	u32_t max = l + bytes;
+	max = ((max + SOCKBUF_BLOCK_SIZE) / SOCKBUF_BLOCK_SIZE) * SOCKBUF_BLOCK_SIZE;
 	
-	u16_t port = (u16_t)luaL_checkinteger(L, 3);
+	u8_t* ptr = (u8_t*)SockPool::current()->alloc(max);
+	if (!ptr)
+		return false;
 	
-	void* ptr = 0;
-	u32_t len = 0;
+	memcpy(ptr, _ptr + _pos_r, l);
+	ptr[l] = 0;
 	
-	int n = 0;
+	dropBlock();
 	
-	if (mylua_input_get(L, 4, ptr, len)) {
-		if (ip > 0)
-			n = _this->sendto((u32_t)ip, port, ptr, len);
-		else if (host && host[0])
-			n = _this->sendto(std::string(host), port, ptr, len);
-	}
+	_ptr = ptr;
+	_max = max;
+	_pos_r = 0;
+	_pos_w = l;
 	
-	lua_pushinteger(L, n);
+	return true;
+}
 
-	return 1;
+void SockBuf::dropBlock()
+{
+	if (_shared) {
+		if (--_shared->refs == 0) {
+			SockPool::current()->release(_shared->ptr, _shared->max);
+			delete _shared;
+		}
+		_shared = 0;
+		_view = false;
+	} else if (_ptr) {
+		SockPool::current()->release(_ptr, _max);
+	}
+	
+	_ptr = 0;
+	_max = 0;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::mylua_recvfrom(lua_State* L)
+u32_t SockBuf::room() const
 {
-	SockUdp* _this = mylua_this(L);
+	if (!_ring)
+		return 0xffffffff;
 	
-	std::string ip;
-	u16_t port;
+	u32_t free = _max - 1 - len();
+	u32_t tail = _max - (_pos_w & (_max - 1));
+	return free < tail ? free : tail;
+}
+
+//----------------------------------------------------------------------------
+// all or nothing, then framing is safe
+//
+int SockBuf::ringWrite(const void* data, u32_t bytes)
+{
+	if (bytes > _max - 1 - len())
+		return 0;
 	
-	char buf[1024 * 8];
-	buf[0] = 0;
+	if (_owner && _pos_w == _pos_r)
+		SockLib::update(_owner);
 	
-	int len = _this->recvfrom(buf, sizeof(buf), ip, &port);
-	if (len > 0)
-		buf[len] = 0;
+	u32_t off = _pos_w & (_max - 1);
+	u32_t part = _max - off;
+	if (part > bytes) part = bytes;
 	
-	const char* fmt = 0;
-	if (lua_gettop(L) >= 2)
-		fmt = luaL_checkstring(L, 2);
-
-	int n = mylua_return_fmt(L, fmt, buf, len > 0 ? len : 0);
+	memcpy(_ptr + off, data, part);
+	memcpy(_ptr, (const u8_t*)data + part, bytes - part);
 	
-	if (n == 1) {
-		lua_pushnumber(L, len);
-	}
-	lua_pushstring(L, ip.c_str());
-	lua_pushnumber(L, port);
+	_pos_w += bytes;
+	_ptr[_pos_w & (_max - 1)] = 0;
 	
-	return n + 2;
+	return bytes;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::mylua_close(lua_State* L)
+bool SockBuf::ringPeek(void* v, u32_t bytes, u32_t from) const
 {
-	SockUdp* _this = mylua_this(L);
-	_this->close();
+	u32_t off = (_pos_r + from) & (_max - 1);
+	u32_t part = _max - off;
+	if (part > bytes) part = bytes;
 	
-	return 0;
+	memcpy(v, _ptr + off, part);
+	memcpy((u8_t*)v + part, _ptr, bytes - part);
+	
+	return true;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::mylua_onevent(lua_State* L)
+u32_t SockBuf::strLen() const
 {
-	SockUdp* _this = mylua_this(L);
-	
-	const char* name = luaL_checkstring(L, 2);
+	u32_t l = len();
 	
-	int handler = -1;
-	if (lua_gettop(L) >= 3) {
-		if (!lua_isfunction(L, -1)) {
-			luaL_error(L, "%s:onevent(%s, func) bad param", SOCKLIB_UDP.c_str(), name);
-			lua_pushvalue(L, 1);
-			return 1;
-		}
-		handler = luaL_ref(L, LUA_REGISTRYINDEX);
+	if (_ring) {
+		u32_t off = _pos_r & (_max - 1);
+		u32_t part = _max - off;
+		if (part > l) part = l;
+		
+		const u8_t* z = (const u8_t*)memchr(_ptr + off, 0, part);
+		if (z) return (u32_t)(z - (_ptr + off));
+		z = (const u8_t*)memchr(_ptr, 0, l - part);
+		return z ? part + (u32_t)(z - _ptr) : l;
 	}
-
-	if (StrCmpI(SOCKEVT_RECV, name) == 0) {
-		SAFE_LUA_REF(_this->_mylua_onRecv, handler);
-	} else if (StrCmpI(SOCKEVT_SEND, name) == 0) {
-		SAFE_LUA_REF(_this->_mylua_onSend, handler);
-	} else if (StrCmpI(SOCKEVT_CLOSE, name) == 0) {
-		SAFE_LUA_REF(_this->_mylua_onClose, handler);
-	} else if (StrCmpI(SOCKEVT_POLL, name) == 0) {
-		SAFE_LUA_REF(_this->_mylua_onPoll, handler);
-	} else {
-		luaL_error(L, "%s:onevent(%s) not support!", SOCKLIB_UDP.c_str(), name);
+	
+	if (!_chain) {
+		const u8_t* z = l ? (const u8_t*)memchr(_ptr + _pos_r, 0, l) : 0;
+		return z ? (u32_t)(z - (_ptr + _pos_r)) : l;
 	}
 	
-	lua_pushvalue(L, 1);
+	u32_t n = 0;
+	for (Seg* seg = _head; seg; seg = seg->next) {
+		const u8_t* z = (const u8_t*)memchr(seg->data + seg->r, 0, seg->w - seg->r);
+		if (z) return n + (u32_t)(z - (seg->data + seg->r));
+		n += seg->w - seg->r;
+	}
 	
-	return 1;
+	return l;
 }
 
 //----------------------------------------------------------------------------
+// the data with a '\0' after it, for a string that runs to the end. a view
+// ends in the parent's bytes, so it is copied out first
 //
-int SockUdp::mylua_setopt(lua_State* L)
+u8_t* SockBuf::strTail()
 {
-	SockUdp* _this = mylua_this(L);
-	return SockRef_mylua_setopt(L, _this);
+	if (_view && !unshare(1))
+		return 0;
+	
+	if (!_chain && !_ring && !_shared && _ptr && _pos_w < _max)
+		_ptr[_pos_w] = 0;
+	
+	return pos();
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::mylua_gc(lua_State* L)
+bool SockBuf::chainPeek(void* v, u32_t bytes, u32_t from) const
 {
-	SockUdp* _this = mylua_this(L);
+	u8_t* p = (u8_t*)v;
 	
-	if (LuaHelper::found(_this)) {
-		DBGLOG("%s{fd=%d}:mylua_gc() free\n", SOCKLIB_UDP.c_str(), _this->fd());
-		_this->close();
-		LuaHelper::remove(_this);
-		SockLib::destroy(_this);
-	} else {
-		DBGLOG("%s{fd=%d}:mylua_gc()\n", SOCKLIB_UDP.c_str(), _this->fd());
+	for (Seg* seg = _head; seg && bytes; seg = seg->next) {
+		u32_t n = seg->w - seg->r;
+		if (from >= n) {
+			from -= n;
+			continue;
+		}
+		
+		n -= from;
+		if (n > bytes) n = bytes;
+		
+		memcpy(p, seg->data + seg->r + from, n);
+		p += n;
+		bytes -= n;
+		from = 0;
 	}
 	
-	SAFE_LUA_UNREF(_this->_mylua_onRecv);
-	SAFE_LUA_UNREF(_this->_mylua_onSend);
-	SAFE_LUA_UNREF(_this->_mylua_onClose);
-	SAFE_LUA_UNREF(_this->_mylua_onPoll);
-
-	return 0;
+	return bytes == 0;
 }
 
 //----------------------------------------------------------------------------
+// drained blocks go to _spare, the last one is reused in place
 //
-int SockUdp::mylua_tostring(lua_State* L)
+void SockBuf::chainConsume(u32_t bytes)
 {
-	SockUdp* _this = mylua_this(L);
-	
-	lua_pushfstring(L, "%s{fd=%d}", SOCKLIB_UDP.c_str(), _this->fd());
+	if (bytes > _size)
+		bytes = _size;
 	
-	return 1;
+	while (_head) {
+		Seg* seg = _head;
+		u32_t n = seg->w - seg->r;
+		if (n > bytes) n = bytes;
+		
+		seg->r += n;
+		_size -= n;
+		bytes -= n;
+		
+		if (seg->r < seg->w)
+			break;
+		
+		if (!seg->next) {
+			seg->r = seg->w = 0;
+			break;
+		}
+		
+		_head = seg->next;
+		if (_spare)
+			segFree(_spare);
+		_spare = seg;
+		
+		if (!bytes)
+			break;
+	}
 }
 
 //----------------------------------------------------------------------------
 //
-int SockUdp::mylua_index(lua_State* L)
+void SockBuf::chainReset()
 {
-	const char* key = luaL_checkstring(L, 2);
-
-	DBGLOG("SockUdp:mylua_index(%s)\n", key);
-
-	lua_pushvalue(L, 1);
-	if (int r = LuaHelper::mylua_index_walk(L, key))
-		return r;
-	
-	lua_pushnil(L);
+	while (_head) {
+		Seg* seg = _head;
+		_head = seg->next;
+		segFree(seg);
+	}
+	if (_spare)
+		segFree(_spare);
 	
-	return 1;
+	_head = _tail = _spare = 0;
+	_size = 0;
 }
 
-#endif // SOCKLIB_TO_LUA
-
 ///////////////////////////////////////////////////////////////////////////////
-// SockBuf
+// SockPool
 //
-#define SOCKBUF_BLOCK_SIZE	(1024 * 4)
+#define SOCKPOOL_CAP		(1024 * 1024 * 4)
+#define SOCKPOOL_RETENTION	(1000 * 10)
 
-SockBuf::SockBuf()
-	: _ptr(0), _max(0), _pos_r(0), _pos_w(0)
+SockPool::SockPool()
+	: _cap(SOCKPOOL_CAP), _retention(SOCKPOOL_RETENTION), _trimTick(0), _closed(false)
 {
+	memset(_classes, 0, sizeof(_classes));
+	memset(&_stats, 0, sizeof(_stats));
 }
 
-SockBuf::~SockBuf()
+SockPool::~SockPool()
 {
-	if (_ptr)
-		free(_ptr);
+	clear();
+	_closed = true;
 }
 
 //----------------------------------------------------------------------------
+// defaultLoop() is no one's to use from a worker thread, it gets the unpooled
+// one then, which is never freed as SockBufs may be released after exit
 //
-int SockBuf::write(const void* data, u32_t bytes)
+SockPool* SockPool::current()
 {
-	if (!data || !bytes)
-		return 0;
-
-	// check enough
-	if ((_pos_w + bytes) >= _max) {
-		if (_pos_r > 0) {
-			memmove(_ptr, _ptr + _pos_r, _pos_w - _pos_r);
-			_pos_w -= _pos_r;
-			_pos_r = 0;
-		}
-		
-		if ((_pos_w + bytes) >= _max) {
-			_max = _pos_w + bytes;
-			_max = ((_max + SOCKBUF_BLOCK_SIZE) / SOCKBUF_BLOCK_SIZE) * SOCKBUF_BLOCK_SIZE;
-			_ptr = (u8_t*)realloc(_ptr, _max);
-
-			if (!_ptr) return 0;
-		}
-	}
-
-	memcpy(_ptr + _pos_w, data, bytes);
-
-	_pos_w += bytes;
-	_ptr[_pos_w] = 0;
-
-//	DBGLOG("SockBuf::write()\n")
-
-	return bytes;
+	SockLoop* loop = SockLoop::threadLoop();
+	if (loop)
+		return &loop->pool();
+	
+	static SockPool* unpooled = [] {
+		SockPool* pool = new SockPool();
+		pool->_closed = true;
+		return pool;
+	}();
+	return unpooled;
 }
 
 //----------------------------------------------------------------------------
 //
-int SockBuf::read(void* data, u32_t bytes)
+void* SockPool::alloc(u32_t& bytes)
 {
-//	DBGLOG("SockBuf::read()\n");
-
-	bytes = peek(data, bytes);
-	_pos_r += bytes;
-	return bytes;
+	u32_t size = CLASS_MIN;
+	int i = 0;
+	while (size < bytes && i < CLASS_COUNT) {
+		size <<= 1;
+		i++;
+	}
+	
+	// may be shared by threads, no stats then
+	if (_closed)
+		return malloc(i == CLASS_COUNT ? bytes : (bytes = size));
+	
+	if (i == CLASS_COUNT) {
+		_stats.misses++;
+		return malloc(bytes);
+	}
+	
+	bytes = size;
+	
+	Class& c = _classes[i];
+	if (c.head) {
+		Node* node = c.head;
+		c.head = node->next;
+		if (--c.count < c.low)
+			c.low = c.count;
+		_stats.cached -= size;
+		_stats.hits++;
+		return node;
+	}
+	
+	_stats.misses++;
+	return malloc(size);
 }
 
 //----------------------------------------------------------------------------
+// bytes must be the one from alloc()
 //
-int SockBuf::peek(void* data, u32_t bytes)
+void SockPool::release(void* ptr, u32_t bytes)
 {
-//	DBGLOG("SockBuf::peek()\n");
+	if (!ptr)
+		return;
 	
-	if (data && bytes) {
-		if (bytes > len())
-			bytes = len();
-		memcpy(data, pos(), bytes);
-		return bytes;
+	u32_t size = CLASS_MIN;
+	int i = 0;
+	while (size < bytes && i < CLASS_COUNT) {
+		size <<= 1;
+		i++;
 	}
-
-	return 0;
+	
+	if (_closed) {
+		free(ptr);
+		return;
+	}
+	
+	Class& c = _classes[i < CLASS_COUNT ? i : 0];
+	if (i == CLASS_COUNT || (c.count + 1) * size > _cap) {
+		_stats.drops++;
+		free(ptr);
+		return;
+	}
+	
+	Node* node = (Node*)ptr;
+	node->next = c.head;
+	c.head = node;
+	c.count++;
+	_stats.cached += size;
 }
 
 //----------------------------------------------------------------------------
+// blocks stayed in free lists since last trim() are not needed
 //
-void SockBuf::reset()
+void SockPool::trim(u64_t now)
 {
-	if (_ptr)
-		free(_ptr);
+	if (!_retention || now - _trimTick < _retention)
+		return;
 	
-	_ptr = 0;
-	_max = _pos_r = _pos_w = 0;
-
-//	DBGLOG("SockBuf::reset()\n");
+	_trimTick = now;
+	
+	u32_t size = CLASS_MIN;
+	for (int i = 0; i < CLASS_COUNT; i++, size <<= 1) {
+		Class& c = _classes[i];
+		while (c.low > 0 && c.head) {
+			Node* node = c.head;
+			c.head = node->next;
+			free(node);
+			c.count--;
+			c.low--;
+			_stats.cached -= size;
+		}
+		c.low = c.count;
+	}
 }
 
-//----------------------------------------------------------------------------
-//
-SockBuf& SockBuf::discard(u32_t bytes)
+void SockPool::clear()
 {
-	if (bytes > len())
-		bytes = len();
-	_pos_r += bytes;
-
-	if (_pos_r >= _pos_w) {
-		_pos_w = 0;
-		_pos_r = 0;
-		_ptr[0] = 0;
-		
-		if (_max > SOCKBUF_BLOCK_SIZE) {
-			free(_ptr);
-			_ptr = (u8_t*) malloc(SOCKBUF_BLOCK_SIZE);
-			_max = SOCKBUF_BLOCK_SIZE;
+	u32_t size = CLASS_MIN;
+	for (int i = 0; i < CLASS_COUNT; i++, size <<= 1) {
+		Class& c = _classes[i];
+		while (c.head) {
+			Node* node = c.head;
+			c.head = node->next;
+			free(node);
+			_stats.cached -= size;
 		}
+		c.count = c.low = 0;
 	}
-	return *this;
 }
 
 #if SOCKLIB_TO_LUA
@@ -2551,7 +6740,7 @@ int SockBuf::mylua_r(lua_State* L)
 	if (lua_gettop(L) >= 3)
 		fmt = luaL_checkstring(L, 3);
 	
-	return mylua_return_fmt(L, fmt, ptr, len);
+	return mylua_return_fmt(L, fmt, ptr, len, _this);
 }
 
 //----------------------------------------------------------------------------
@@ -2567,7 +6756,7 @@ int SockBuf::mylua_rl(lua_State* L)
 	if (lua_gettop(L) >= 2)
 		fmt = luaL_checkstring(L, 2);
 
-	return mylua_return_fmt(L, fmt, ptr, len);
+	return mylua_return_fmt(L, fmt, ptr, len, _this);
 }
 
 //----------------------------------------------------------------------------
@@ -2584,7 +6773,7 @@ int SockBuf::mylua_rs(lua_State* L)
 	if (lua_gettop(L) >= 2)
 		fmt = luaL_checkstring(L, 2);
 
-	return mylua_return_fmt(L, fmt, ptr, len);
+	return mylua_return_fmt(L, fmt, ptr, len, _this);
 }
 
 //----------------------------------------------------------------------------
@@ -2601,7 +6790,7 @@ int SockBuf::mylua_rsl(lua_State* L)
 	if (lua_gettop(L) >= 2)
 		fmt = luaL_checkstring(L, 2);
 
-	return mylua_return_fmt(L, fmt, ptr, len);
+	return mylua_return_fmt(L, fmt, ptr, len, _this);
 }
 
 //----------------------------------------------------------------------------
@@ -2657,7 +6846,7 @@ int SockBuf::mylua_p(lua_State* L)
 	if (lua_gettop(L) >= 3)
 		fmt = luaL_checkstring(L, 3);
 	
-	return mylua_return_fmt(L, fmt, ptr, len);
+	return mylua_return_fmt(L, fmt, ptr, len, _this);
 }
 
 //----------------------------------------------------------------------------
@@ -2673,7 +6862,7 @@ int SockBuf::mylua_pl(lua_State* L)
 	if (lua_gettop(L) >= 2)
 		fmt = luaL_checkstring(L, 2);
 
-	return mylua_return_fmt(L, fmt, ptr, len);
+	return mylua_return_fmt(L, fmt, ptr, len, _this);
 }
 
 //----------------------------------------------------------------------------
@@ -2690,7 +6879,7 @@ int SockBuf::mylua_ps(lua_State* L)
 	if (lua_gettop(L) >= 2)
 		fmt = luaL_checkstring(L, 2);
 
-	return mylua_return_fmt(L, fmt, ptr, len);
+	return mylua_return_fmt(L, fmt, ptr, len, _this);
 }
 
 //----------------------------------------------------------------------------
@@ -2707,7 +6896,7 @@ int SockBuf::mylua_psl(lua_State* L)
 	if (lua_gettop(L) >= 2)
 		fmt = luaL_checkstring(L, 2);
 
-	return mylua_return_fmt(L, fmt, ptr, len);
+	return mylua_return_fmt(L, fmt, ptr, len, _this);
 }
 
 //----------------------------------------------------------------------------
@@ -2776,10 +6965,10 @@ int SockBuf::mylua_sub(lua_State* L)
 		fmt = lua_tostring(L, 4);
 	
 	if (from <= _le && from > 0 && end > 0 && from <= end) {
-		void* ptr = _this->pos() + from - 1;
+		void* ptr = _this->pullup(end) + from - 1;
 		u32_t len = end - from + 1;
 		
-		return mylua_return_fmt(L, fmt, ptr, len);
+		return mylua_return_fmt(L, fmt, ptr, len, _this);
 	} else {
 		lua_pushnil(L);
 		return 1;
@@ -2822,6 +7011,43 @@ int SockBuf::mylua_reset(lua_State* L)
 	return 1;
 }
 
+//----------------------------------------------------------------------------
+// buf:chain(true) or buf:chain() -> bool
+//
+int SockBuf::mylua_chain(lua_State* L)
+{
+	SockBuf* _this = mylua_this(L);
+	
+	if (lua_gettop(L) < 2) {
+		lua_pushboolean(L, _this->isChain());
+		return 1;
+	}
+	
+	_this->setChain(lua_toboolean(L, 2) != 0);
+	lua_settop(L, 1);
+	
+	return 1;
+}
+
+//----------------------------------------------------------------------------
+// buf:ring(65536) or buf:ring(0) to turn off, buf:ring() -> capacity or 0
+//
+int SockBuf::mylua_ring(lua_State* L)
+{
+	SockBuf* _this = mylua_this(L);
+	
+	if (lua_gettop(L) < 2) {
+		lua_pushinteger(L, _this->isRing() ? _this->_max : 0);
+		return 1;
+	}
+	
+	if (!_this->setRing((u32_t)luaL_checkinteger(L, 2)))
+		luaL_error(L, "%s:ring(%d) too small", SOCKLIB_BUF.c_str(), (int)lua_tointeger(L, 2));
+	lua_settop(L, 1);
+	
+	return 1;
+}
+
 //----------------------------------------------------------------------------
 //
 int SockBuf::mylua_buffer(lua_State* L)
@@ -2835,7 +7061,7 @@ int SockBuf::mylua_buffer(lua_State* L)
 	if (lua_gettop(L) >= 2)
 		fmt = luaL_checkstring(L, 2);
 
-	return mylua_return_fmt(L, fmt, ptr, len);
+	return mylua_return_fmt(L, fmt, ptr, len, _this);
 }
 
 //----------------------------------------------------------------------------
@@ -2940,6 +7166,20 @@ int SockBuf::mylua_tostring(lua_State* L)
 {
 	SockBuf* _this = mylua_this(L);
 	
+	if (_this->_ring) {
+		lua_pushfstring(L, "%s{ring=%d, posr=%d, posw=%d, len=%d}", SOCKLIB_BUF.c_str(),
+			_this->_max, _this->_pos_r & (_this->_max - 1), _this->_pos_w & (_this->_max - 1), _this->len());
+		return 1;
+	}
+	
+	if (_this->_chain) {
+		int n = 0;
+		for (Seg* seg = _this->_head; seg; seg = seg->next)
+			n++;
+		lua_pushfstring(L, "%s{chain=%d, len=%d}", SOCKLIB_BUF.c_str(), n, _this->len());
+		return 1;
+	}
+	
 	lua_pushfstring(L, "%s{ptr=%p, max=%d, posr=%d, posw=%d, len=%d}", SOCKLIB_BUF.c_str(),
 		_this->_ptr, _this->_max, _this->_pos_r, _this->_pos_w, _this->len());
 	
@@ -3840,136 +8080,555 @@ std::string Base64_decode(const char* sz, u32_t len)
 ///////////////////////////////////////////////////////////////////////////////
 // Timer
 //
-Timer::TimerMap Timer::_refs;
-Timer::TimerMap Timer::_news;
-Timer::TmrIdMap Timer::_dies;
+//----------------------------------------------------------------------------
+// lua state may be closed already, don't touch the refs
+//
+Timer::Wheel::~Wheel()
+{
+	for (auto& it : refs)
+		delete it.second;
+}
 
-#if SOCKLIB_TO_LUA
-Timer::TmrIdMap Timer::_mylua_refs;
-#endif
+Timer::Wheel& Timer::wheel()
+{
+	return SockLoop::current()->timers();
+}
 
+//----------------------------------------------------------------------------
+//
 u64_t Timer::add(Timer& tmr)
 {
-	static u64_t _base = 0;
+	// unique in all loops
+	static std::atomic<u64_t> _base(0);
 	
-	tmr._timerId = ++_base;
-	_news[tmr._timerId] = tmr;
-
-#if SOCKLIB_TO_LUA
-	if (tmr._mylua_ref >= 0)
-		_mylua_refs[tmr._timerId] = tmr._mylua_ref;
-#endif
+	Wheel& w = wheel();
+	u64_t tick = Util::tick();
+	if (w.refs.empty())
+		w.jiffies = tick;
+	
+	Timer* obj = new Timer(tmr);
+	obj->_list = nullptr;
+	obj->_prev = obj->_next = nullptr;
+	obj->_dead = false;
+	obj->_expires = tick + obj->_interval;
+	
+	tmr._timerId = obj->_timerId = ++_base;
+	w.refs[obj->_timerId] = obj;
+	
+	link(w, obj);
 
 	return tmr._timerId;
 }
 
+//----------------------------------------------------------------------------
+//
 void Timer::remove(u64_t tmrId)
 {
-	_news.erase(tmrId);
-	_dies[tmrId] = 1;
+	Wheel& w = wheel();
+	TimerMap::iterator it = w.refs.find(tmrId);
+	if (it == w.refs.end())
+		return;
+	
+	Timer* tmr = it->second;
+	w.refs.erase(it);
+	unlink(tmr);
+	
+	// onTick() will destroy it
+	if (tmr == w.firing)
+		tmr->_dead = true;
+	else
+		destroy(tmr);
+}
 
+//----------------------------------------------------------------------------
+//
+void Timer::destroy(Timer* tmr)
+{
 #if SOCKLIB_TO_LUA
-	TmrIdMap::iterator it = _mylua_refs.find(tmrId);
-	if (it != _mylua_refs.end()) {
-		luaL_unref(SockLib::luaState(), LUA_REGISTRYINDEX, it->second);
-		_mylua_refs.erase(it);
-	}
+	if (tmr->_mylua_ref >= 0)
+		luaL_unref(SockLib::luaState(), LUA_REGISTRYINDEX, tmr->_mylua_ref);
 #endif // SOCKLIB_TO_LUA
+	delete tmr;
 }
 
+//----------------------------------------------------------------------------
+//
+void Timer::link(Wheel& w, Timer* tmr)
+{
+	u64_t expires = tmr->_expires;
+	i64_t idx = (i64_t)(expires - w.jiffies);
+	Timer** list;
+	
+	if (idx < 0) {
+		list = &w.tv1[w.jiffies & TVR_MASK];
+	} else if (idx < TVR_SIZE) {
+		list = &w.tv1[expires & TVR_MASK];
+	} else {
+		int n = 0;
+		while (n < 3 && idx >= (1LL << (TVR_BITS + (n + 1) * TVN_BITS)))
+			++n;
+		// too far, it will be relinked after cascade()
+		if (idx > 0xffffffffLL)
+			expires = w.jiffies + 0xffffffffLL;
+		list = &w.tvn[n][(expires >> (TVR_BITS + n * TVN_BITS)) & TVN_MASK];
+	}
+	
+	tmr->_list = list;
+	tmr->_prev = nullptr;
+	tmr->_next = *list;
+	if (*list)
+		(*list)->_prev = tmr;
+	*list = tmr;
+}
+
+//----------------------------------------------------------------------------
+//
+void Timer::unlink(Timer* tmr)
+{
+	if (!tmr->_list)
+		return;
+	
+	if (tmr->_prev)
+		tmr->_prev->_next = tmr->_next;
+	else
+		*tmr->_list = tmr->_next;
+	if (tmr->_next)
+		tmr->_next->_prev = tmr->_prev;
+	
+	tmr->_list = nullptr;
+	tmr->_prev = tmr->_next = nullptr;
+}
+
+//----------------------------------------------------------------------------
+// move timers in tvn[n][index] down to lower level
+//
+void Timer::cascade(Wheel& w, int n, int index)
+{
+	Timer* tmr = w.tvn[n][index];
+	w.tvn[n][index] = nullptr;
+	
+	while (tmr) {
+		Timer* next = tmr->_next;
+		tmr->_list = nullptr;
+		link(w, tmr);
+		tmr = next;
+	}
+}
+
+//----------------------------------------------------------------------------
+// only expired slots are touched
+//
 void Timer::poll()
 {
-	for (auto& it : _news) {
-		_refs[it.first] = it.second;
+	Wheel& w = wheel();
+	u64_t tick = Util::tick();
+	
+	if (w.refs.empty()) {
+		w.jiffies = tick + 1;
+		return;
+	}
+	
+	while (w.jiffies <= tick) {
+		int index = (int)(w.jiffies & TVR_MASK);
+		
+		if (!index) {
+			for (int n = 0; n < 4; ++n) {
+				int i = (int)((w.jiffies >> (TVR_BITS + n * TVN_BITS)) & TVN_MASK);
+				cascade(w, n, i);
+				if (i) break;
+			}
+		}
+		
+		++w.jiffies;
+		
+		// off the wheel first, a periodic one may be relinked to this slot
+		Timer* list = w.tv1[index];
+		w.tv1[index] = nullptr;
+		for (Timer* tmr = list; tmr; tmr = tmr->_next)
+			tmr->_list = &list;
+		
+		while (Timer* tmr = list) {
+			unlink(tmr);
+			tmr->onTick(tick);
+		}
 	}
-	_news.clear();
+}
+
+//----------------------------------------------------------------------------
+// only tv1 is scanned, timers in tvn are cascaded at the end of tv1,
+// so wake up there at latest
+//
+i64_t Timer::nextTimeout()
+{
+	Wheel& w = wheel();
+	if (w.refs.empty())
+		return -1;
+	
+	u64_t expires = w.jiffies;
 	
-	for (auto& it : _dies) {
-		_refs.erase(it.first);
+	if (expires & TVR_MASK) {
+		for (int i = (int)(expires & TVR_MASK); i < TVR_SIZE && !w.tv1[i]; ++i)
+			++expires;
 	}
-	_dies.clear();
 	
 	u64_t tick = Util::tick();
-	for (auto& it : _refs) {
-		it.second.onTick(tick);
-	}
+	return expires > tick ? (i64_t)(expires - tick) : 0;
 }
 
+//----------------------------------------------------------------------------
+//
 void Timer::onTick(u64_t tick)
 {
-	if (!_curTick || _curTick > tick)
-		_curTick = tick;
+	Wheel& w = wheel();
+	bool keep = true;
+	
+	++_curLoops;
+	
+	if (_maxLoops < 0 || _curLoops <= _maxLoops) {
+		if (_callback) {
+			w.firing = this;
+			keep = _callback(*this);
+			w.firing = nullptr;
+		}
+	}
+	
+	if (_dead) {
+		destroy(this);
+	} else if (!keep || (_maxLoops >= 0 && _curLoops >= _maxLoops)) {
+		Timer::remove(timerId());
+	} else {
+		// at least next tick, not to run again in this poll
+		_expires = tick + (_interval ? _interval : 1);
+		link(w, this);
+	}
+}
+	
+///////////////////////////////////////////////////////////////////////////////
+// Resolver
+//
+
+//----------------------------------------------------------------------------
+// workers are detached and may be in getaddrinfo() at exit, so it's never freed
+//
+Resolver::State& Resolver::state()
+{
+	static State* st = new State();
+	return *st;
+}
 
-	if ((_curTick + _interval) <= tick) {
-		_curTick = tick;
+//----------------------------------------------------------------------------
+// Util::tick() is cached per loop thread, workers have none
+//
+u64_t Resolver::now()
+{
+	return Util::nsec() / 1000000;
+}
 
-		++_curLoops;
-		
-		if (_maxLoops < 0 || _curLoops <= _maxLoops) {
-			if (_callback) {
-				if (!_callback(*this))
-					Timer::remove(timerId());
-			}
+//----------------------------------------------------------------------------
+//
+void Resolver::setup(u32_t threads, u32_t ttl, u32_t negTtl, u32_t entries)
+{
+	State& st = state();
+	AutoMutex locker(st.mutex);
+	
+	if (threads) st.maxThreads = threads;
+	if (ttl) st.ttl = ttl;
+	if (negTtl) st.negTtl = negTtl;
+	if (entries) st.entries = entries;
+	
+	trim(st);
+}
+
+//----------------------------------------------------------------------------
+// a name being resolved is not fresh, even it has an old answer
+//
+bool Resolver::probe(const std::string& host, Addrs& addrs, int* err)
+{
+	addrs.clear();
+	if (err) *err = 0;
+	
+	u32_t ip = inet_addr(host.c_str());
+	if (ip != INADDR_NONE) {
+		addrs.push_back(ip);
+		return true;
+	}
+	
+	State& st = state();
+	AutoMutex locker(st.mutex);
+	
+	auto it = st.cache.find(host);
+	if (it == st.cache.end() || it->second.pending || it->second.expires <= now())
+		return false;
+	
+	addrs = it->second.addrs;
+	if (err) *err = it->second.err;
+	
+	return true;
+}
+
+//----------------------------------------------------------------------------
+// the callback stays in this loop, only the id goes to the workers
+//
+u64_t Resolver::resolve(const std::string& host, const Callback& func)
+{
+	static std::atomic<u64_t> _base(0);
+	
+	SockLoop* loop = SockLoop::current();
+	u64_t reqId = 0;
+	if (func) {
+		reqId = ++_base;
+		loop->resolves()[reqId] = func;
+	}
+	
+	int err = 0;
+	Addrs addrs;
+	if (probe(host, addrs, &err)) {
+		if (reqId)
+			loop->post([reqId, err, addrs] { deliver(reqId, err, addrs); });
+		return reqId;
+	}
+	
+	State& st = state();
+	AutoMutex locker(st.mutex);
+	
+	Entry& e = st.cache[host];
+	if (reqId)
+		e.waiters.push_back(Waiter{ loop, reqId });
+	
+	// asked already, share the answer
+	if (e.pending)
+		return reqId;
+	
+	e.pending = true;
+	st.queue.push_back(host);
+	
+	if (st.idle > 0 || st.threads >= st.maxThreads) {
+		st.cond.notify_one();
+	} else {
+		++st.threads;
+		std::thread(work).detach();
+	}
+	
+	return reqId;
+}
+
+//----------------------------------------------------------------------------
+// the answer may be posted already, it's dropped in deliver()
+//
+void Resolver::cancel(u64_t reqId)
+{
+	if (reqId > 0)
+		SockLoop::current()->resolves().erase(reqId);
+}
+
+//----------------------------------------------------------------------------
+//
+void Resolver::cancel(SockLoop* loop)
+{
+	State& st = state();
+	AutoMutex locker(st.mutex);
+	
+	for (auto& it : st.cache) {
+		std::vector<Waiter>& waiters = it.second.waiters;
+		waiters.erase(std::remove_if(waiters.begin(), waiters.end(), [loop](const Waiter& w) {
+			return w.loop == loop;
+		}), waiters.end());
+	}
+}
+
+//----------------------------------------------------------------------------
+//
+int Resolver::lookup(const std::string& host, Addrs& addrs)
+{
+	int err = 0;
+	if (probe(host, addrs, &err))
+		return err;
+	
+	err = query(host, addrs);
+	
+	State& st = state();
+	AutoMutex locker(st.mutex);
+	store(st, host, err, addrs);
+	
+	return err;
+}
+
+//----------------------------------------------------------------------------
+// in a worker, or the caller of lookup()
+//
+int Resolver::query(const std::string& host, Addrs& addrs)
+{
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;	// one entry per address
+	
+	addrinfo* res = nullptr;
+	int err = ::getaddrinfo(host.c_str(), nullptr, &hints, &res);
+	if (err)
+		return err;
+	
+	for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_family != AF_INET || !ai->ai_addr)
+			continue;
+		u32_t ip = ((sockaddr_in*)ai->ai_addr)->sin_addr.s_addr;
+		if (std::find(addrs.begin(), addrs.end(), ip) == addrs.end())
+			addrs.push_back(ip);
+	}
+	
+	::freeaddrinfo(res);
+	
+	return addrs.empty() ? EAI_NONAME : 0;
+}
+
+//----------------------------------------------------------------------------
+// with the mutex held, answers are posted under it, so cancel(loop) misses none
+//
+void Resolver::store(State& st, const std::string& host, int err, const Addrs& addrs)
+{
+	Entry& e = st.cache[host];
+	e.addrs = addrs;
+	e.err = err;
+	e.expires = now() + (err ? st.negTtl : st.ttl);
+	e.pending = false;
+	
+	for (auto& w : e.waiters) {
+		u64_t reqId = w.reqId;
+		w.loop->post([reqId, err, addrs] { deliver(reqId, err, addrs); });
+	}
+	e.waiters.clear();
+	
+	trim(st);
+}
+
+//----------------------------------------------------------------------------
+// expired ones go first, then the ones to expire soonest, pending ones stay
+//
+void Resolver::trim(State& st)
+{
+	if (st.cache.size() <= st.entries)
+		return;
+	
+	u64_t tick = now();
+	for (auto it = st.cache.begin(); it != st.cache.end(); ) {
+		if (!it->second.pending && it->second.expires <= tick)
+			it = st.cache.erase(it);
+		else
+			++it;
+	}
+	
+	while (st.cache.size() > st.entries) {
+		auto oldest = st.cache.end();
+		for (auto it = st.cache.begin(); it != st.cache.end(); ++it) {
+			if (!it->second.pending && (oldest == st.cache.end() || it->second.expires < oldest->second.expires))
+				oldest = it;
+		}
+		if (oldest == st.cache.end())
+			break;
+		st.cache.erase(oldest);
+	}
+}
+
+//----------------------------------------------------------------------------
+//
+void Resolver::work()
+{
+	State& st = state();
+	std::unique_lock<std::mutex> lock(st.mutex);
+	
+	for (;;) {
+		while (st.queue.empty()) {
+			++st.idle;
+			st.cond.wait(lock);
+			--st.idle;
 		}
 		
-		if (_maxLoops >= 0 && _curLoops > _maxLoops)
-			Timer::remove(timerId());
+		std::string host = std::move(st.queue.front());
+		st.queue.pop_front();
+		
+		lock.unlock();
+		Addrs addrs;
+		int err = query(host, addrs);
+		lock.lock();
+		
+		store(st, host, err, addrs);
 	}
 }
+
+//----------------------------------------------------------------------------
+// in the poll thread
+//
+void Resolver::deliver(u64_t reqId, int err, const Addrs& addrs)
+{
+	Waits& waits = SockLoop::current()->resolves();
+	auto it = waits.find(reqId);
+	if (it == waits.end())
+		return;
+	
+	Callback func = std::move(it->second);
+	waits.erase(it);
+	func(err, addrs);
+}
 	
 ///////////////////////////////////////////////////////////////////////////////
 // Util
 //
 
-Util::IPCache Util::_ipcache;
-std::mutex Util::_ipmutex;
+thread_local u64_t Util::_tick = 0;
+thread_local bool Util::_tickCached = false;
 
+u64_t Util::nsec()
+{
 #ifdef _WIN32
-int gettimeofday(struct timeval *tp, void *tzp)
-{
-	time_t clock;
-	struct tm tm;
-	SYSTEMTIME wtm;
-	GetLocalTime(&wtm);
-	tm.tm_year = wtm.wYear - 1900;
-	tm.tm_mon = wtm.wMonth - 1;
-	tm.tm_mday = wtm.wDay;
-	tm.tm_hour = wtm.wHour;
-	tm.tm_min = wtm.wMinute;
-	tm.tm_sec = wtm.wSecond;
-	tm.tm_isdst = -1;
-	clock = mktime(&tm);
-	tp->tv_sec = clock;
-	tp->tv_usec = wtm.wMilliseconds * 1000;
-	return (0);
-}
+	static LARGE_INTEGER freq = { 0 };
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (u64_t)(now.QuadPart / freq.QuadPart) * 1000000000ULL +
+		(u64_t)(now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 #endif // _WIN32
+}
+
+u64_t Util::usec()
+{
+	return nsec() / 1000;
+}
+
+u64_t Util::updateTick()
+{
+	_tick = nsec() / 1000000;
+	return _tick;
+}
 
 u64_t Util::tick()
 {
-    struct timeval tv;     
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	return _tickCached ? _tick : updateTick();
 }
 
+bool Util::cacheTick(bool b)
+{
+	bool old = _tickCached;
+	if (b && !old)
+		updateTick();
+	_tickCached = b;
+	return old;
+}
 
 //----------------------------------------------------------------------------
-//	gethostbyname() is blocking
+//	blocks on a name not cached
 //
 u32_t Util::ips2n(const std::string& addr)
 {
-	u32_t ip = inet_addr(addr.c_str());
-
-	if (!ip || ip == INADDR_NONE) {
-		hostent* host = ::gethostbyname(addr.c_str());
-		if (host && host->h_length)  {
-			sockaddr_in addr = { 0 };
-			memcpy(&addr.sin_addr, host->h_addr_list[0], host->h_length);
-			ip = addr.sin_addr.s_addr;
-		}
-	}
+	Resolver::Addrs addrs;
+	if (Resolver::lookup(addr, addrs))
+		return 0;
 	
-	return (ip == INADDR_NONE ? 0 : ip);
+	return addrs[0];
 }
 
 std::string Util::ipn2s(u32_t ip)
@@ -3982,40 +8641,13 @@ std::string Util::ipn2s(u32_t ip)
 
 u32_t Util::ipprobe(const std::string& addr)
 {
-	u32_t ip = inet_addr(addr.c_str());
-	
-	if (ip == INADDR_NONE) {
-		AutoMutex locker(_ipmutex);
-		if (_ipcache.find(addr) != _ipcache.end()) {
-			ip = _ipcache[addr];
-		} else {
-			_ipcache[addr] = 0;
-			
-			auto t = std::thread([addr] {
-				u32_t ip = 0;
-				hostent* host = ::gethostbyname(addr.c_str());
-				if (host && host->h_length)  {
-					sockaddr_in addr = { 0 };
-					memcpy(&addr.sin_addr, host->h_addr_list[0], host->h_length);
-					ip = addr.sin_addr.s_addr;
-				}
-				if (ip != INADDR_NONE && ip > 0)
-				{
-					AutoMutex locker(_ipmutex);
-					_ipcache[addr] = ip;
-				} else {
-					AutoMutex locker(_ipmutex);
-					_ipcache.erase(addr);
-				}
-			});
-			t.detach();
-		}
+	Resolver::Addrs addrs;
+	if (!Resolver::probe(addr, addrs)) {
+		Resolver::resolve(addr, nullptr);
+		return 0;
 	}
-
-	if (ip == INADDR_NONE)
-		ip = 0;
-
-	return ip;
+	
+	return addrs.empty() ? 0 : addrs[0];
 }
 
 void Util::addr2ips(const sockaddr_in* addr, std::string& ip, u16_t* port)
@@ -4354,6 +8986,18 @@ int Util::mylua_tick(lua_State* L)
 	return 1;
 }
 
+int Util::mylua_usec(lua_State* L)
+{
+	lua_pushnumber(L, Util::usec());
+	return 1;
+}
+
+int Util::mylua_nsec(lua_State* L)
+{
+	lua_pushnumber(L, Util::nsec());
+	return 1;
+}
+
 int Util::mylua_urlenc(lua_State* L)
 {
 	const char* url = luaL_checkstring(L, 1);
@@ -4392,6 +9036,43 @@ int Util::mylua_ipprobe(lua_State* L)
 	return 1;
 }
 
+//----------------------------------------------------------------------------
+// socklib.util.resolve(host, function(ips, err) end)
+//	ips: { ipn, ... } or nil if err is not 0
+//
+int Util::mylua_resolve(lua_State* L)
+{
+	std::string host = luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	
+	lua_pushvalue(L, 2);
+	int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	
+	Resolver::resolve(host, [ref, host](int err, const Resolver::Addrs& addrs) {
+		lua_State* L = SockLib::luaState();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+		
+		if (err) {
+			lua_pushnil(L);
+		} else {
+			lua_createtable(L, (int)addrs.size(), 0);
+			for (size_t i = 0; i < addrs.size(); ++i) {
+				lua_pushnumber(L, addrs[i]);
+				lua_rawseti(L, -2, (int)i + 1);
+			}
+		}
+		lua_pushinteger(L, err);
+		
+		if (0 != lua_pcall(L, 2, 0, 0)) {
+			DBGLOG("%s:resolve(%s) call error: %s\n", SOCKLIB_UTIL.c_str(), host.c_str(), lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+	});
+	
+	return 0;
+}
+
 int Util::mylua_settimer(lua_State* L)
 {
 	Timer obj;
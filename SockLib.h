@@ -42,6 +42,26 @@
 #define SOCKLIB_NAME		"socklib"
 #endif
 
+// use epoll() instead of select() to poll sockets?
+// (linux only, select() is always the portable fallback)
+#ifndef SOCKLIB_EPOLL
+	#if defined(__linux__) || defined(ANDROID)
+	#define SOCKLIB_EPOLL	1
+	#else
+	#define SOCKLIB_EPOLL	0
+	#endif
+#endif
+
+// SockLoop slots by a map of fd to dense indices instead of by fd?
+// (windows SOCKETs are sparse and big, unix fds are small and dense)
+#ifndef SOCKLIB_SLOTMAP
+	#ifdef _WIN32
+	#define SOCKLIB_SLOTMAP	1
+	#else
+	#define SOCKLIB_SLOTMAP	0
+	#endif
+#endif
+
 // use a cpp namespace?
 // you can change this name
 #if 1
@@ -54,7 +74,9 @@
 
 #include <string>
 #include <vector>
+#include <deque>
 #include <map>
+#include <unordered_map>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -62,7 +84,9 @@
 #include <iostream>
 #include <functional>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
+#include <atomic>
 
 #ifdef __APPLE__
 	#include <sys/malloc.h>
@@ -75,6 +99,10 @@
 	#include <windows.h>
 	#include <process.h>
 	#include <ws2tcpip.h>
+	struct iovec {
+		void*	iov_base;
+		size_t	iov_len;
+	};
 #else // !_WIN32
 	#include <sys/socket.h>
 	#include <netinet/tcp.h>
@@ -83,6 +111,10 @@
 	#include <arpa/inet.h>
 	#include <netdb.h>
 	#include <unistd.h>
+	#include <sys/uio.h>
+	#if SOCKLIB_EPOLL
+	#include <sys/epoll.h>
+	#endif
 	#define SOCKET_ERROR -1
 #endif // _WIN32
 
@@ -247,7 +279,7 @@ public:
 	static int mylua_index(lua_State* L);
 
 protected:
-	static Objects _objs;
+	static thread_local Objects _objs;	// one lua state per thread
 };
 #endif // SOCKLIB_TO_LUA
 
@@ -259,7 +291,10 @@ class SockLib;
 class SockRef;
 class SockTcp;
 class SockUdp;
+class SockRudp;
 class SockBuf;
+class SockWakeup;
+class SockLoop;
 
 //typedef std::shared_ptr<SockRef> SockPtr;
 typedef SockRef* SockPtr;
@@ -294,7 +329,24 @@ public:
 		STA_ACCEPTED,
 	};
 	
-	typedef std::map<const SockPtr,  int> SockMap;
+	enum {
+		PEND_NONE,
+		PEND_ADD,
+		PEND_REMOVE,
+		PEND_DESTROY,
+	};
+	
+	struct SockSlot {
+		SockPtr	ref = nullptr;
+		u32_t	gen = 0;	// changed when ref in/out, to find stale handles
+#if SOCKLIB_SLOTMAP
+		int		fd = -1;
+#endif // SOCKLIB_SLOTMAP
+	};
+	
+	typedef std::vector<SockSlot> SockSlots;	// indexed by fd, or SockLoop::slotOf()
+	typedef std::pair<SockPtr, int> SockEvt;
+	typedef std::vector<SockEvt> SockEvts;
 	
 	static bool init();
 	static void cleanup();
@@ -325,32 +377,43 @@ public:
 		return create<SockUdp>();
 	}
 
+	// all below work on the ref's loop, or SockLoop::current()
 	static void destroy(SockPtr ref);
+	// deleted before the next poll, for a closed ref never given to lua
+	static void release(SockPtr ref);
 	
 	static void add(SockPtr ref, int event);
 	static void modify(SockPtr ref, int event);
 	static void remove(const SockPtr ref);
 	static bool found(const SockPtr ref);
 	
+	// ref->careSend()/careRecv() may changed, recheck it before next poll
+	static void update(SockPtr ref);
+	
+	// ref->onPoll() is called every poll only after addPoll()
+	static void addPoll(SockPtr ref);
+	static void removePoll(SockPtr ref);
+	
+	// ref->onFlush() once at the end of this poll, see SockLoop::flushLater()
+	static void flushLater(SockPtr ref);
+	
+	// wait at most usec, and no longer than the nearest timer
+	static const u32_t POLL_FOREVER = 0xffffffff;
 	static void poll(u32_t usec = 10);
+	
+	// poll() until stop(), stop() is thread safe
+	static void run(u32_t usec = POLL_FOREVER);
+	static void stop();
+	
+	// func is called in the poll thread later, post()/wakeup() are thread safe
+	static void post(const std::function<void()>& func);
+	static void wakeup();
 
 	static const char* libName() { return _libName.c_str(); }
 
 protected:
-    static int _poll_per_FD_SETSIZE(SockMap::iterator& begin, u32_t usec = 10);
-	static void beforePoll();
-	static void afterPoll() { dispatch(); }
-	static void dispatch();
-
-protected:
-	static SockMap _news;
-	static SockMap _refs;
-	static SockMap _clos;
-	static SockMap _dies;
-
-	static fd_set	_fdr, _fdw, _fde;
-	static timeval	_tv;
-
+	static SockLoop* loopOf(SockPtr ref);
+	
 	static std::string	_libName;
 	
 #if SOCKLIB_TO_LUA
@@ -373,19 +436,22 @@ public:
 		return luaLoadString(luaState(), str, protect);
 	}
 	
-	static lua_State* luaState() { return _luaState; }
+	// lua state of SockLoop::current()
+	static lua_State* luaState();
 
 // call @LUA
 public:
 	static int mylua_tcp(lua_State* L);
 	static int mylua_udp(lua_State* L);
+	static int mylua_rudp(lua_State* L);
 	static int mylua_buf(lua_State* L);
 	
 	static int mylua_poll(lua_State* L);
+	static int mylua_run(lua_State* L);
+	static int mylua_stop(lua_State* L);
+	static int mylua_pool(lua_State* L);
 	
 private:
-	static lua_State* _luaState;
-	
 	LuaHelper _luaHelper;
 #endif // SOCKLIB_TO_LUA
 };
@@ -420,7 +486,11 @@ public:
 	
 	int setNonBlock(bool b);
 	int setReuseAddr(bool b);
+	int setReusePort(bool b);
 	int setBroadcast(bool b);
+	int setNoDelay(bool b);		// TCP_NODELAY, no Nagle delay
+	int setCork(bool b);		// TCP_CORK/TCP_NOPUSH, hold partial segments
+	int setQuickAck(bool b);	// TCP_QUICKACK, Linux clears it by itself
 	int setRecvTimeout(int seconds);
 	int setSendTimeout(int seconds);
 	int setRecvBufferSize(int bytes);
@@ -433,7 +503,8 @@ public:
 public:
 	virtual void onConnect(bool ok) {}
 	virtual void onAccept() {}
-	virtual void onPoll() 	{}
+	virtual void onPoll() 	{}		// see SockLib::addPoll()
+	virtual void onFlush()	{}		// see SockLib::flushLater()
 	virtual void onRecv()	= 0;
 	virtual void onSend()	= 0;
 	virtual void onClose()	= 0;
@@ -442,10 +513,20 @@ protected:
 	int	_careEvent = SockLib::EVT_NONE;
 	int _fireEvent = SockLib::EVT_NONE;
 	int _sockState = SockLib::STA_CLOSED;
+	int _pollEvent = -1;	// registered in poller, -1 = not registered
+	bool _pollDirty = false;
+	bool _careOnPoll = false;
+	bool _flushDirty = false;	// in SockLoop::_flushes
+	int _slot = -1;			// index in SockLoop::_slots
+	int _pending = SockLib::PEND_NONE;
+	int _noDelayOpt = -1;	// setNoDelay() of the user, -1 never called
+	bool _corked = false;	// setCork(true) of the user
+	SockLoop* _loop = nullptr;	// bound in the first add()
 	
 	int _fd = -1;
 	
 	friend SockLib;
+	friend SockLoop;
 	
 #if SOCKLIB_TO_LUA
 	friend LuaHelper;
@@ -464,10 +545,21 @@ protected:
 public:
 	int create();
 	
+	// a name is resolved by Resolver without blocking, onConnect() tells
 	int connect(const std::string& host, u16_t port);
 	int connect(u32_t ip, u16_t port);
 	int connect(const sockaddr_in* addr);
 	
+	// onConnect(false) if not connected in msec, resolving included, 0 for none
+	void setConnectTimeout(u32_t msec) { _connTimeout = msec; }
+	
+	// delay > 0: connect(host) races the resolved addrs, one more starts every
+	// delay msec or at once when one fails, the first connected one wins and
+	// the others are closed. its fd replaces this one's, so socket options
+	// go after onConnect(true)
+	enum { RACE_DELAY = 250 };
+	void setConnectRace(u32_t delay) { _raceDelay = delay; }
+	
 	int bind(const std::string& ip, u16_t port);
 	int bind(u32_t ip, u16_t port);
 	int bind(const sockaddr_in* addr);
@@ -475,12 +567,59 @@ public:
 	
 	int listen(int logs = 5);
 	
+	// one SO_REUSEPORT listener per loop on the same addr, the kernel balances
+	// connections among them, onAccept(listener, shard) comes in the loop's thread
+	typedef std::function<void(SockTcp*, int)> ON_SHARD_ACCEPT;
+	static std::vector<SockTcp*> listenShards(const std::vector<SockLoop*>& loops,
+		const std::string& ip, u16_t port, const ON_SHARD_ACCEPT& onAccept, int logs = 128);
+	
 	int accept(sockaddr_in* addr);
 	
-	void acceptfd(int fd);
+	// accept up to max pending connections as non-blocking SockTcp, returns the count
+	int accept(std::vector<SockTcp*>& socks, int max);
+	
+	// n > 0: onAccept() accepts up to n connections per poll, and passes them
+	// to _onAcceptBatch (who owns them), or to lua ACCEPT event as an array
+	void setAcceptBatch(int n);
+	
+	// nonBlocking: fd is non-blocking already, e.g. from accept4()
+	void acceptfd(int fd, bool nonBlocking = false);
 	
 	int send(const void* buf, u32_t len, int flags = 0);
 	int recv(void* buf, u32_t len, int flags = 0);
+	
+	// how write() sends:
+	//	SEND_POLL	queue it, send when the poller says writable
+	//	SEND_DIRECT	send now if nothing is queued, queue what's left
+	//	SEND_DEFER	queue it, all of this pass go in one call at the end,
+	//				with TCP_NODELAY on so the merged segment isn't held (unless
+	//				setNoDelay() said otherwise) and a cork lifted for the call
+	enum {
+		SEND_POLL,
+		SEND_DIRECT,
+		SEND_DEFER,
+	};
+	void setSendMode(int mode) { _sendMode = mode; }
+	int sendMode() const { return _sendMode; }
+	
+	// gather write, may send less than all like send()
+	int writev(const struct iovec* v, int n);
+	
+	// send header + payloads without joining them: data pending in sendBuf()
+	// and v go out in one writev(), what's left is queued into sendBuf().
+	// returns the bytes taken, 0 if dropped, SOCKET_ERROR if closed
+	int sendv(const struct iovec* v, int n);
+	
+	// queue data into sendBuf() with the limits below,
+	// returns len, 0 if dropped, SOCKET_ERROR if closed
+	int write(const void* data, u32_t len);
+	
+	// backpressure of write()/sendv(): writable() is false when pending()
+	// reaches high, and onDrain() comes when it falls to low again.
+	// a message makes pending() over cap closes the socket, or is dropped
+	void setSendLimits(u32_t high, u32_t low, u32_t cap = 0, bool dropOnCap = false);
+	u32_t pending() const;
+	bool writable() const { return !_sendFull; }
 
 	void close();
 
@@ -506,20 +645,70 @@ public:
 	virtual void onSend();
 	virtual void onClose();
 	virtual void onPoll();
+	virtual void onDrain();
+	virtual void onFlush();
 
 	typedef std::function<void(SockTcp*, bool)> ON_CONNECT;
 	typedef std::function<void(SockTcp*)> 		ON_EVENT;
+	typedef std::function<void(SockTcp*, std::vector<SockTcp*>&)> ON_ACCEPT_BATCH;
+	typedef std::function<void(SockTcp*, SockBuf&)> ON_FRAME;
 	
 	ON_CONNECT	_onConnect = nullptr;
 	ON_EVENT	_onAccept = nullptr;
+	ON_ACCEPT_BATCH	_onAcceptBatch = nullptr;
 	ON_EVENT	_onRecv = nullptr;
 	ON_EVENT	_onSend = nullptr;
 	ON_EVENT	_onClose = nullptr;
 	ON_EVENT	_onPoll = nullptr;
+	ON_FRAME	_onFrame = nullptr;
+	ON_EVENT	_onDrain = nullptr;
+	
+	// split recvBuf() into frames of [length][body] before onRecv callbacks,
+	// _onFrame or lua FRAME event gets each body as a view (no copy).
+	// headBytes: 2 or 4, 0 to turn off. maxFrame: body size, 0 for 16MB,
+	// a bigger one closes the socket
+	void setFraming(int headBytes, u32_t maxFrame = 0, bool littleEndian = false);
 
 protected:
+	void onAcceptBatch();
+	int onResolve(u16_t port, int err, const std::vector<u32_t>& addrs);
+	int connectTo(const sockaddr_in* addr);
+	void connectTimer();
+	void connectFail();
+	int raceStart(u16_t port, const std::vector<u32_t>& addrs);
+	void raceNext();
+	void raceStop();
+	void onRace(SockTcp* sk, bool ok);
+	int doFrames();
+	bool checkCap(u32_t len);
+	void checkDrain();
+	
 	SockBuf*	_recvBuf;
 	SockBuf*	_sendBuf;
+	u32_t		_recvSize;		// bytes to read once, adapt to the traffic
+	
+	int			_acceptBatch = 0;
+	
+	u8_t		_frameHead = 0;		// length bytes of a frame
+	bool		_frameLE = false;
+	u32_t		_frameMax = 0;
+	
+	u32_t		_sendHigh = 0;
+	u32_t		_sendLow = 0;
+	u32_t		_sendCap = 0;
+	bool		_sendDrop = false;	// over cap: drop the message, or close
+	bool		_sendFull = false;	// reached high, wait for low
+	int			_sendMode = SEND_POLL;
+	bool		_noDelay = false;	// TCP_NODELAY set by onFlush()
+	u64_t		_resolveId = 0;		// connect(host) waits for Resolver
+	u32_t		_connTimeout = 0;
+	u64_t		_connTimer = 0;
+	
+	u32_t		_raceDelay = 0;
+	u64_t		_raceTimer = 0;
+	u16_t		_racePort = 0;
+	std::vector<u32_t>		_raceAddrs;	// not tried yet, the next at back
+	std::vector<SockTcp*>	_races;		// connecting
 	
 	friend SockLib;
 	
@@ -538,6 +727,7 @@ public:
 	static int mylua_close(lua_State* L);
 	static int mylua_isclosed(lua_State* L);
 	static int mylua_send(lua_State* L);
+	static int mylua_sendv(lua_State* L);
 	static int mylua_recv(lua_State* L);
 	static int mylua_inbuf(lua_State* L);
 	static int mylua_outbuf(lua_State* L);
@@ -556,6 +746,8 @@ private:
 	int _mylua_onAccept = -1;
 	int _mylua_onClose = -1;
 	int _mylua_onPoll = -1;
+	int _mylua_onFrame = -1;
+	int _mylua_onDrain = -1;
 #endif // SOCKLIB_TO_LUA
 };
 
@@ -589,19 +781,83 @@ public:
 	int recvfrom(void* data, u32_t len, std::string& ip, u16_t* port);
 	int recvfrom(void* data, u32_t len, sockaddr_in* addr);
 	
+	// a datagram of recvBatch(), data is in the socket's arena and valid
+	// until the next recvBatch()
+	struct Packet {
+		const u8_t*	data;
+		u32_t		len;
+		u32_t		ip;		// network order, as sendto(u32_t ip, ...)
+		u16_t		port;
+	};
+	typedef std::vector<Packet> Packets;
+	
+	// read up to max datagrams with one recvmmsg(), a recvfrom() loop where
+	// there is none. returns the count, SOCKET_ERROR on error
+	int recvBatch(Packets& pkts, int max);
+	
+	// n > 0: onRecv() reads up to n datagrams of maxPacket bytes per poll, and
+	// passes them to _onRecvBatch, or to lua RECV event as an array
+	void setRecvBatch(int n, u32_t maxPacket = 0);
+	
+	// n > 0: sendto() queues the datagram, the queue goes out with sendmmsg()
+	// at the end of this poll (see SockLib::flushLater()), or once n queued
+	void setSendBatch(int n);
+	int queueTo(const sockaddr_in* addr, const void* data, u32_t len);
+	
+	// send the queue now, what fails is dropped. returns the datagrams sent
+	int flush();
+	
+	// into the queue only, flush() is up to the caller
+	void enqueue(const sockaddr_in* addr, const void* data, u32_t len);
+	
+	// GSO: sendto() of more than size bytes sends datagrams of size bytes
+	// (the last one may be shorter) in one call with UDP_SEGMENT, or one by
+	// one where the kernel has none. 0 to turn off
+	void setGso(u32_t size) { _gsoSize = size; }
+	int sendSegments(const sockaddr_in* addr, const void* data, u32_t len, u32_t size);
+	
+	// GRO: the kernel may coalesce datagrams of a peer, recvBatch() splits
+	// them back. works in the batch path only, setRecvBatch() if it is off
+	int setGro(bool b);
+	
 public:
 	virtual void onRecv();
 	virtual void onSend();
 	virtual void onClose();
 	virtual void onPoll();
+	virtual void onFlush();
 	
 	typedef std::function<void(SockUdp*)> 	ON_EVENT;
+	typedef std::function<void(SockUdp*, const Packets&)> ON_RECV_BATCH;
 	
 	ON_EVENT	_onRecv = nullptr;
 	ON_EVENT	_onSend = nullptr;
 	ON_EVENT	_onClose = nullptr;
 	ON_EVENT	_onPoll = nullptr;
+	ON_RECV_BATCH	_onRecvBatch = nullptr;
 
+protected:
+	void onRecvBatch();
+	
+	struct Queued {
+		sockaddr_in	addr;
+		u32_t		off;	// in _sendArena
+		u32_t		len;
+	};
+	
+	int			_recvBatch = 0;
+	u32_t		_packetMax = 0;
+	std::vector<u8_t>	_recvArena;
+	Packets		_packets;
+	
+	int			_sendBatch = 0;
+	std::vector<u8_t>	_sendArena;
+	std::vector<Queued>	_sendQueue;
+	
+	u32_t		_gsoSize = 0;
+	bool		_gsoNone = false;	// kernel said no, send one by one
+	bool		_gro = false;
+	
 private:
 	
 	friend SockLib;
@@ -634,6 +890,230 @@ private:
 #endif // SOCKLIB_TO_LUA
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// class SockRudp
+//	reliable messages over UDP, like KCP: sequence numbers, an ack for every
+//	segment with the cumulative una, fast retransmit, send/recv windows and
+//	an RTO from the RTT, plus unreliable datagrams in the same session.
+//	listen() serves many peers on one socket, connect() has a socket of its own
+//
+class SockRudp : public SockUdp
+{
+protected:
+	SockRudp();
+	~SockRudp();
+	
+public:
+	// header and the first four as KCP
+	enum {
+		CMD_PUSH = 81,	// reliable data
+		CMD_ACK,
+		CMD_WASK,		// ask the window
+		CMD_WINS,		// tell the window
+		CMD_SYN,		// connect, and the answer
+		CMD_UNRE,		// unreliable data
+		CMD_FIN,		// closed
+	};
+	
+	// onConnect(true) when the peer answers, false after deadLink tries.
+	// conv: session id, 0 for a random one
+	int connect(const std::string& host, u16_t port, u32_t conv = 0);
+	int connect(u32_t ip, u16_t port, u32_t conv = 0);
+	
+	// sessions of new peers come to _onAccept or lua ACCEPT event
+	int listen(const std::string& ip, u16_t port);
+	int listen(u16_t port) { return listen("", port); }
+	
+	// a message, split into segments of MSS. reliable = false: one datagram
+	// of MSS at most, may be lost, no order. returns len, SOCKET_ERROR if
+	// closed or too big for the window
+	int send(const void* data, u32_t len, bool reliable = true);
+	
+	// interval: ms between updates at least. resend: fast retransmit after
+	// so many later acks, 0 off. nodelay: RTO from 30ms and not doubled.
+	// nocwnd: no congestion window, only the send and peer windows
+	void setArq(int interval, int resend, bool nodelay, bool nocwnd);
+	void setWindow(u32_t sndWnd, u32_t rcvWnd);
+	int setMtu(u32_t mtu);
+	// a segment sent so many times closes the session
+	void setDeadLink(u32_t n) { _deadLink = n; }
+	// no input for ms closes the session, a WASK asks the peer after a
+	// quarter of it so a live one answers. 0 off
+	void setIdle(u32_t ms) { _idle = ms; }
+	
+	u32_t conv() const { return _conv; }
+	u32_t rtt() const { return _srtt; }
+	// messages not sent and segments not acked yet
+	u32_t pending() const { return (u32_t)(_sndQueue.size() + _sndBuf.size()); }
+	
+	void getPeerAddr(std::string& ip, u16_t* port);
+	
+	virtual void close();
+	
+public:
+	virtual void onRecv();
+	virtual void onFlush();
+	virtual void onConnect(bool ok);
+	virtual void onClose();
+	virtual void onSession(SockRudp* sk);	// accepted
+	virtual void onMessage(const u8_t* data, u32_t len, bool reliable);
+	
+	typedef std::function<void(SockRudp*, bool)> ON_CONNECT;
+	typedef std::function<void(SockRudp*, SockRudp*)> ON_ACCEPT;
+	typedef std::function<void(SockRudp*, const u8_t*, u32_t, bool)> ON_MESSAGE;
+	
+	ON_CONNECT	_onConnect = nullptr;
+	ON_ACCEPT	_onAccept = nullptr;	// owns the new session
+	ON_MESSAGE	_onMessage = nullptr;
+	// _onClose of SockUdp
+	
+protected:
+	struct Seg {
+		u32_t	conv;
+		u8_t	cmd;
+		u8_t	frg;	// fragments after this one of the message
+		u16_t	wnd;
+		u32_t	ts;
+		u32_t	sn;
+		u32_t	una;
+		u32_t	resendts;
+		u32_t	rto;
+		u32_t	fastack;
+		u32_t	xmit;
+		std::string	data;
+	};
+	
+	void start();
+	void update();
+	void schedule();
+	int input(const u8_t* data, u32_t len);
+	void output();
+	void emit(const Seg& seg, const void* data, u32_t len);
+	void emitOut();
+	void parseAck(u32_t sn);
+	void parseUna(u32_t una);
+	void parseFastack(u32_t sn);
+	void parseData(Seg& seg);
+	void updateAck(i32_t rtt);
+	void deliver();
+	u16_t wndUnused() const;
+	void detach();
+	void dead();
+	
+	static u64_t peerKey(const sockaddr_in* addr) {
+		return ((u64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+	}
+	
+	SockUdp* transport() { return _parent ? (SockUdp*)_parent : this; }
+	
+	sockaddr_in	_peer;
+	SockRudp*	_parent = nullptr;		// listener of an accepted session
+	std::unordered_map<u64_t, SockRudp*>	_sessions;	// of a listener
+	bool		_listener = false;
+	
+	u32_t		_conv = 0;
+	u32_t		_mtu;
+	u32_t		_mss;
+	u32_t		_sndUna = 0;
+	u32_t		_sndNxt = 0;
+	u32_t		_rcvNxt = 0;
+	u32_t		_ssthresh;
+	u32_t		_srtt = 0;
+	u32_t		_rttval = 0;
+	u32_t		_rto;
+	u32_t		_minRto;
+	u32_t		_sndWnd;
+	u32_t		_rcvWnd;
+	u32_t		_rmtWnd;
+	u32_t		_cwnd = 1;
+	u32_t		_incr = 0;
+	u32_t		_probe = 0;
+	u32_t		_probeTs = 0;
+	u32_t		_probeWait = 0;
+	u32_t		_interval;
+	u32_t		_fastResend = 0;
+	u32_t		_deadLink;
+	u32_t		_idle;
+	u32_t		_rcvTs = 0;			// last input
+	u32_t		_keepTs = 0;		// next WASK of an idle session
+	bool		_nodelay = false;
+	bool		_nocwnd = false;
+	bool		_connecting = false;
+	u64_t		_resolveId = 0;		// connect(host) waits for Resolver
+	bool		_synSend = false;	// SYN to send in output()
+	u32_t		_synTs = 0;			// connect: next SYN
+	u32_t		_synTries = 0;
+	u64_t		_timer = 0;
+	u32_t		_timerTs = 0;		// when _timer fires
+	
+	std::deque<Seg>		_sndQueue;
+	std::deque<Seg>		_sndBuf;
+	std::deque<Seg>		_rcvQueue;
+	std::deque<Seg>		_rcvBuf;
+	std::vector<std::pair<u32_t, u32_t>>	_acks;	// sn, ts
+	std::vector<std::string>	_unreQueue;
+	std::string	_out;		// segments of one datagram
+	std::string	_msg;		// reassembled message
+	
+	friend SockLib;
+
+#if SOCKLIB_TO_LUA
+	friend LuaHelper;
+
+// call @C++
+public:
+	static SockRudp* mylua_this(lua_State* L, int idx = 1);
+
+// call @LUA
+public:
+	static int mylua_connect(lua_State* L);
+	static int mylua_listen(lua_State* L);
+	static int mylua_send(lua_State* L);
+	static int mylua_close(lua_State* L);
+	static int mylua_isclosed(lua_State* L);
+	static int mylua_onevent(lua_State* L);
+	static int mylua_setopt(lua_State* L);
+	static int mylua_peeraddr(lua_State* L);
+	static int mylua_index(lua_State* L);
+	static int mylua_gc(lua_State* L);
+	static int mylua_tostring(lua_State* L);
+	
+private:
+	int _mylua_onConnect = -1;
+	int _mylua_onAccept = -1;
+	int _mylua_onRecv = -1;
+	int _mylua_onClose = -1;
+
+#endif // SOCKLIB_TO_LUA
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// class SockWakeup
+//	eventfd (linux), pipe (posix) or loopback udp (win32) to wake up poll()
+//
+class SockWakeup : public SockRef
+{
+public:
+	SockWakeup() {}
+	~SockWakeup() { close(); }
+	
+	int create();
+	void close();
+	
+	// thread safe
+	void signal();
+	
+	bool careSend() { return false; }
+	
+public:
+	virtual void onRecv();
+	virtual void onSend() {}
+	virtual void onClose() {}
+	
+private:
+	int _wfd = -1;	// write end of the pipe
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // class SockBuf
 //
@@ -648,8 +1128,23 @@ public:
 		_max = r._max;
 		_pos_r = r._pos_r;
 		_pos_w = r._pos_w;
+		_owner = r._owner;
+		_chain = r._chain;
+		_ring = r._ring;
+		_shared = r._shared;
+		_view = r._view;
+		_head = r._head;
+		_tail = r._tail;
+		_spare = r._spare;
+		_size = r._size;
 		r._ptr = 0;
+		r._owner = 0;
 		r._max = r._pos_r = r._pos_w = 0;
+		r._head = r._tail = r._spare = 0;
+		r._size = 0;
+		r._chain = r._ring = false;
+		r._shared = 0;
+		r._view = false;
 	}
 	
 private:
@@ -658,18 +1153,53 @@ private:
 	
 public:
 	/// only for read
-	u8_t*	pos() const { return _ptr + _pos_r;	}
-	u32_t	len() const { return _pos_w - _pos_r;	}
+	/// (chain/ring mode: pos() makes all data contiguous, use pullup() or
+	/// iov() if you can)
+	u8_t*	pos() const { return _chain || _ring ? pullup(len()) : _ptr + _pos_r; }
+	u32_t	len() const { return _chain ? _size : _pos_w - _pos_r; }
 
 	int write(const void* data, u32_t bytes);
 	int read(void* data, u32_t bytes);
 	int peek(void* data, u32_t bytes);
 	void reset();
 	
+	// write in place: reserve() room for bytes at the tail, fill it, then
+	// commit() the bytes really written, e.g. recv(buf.reserve(n), n)
+	u8_t* reserve(u32_t bytes);
+	void commit(u32_t bytes);
+	
+	// chain mode keeps data in a list of 16KB blocks, append and discard
+	// never move the data, good for big queues, e.g. send buffer of a slow client
+	void setChain(bool b);
+	bool isChain() const { return _chain; }
+	
+	// ring mode has a fixed capacity (power of 2, one byte less usable),
+	// data is never moved by write, which fails if it doesn't fit.
+	// good for recv buffers when max frame size is known, a socket whose
+	// recv ring is still full after onRecv() is closed. 0 to turn off
+	bool setRing(u32_t capacity);
+	bool isRing() const { return _ring; }
+	
+	// bytes reserve() can give in one piece, ring mode only has a limit
+	u32_t room() const;
+	
+	// dst becomes a view of bytes from pos() + from, no copy in flat mode.
+	// the block is shared and ref counted, a view copies its data out when
+	// it's written, this buf does it when the block needs compact or grow
+	int slice(SockBuf& dst, u32_t from, u32_t bytes);
+	// ptr is from this buf, e.g. by r(), p(), pos()
+	int slice(SockBuf& dst, const void* ptr, u32_t bytes);
+	
+	// readable data as at most n iovecs, returns the count
+	int iov(struct iovec* v, int n) const;
+	
+	// make the first bytes contiguous, returns pos()
+	u8_t* pullup(u32_t bytes) const;
+	
 	SockBuf& skip(u32_t bytes) {
 		if (bytes > len())
 			bytes = len();
-		_pos_r += bytes;
+		consume(bytes);
 		return *this;
 	}
 	
@@ -680,21 +1210,21 @@ public:
 		if (_le) {
 			if (!len) len = _le;
 			else if (len > _le) len = _le;
-			return write(buf.pos(), len);
+			return write(buf.pullup(len), len);
 		}
 		return 0;
 	}
 	
 	int rbuf(SockBuf& buf, u32_t len) {
 		int r = pbuf(buf, 0, len);
-		_pos_r += r;
+		consume(r);
 		return r;
 	}
 	
 	int pbuf(SockBuf& buf, u32_t from, u32_t len) {
 		u32_t _le = this->len();
 		if ((from + len) < _le &&
-			len == buf.write(this->pos() + from, len)) {
+			len == buf.write(this->pullup(from + len) + from, len)) {
 			return len;
 		}
 		return 0;
@@ -754,8 +1284,8 @@ public:
 		if (bytes > len())
 			return 0;
 		
-		u8_t* buf = _ptr + _pos_r;
-		_pos_r += bytes;
+		u8_t* buf = pullup(bytes);
+		consume(bytes);
 		
 		return buf;
 	}
@@ -764,8 +1294,9 @@ public:
 		if (len() >= sizeof(u32_t)) {
 			bytes = p32();
 			if (len() >= (bytes + sizeof(u32_t))) {
-				_pos_r += sizeof(u32_t) + bytes;
-				return pos() - bytes;
+				u8_t* buf = pullup(sizeof(u32_t) + bytes) + sizeof(u32_t);
+				consume(sizeof(u32_t) + bytes);
+				return buf;
 			}
 		}
 		return 0;
@@ -773,18 +1304,16 @@ public:
 	
 	u8_t r8() {
 		u8_t v = 0;
-		if (len() >= sizeof(v)) {
-			v = pos()[0];
-			_pos_r += sizeof(v);
+		if (peekAt(&v, sizeof(v))) {
+			consume(sizeof(v));
 		}
 		return v;
 	}
 	
 	u16_t r16() {
 		u16_t v = 0;
-		if (len() >= sizeof(v)) {
-			memcpy(&v, pos(), sizeof(v));
-			_pos_r += sizeof(v);
+		if (peekAt(&v, sizeof(v))) {
+			consume(sizeof(v));
 			v = ntohs(v);
 		}
 		return v;
@@ -792,9 +1321,8 @@ public:
 	
 	u32_t r32() {
 		u32_t v = 0;
-		if (len() >= sizeof(v)) {
-			memcpy(&v, pos(), sizeof(v));
-			_pos_r += sizeof(v);
+		if (peekAt(&v, sizeof(v))) {
+			consume(sizeof(v));
 			v = ntohl(v);
 		}
 		return v;
@@ -802,9 +1330,8 @@ public:
 	
 	u64_t r64() {
 		u64_t v = 0;
-		if (len() >= sizeof(v)) {
-			memcpy(&v, pos(), sizeof(v));
-			_pos_r += sizeof(v);
+		if (peekAt(&v, sizeof(v))) {
+			consume(sizeof(v));
 			v = ntohll(v);
 		}
 		return v;
@@ -812,29 +1339,26 @@ public:
 	
 	//
 	const char*	rs() {
-		char* beg = (char*)pos();
-		char* p = beg;
 		u32_t l = len();
-
-		if (!p || !l) return "";
-
-		while (l && *p) {
-			p++; l--;
-		}
-		if (*p == 0) {
-			_pos_r += p - beg;
-			if (len()) _pos_r += 1;
-			return beg;
-		}
-		return "";
+		if (!l) return "";
+		
+		// only the string and its '\0' are made contiguous
+		u32_t n = strLen();
+		char* beg = (char*)(n < l ? pullup(n + 1) : strTail());
+		
+		if (!beg || beg[n] != 0) return "";
+		
+		consume(n < l ? n + 1 : n);
+		return beg;
 	}
 	
 	const char*	rsl() {
 		if (len() >= sizeof(u16_t)) {
 			u16_t bytes = p16();
 			if (len() >= (bytes + sizeof(u16_t))) {
-				_pos_r += sizeof(u16_t) + bytes;
-				return (char*)pos() - bytes;
+				char* s = (char*)pullup(sizeof(u16_t) + bytes) + sizeof(u16_t);
+				consume(sizeof(u16_t) + bytes);
+				return s;
 			}
 		}
 		return 0;
@@ -844,14 +1368,14 @@ public:
 	// peek
 	
 	u8_t* p(u32_t bytes) {
-		return bytes > len() ? 0 : pos();
+		return bytes > len() ? 0 : pullup(bytes);
 	}
 	
 	u8_t* pl(u32_t& bytes) {
 		if (len() >= sizeof(u32_t)) {
 			bytes = p32();
 			if (len() >= (bytes + sizeof(u32_t))) {
-				return pos() + sizeof(u32_t);
+				return pullup(sizeof(u32_t) + bytes) + sizeof(u32_t);
 			}
 		}
 		return 0;
@@ -859,16 +1383,13 @@ public:
 	
 	u8_t p8() {
 		u8_t v = 0;
-		if (len() >= sizeof(v)) {
-			v = pos()[0];
-		}
+		peekAt(&v, sizeof(v));
 		return v;
 	}
 	
 	u16_t p16() {
 		u16_t v = 0;
-		if (len() >= sizeof(v)) {
-			memcpy(&v, pos(), sizeof(v));
+		if (peekAt(&v, sizeof(v))) {
 			v = ntohs(v);
 		}
 		return v;
@@ -876,8 +1397,7 @@ public:
 	
 	u32_t p32() {
 		u32_t v = 0;
-		if (len() >= sizeof(v)) {
-			memcpy(&v, pos(), sizeof(v));
+		if (peekAt(&v, sizeof(v))) {
 			v = ntohl(v);
 		}
 		return v;
@@ -885,45 +1405,114 @@ public:
 	
 	u64_t p64() {
 		u64_t v = 0;
-		if (len() >= sizeof(v)) {
-			memcpy(&v, pos(), sizeof(v));
+		if (peekAt(&v, sizeof(v))) {
 			v = ntohll(v);
 		}
 		return v;
 	}
 	
 	const char*	ps() {
-		char* p = (char*)pos();
 		u32_t l = len();
-
-		if (!p || !l) return 0;
-
-		while (l && *p) {
-			p++; l--;
-		}
-		if (*p == 0) {
-			return (char*)pos();
-		}
-		return 0;
+		if (!l) return 0;
+		
+		u32_t n = strLen();
+		char* beg = (char*)(n < l ? pullup(n + 1) : strTail());
+		
+		if (!beg || beg[n] != 0) return 0;
+		
+		return beg;
 	}
 	
 	const char*	psl() {
 		if (len() >= sizeof(u16_t)) {
 			u16_t bytes = p16();
 			if (len() >= (bytes + sizeof(u16_t))) {
-				return (char*)pos() + sizeof(u16_t);
+				return (char*)pullup(sizeof(u16_t) + bytes) + sizeof(u16_t);
 			}
 		}
 		return 0;
 	}
 
+protected:
+	// copy bytes out from pos() + from, false if not enough
+	bool peekAt(void* v, u32_t bytes, u32_t from = 0) const {
+		if (from + bytes > len())
+			return false;
+		if (_ring)
+			return ringPeek(v, bytes, from);
+		if (!_chain) {
+			memcpy(v, _ptr + _pos_r + from, bytes);
+			return true;
+		}
+		return chainPeek(v, bytes, from);
+	}
+	
+	// bytes before the first '\0', len() if none, nothing is moved
+	u32_t strLen() const;
+	// pos() with a '\0' after the data, a view is copied out for it
+	u8_t* strTail();
+	
+	// move pos() forward, the memory is kept until next consume()
+	void consume(u32_t bytes) {
+		if (_chain) {
+			chainConsume(bytes);
+		} else {
+			_pos_r += bytes;
+			// ring: start over at 0, next write is contiguous
+			if (_ring && _pos_r == _pos_w)
+				_pos_r = _pos_w = 0;
+		}
+	}
+	
+	// a block in chain mode, always has one more byte for '\0'
+	struct Seg {
+		Seg*	next;
+		u32_t	r;
+		u32_t	w;
+		u32_t	cap;
+		u8_t	data[1];
+	};
+	
+	static Seg* segNew(u32_t bytes);
+	static void segFree(Seg* seg);
+	
+	int chainWrite(const void* data, u32_t bytes);
+	bool chainPeek(void* v, u32_t bytes, u32_t from) const;
+	void chainConsume(u32_t bytes);
+	void chainReset();
+	
+	// flat block shared by slices
+	struct Shared {
+		u32_t	refs;
+		u8_t*	ptr;
+		u32_t	max;
+	};
+	
+	// own a private block with room for bytes more
+	bool unshare(u32_t bytes = 0);
+	void dropBlock();
+	
+	int ringWrite(const void* data, u32_t bytes);
+	bool ringPeek(void* v, u32_t bytes, u32_t from) const;
+	
 protected:
 	u8_t*	_ptr;
 	u32_t	_max;		// alloced
-	u32_t	_pos_w;		// write
-	u32_t	_pos_r;		// read
+	mutable u32_t	_pos_w;		// write, ring mode: & (_max - 1)
+	mutable u32_t	_pos_r;		// read
+	SockRef* _owner;	// notify SockLib::update() when data comes
+	
+	bool	_chain;		// chain mode, pullup() may change the list
+	bool	_ring;		// ring mode, pullup() may rotate the data
+	Shared*	_shared;	// _ptr is in it, not ours only
+	bool	_view;		// slice of others, never write in place
+	mutable Seg*	_head;
+	mutable Seg*	_tail;
+	mutable Seg*	_spare;		// consumed last, keep r()'s data valid
+	u32_t	_size;
 	
 	friend SockLib;
+	friend SockTcp;
 
 #if SOCKLIB_TO_LUA
 	friend LuaHelper;
@@ -936,6 +1525,8 @@ public:
 public:
 	static int mylua_reset(lua_State* L);
 	static int mylua_skip(lua_State* L);
+	static int mylua_chain(lua_State* L);
+	static int mylua_ring(lua_State* L);
 	static int mylua_discard(lua_State* L);
 	static int mylua_buffer(lua_State* L);
 	static int mylua_length(lua_State* L);
@@ -974,6 +1565,70 @@ public:
 #endif // SOCKLIB_TO_LUA
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// class SockPool
+//	free lists of SockBuf blocks in size classes 4KB ... 256KB, one per loop.
+//	blocks not used for retention msec are given back to the system.
+//	threads without a loop share one that only mallocs and frees, so a block
+//	may be released to another pool than the one it came from
+//
+class SockPool
+{
+public:
+	enum {
+		CLASS_MIN = 1024 * 4,
+		CLASS_COUNT = 7,		// up to 256KB, bigger ones go to malloc()
+	};
+	
+	struct Stats {
+		u64_t	hits;			// alloc() from free lists
+		u64_t	misses;			// alloc() from malloc()
+		u64_t	drops;			// release() to free(), over cap
+		u32_t	cached;			// bytes in free lists
+	};
+	
+	SockPool();
+	~SockPool();
+	
+	// the pool of SockLoop::threadLoop(), or the unpooled one
+	static SockPool* current();
+	
+	// bytes is rounded up to the size class, pass it back to release()
+	void* alloc(u32_t& bytes);
+	void release(void* ptr, u32_t bytes);
+	
+	// cap: bytes kept per size class, retention: msec, 0 keeps them forever
+	void setCap(u32_t bytes) { _cap = bytes; }
+	void setRetention(u32_t msec) { _retention = msec; }
+	
+	// the loop calls it every poll
+	void trim(u64_t now);
+	void clear();
+	
+	const Stats& stats() const { return _stats; }
+	
+protected:
+	SockPool(const SockPool& r);
+	SockPool& operator = (const SockPool& r);
+	
+	struct Node {
+		Node*	next;
+	};
+	
+	struct Class {
+		Node*	head;
+		u32_t	count;
+		u32_t	low;			// min count since last trim(), not used at all
+	};
+	
+	Class	_classes[CLASS_COUNT];
+	u32_t	_cap;
+	u32_t	_retention;
+	u64_t	_trimTick;
+	bool	_closed;			// destructed or unpooled, malloc()/free() only
+	Stats	_stats;
+};
+
 
 #if SOCKLIB_ALG
 ///////////////////////////////////////////////////////////////////////////////
@@ -1205,13 +1860,16 @@ std::string Base64_decode(const char* sz, u32_t len = 0);
 class Timer {
 public:
 	typedef std::function<bool(Timer& tmr)> Callback;
-	typedef std::map<u64_t, Timer> TimerMap;
-	typedef std::map<u64_t, int> TmrIdMap;
+	typedef std::unordered_map<u64_t, Timer*> TimerMap;
 	
+	// in SockLoop::current()
 	static u64_t add(Timer& tmr);
 	static void remove(u64_t tmrId);
 	static void poll();
 	
+	// msec to wait for the nearest timer, -1 if none
+	static i64_t nextTimeout();
+	
 	void	onTick(u64_t tick);
 	
 	void 	cancel() { remove(_timerId); }
@@ -1222,22 +1880,49 @@ public:
 	i64_t	maxLoops() { return _maxLoops; }
 	
 private:
-	static TimerMap _refs;
-	static TimerMap _news;
-	static TmrIdMap _dies;
+	// hierarchical hashed timing wheel in msec, like the old linux kernel:
+	//		tv1 = 256 slots of 1ms, tvn[0..3] = 64 slots of 2^14 2^20 2^26 2^32 ms
+	enum {
+		TVR_BITS = 8,
+		TVN_BITS = 6,
+		TVR_SIZE = 1 << TVR_BITS,
+		TVN_SIZE = 1 << TVN_BITS,
+		TVR_MASK = TVR_SIZE - 1,
+		TVN_MASK = TVN_SIZE - 1,
+	};
 	
-#if SOCKLIB_TO_LUA
-	static TmrIdMap _mylua_refs;
-#endif
+public:
+	// one per SockLoop
+	struct Wheel {
+		~Wheel();
+		
+		TimerMap	refs;
+		Timer*		tv1[TVR_SIZE] = {};
+		Timer*		tvn[4][TVN_SIZE] = {};
+		u64_t		jiffies = 0;	// next tick to run
+		Timer*		firing = nullptr;
+	};
+	
+private:
+	static Wheel& wheel();
+	static void link(Wheel& w, Timer* tmr);
+	static void unlink(Timer* tmr);
+	static void cascade(Wheel& w, int n, int index);
+	static void destroy(Timer* tmr);
 
 private:
 	u64_t 	_timerId = 0;
-	u64_t	_curTick = 0;
+	u64_t	_expires = 0;
 	u64_t	_interval = 0;
 	i64_t   _curLoops = 0;
 	i64_t	_maxLoops = 0;
 	Callback _callback = nullptr;
 	
+	Timer**	_list = nullptr;	// in which slot
+	Timer*	_prev = nullptr;
+	Timer*	_next = nullptr;
+	bool	_dead = false;		// removed in callback
+	
 #if SOCKLIB_TO_LUA
 	int 	_mylua_ref = -1;
 #endif
@@ -1251,12 +1936,23 @@ private:
 class Util
 {
 public:
+	// monotonic msec. inside SockLib::poll() it is a value cached per poll,
+	// taken at the start and again after the wait, so callbacks of one poll
+	// see the same time. other threads and code out of a poll read the clock
 	static u64_t 		tick();
+	static u64_t 		updateTick();
+	// tick() cached or not in this thread, returns the old one
+	static bool			cacheTick(bool b);
+	
+	// monotonic, high resolution, not cached
+	static u64_t 		usec();
+	static u64_t 		nsec();
 	
 	static std::string	ipn2s(u32_t ip);
+	// blocks on a name not in Resolver's cache, use Resolver::resolve() then
 	static u32_t 		ips2n(const std::string& addr);
 	
-	// probe from cache
+	// probe from cache, 0 if missing and it is resolved in background
 	static u32_t 		ipprobe(const std::string& addr);
 
 	static std::string	urlenc(const std::string& url);
@@ -1273,25 +1969,8 @@ public:
 	static void ipn2addr(u32_t ip, u16_t port, sockaddr_in* addr);
 	
 private:
-	typedef std::map<const std::string, u32_t> IPCache;
-	static IPCache _ipcache;
-	static std::mutex _ipmutex;
-	
-	struct AutoMutex {
-		AutoMutex(std::mutex& mutex) : _mutex(mutex) {
-			_mutex.lock();
-		}
-		~AutoMutex() {
-			_mutex.unlock();
-		}
-		
-	private:
-		AutoMutex(const AutoMutex& r);
-		AutoMutex& operator = (const AutoMutex& r);
-		
-	private:
-		std::mutex& _mutex;
-	};
+	static thread_local u64_t _tick;	// cached per loop thread
+	static thread_local bool _tickCached;	// in SockLoop::poll()
 
 #if SOCKLIB_TO_LUA
 	static bool _onTimerCallback(Timer& tmr);
@@ -1318,6 +1997,8 @@ public:
 	static int mylua_u32_rshift(lua_State* L);
 
 	static int mylua_tick(lua_State* L);
+	static int mylua_usec(lua_State* L);
+	static int mylua_nsec(lua_State* L);
 
 	static int mylua_urlenc(lua_State* L);
 	static int mylua_urldec(lua_State* L);
@@ -1326,6 +2007,7 @@ public:
 	static int mylua_ipn2s(lua_State* L);
 
 	static int mylua_ipprobe(lua_State* L);
+	static int mylua_resolve(lua_State* L);
 
 	static int mylua_settimer(lua_State* L);
 	static int mylua_deltimer(lua_State* L);
@@ -1339,6 +2021,230 @@ public:
 #endif // SOCKLIB_TO_LUA
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// class Resolver
+//	getaddrinfo() in a fixed pool of threads, IPv4 only as the sockets are.
+//	answers are cached for a ttl, failures for a shorter one, a name being
+//	resolved is asked once for all waiters, and callbacks run in the poll
+//	thread of the loop resolve() is called in:
+//
+//		Resolver::resolve("example.com", [](int err, const Resolver::Addrs& addrs) {
+//			if (!err) tcp->connect(addrs[0], 80);
+//		});
+//
+class Resolver
+{
+public:
+	typedef std::vector<u32_t> Addrs;	// network order
+	// err: 0 or EAI_xxx, addrs is not empty when err is 0
+	typedef std::function<void(int err, const Addrs& addrs)> Callback;
+	typedef std::unordered_map<u64_t, Callback> Waits;
+	
+	enum {
+		THREADS		= 4,
+		TTL			= 60000,	// msec
+		NEG_TTL		= 5000,
+		ENTRIES		= 1024,
+	};
+	
+	// 0 keeps the current one, threads already started are kept
+	static void setup(u32_t threads, u32_t ttl = 0, u32_t negTtl = 0, u32_t entries = 0);
+	
+	// func is always called later, in this loop, unless canceled
+	// returns the request id, or 0 if func is empty
+	static u64_t resolve(const std::string& host, const Callback& func);
+	static void cancel(u64_t reqId);
+	
+	// a dotted ip or a fresh cache entry, false if the name must be resolved
+	static bool probe(const std::string& host, Addrs& addrs, int* err = nullptr);
+	
+	// blocking, through the cache
+	static int lookup(const std::string& host, Addrs& addrs);
+	
+	// the loop is going away, drop its waiters
+	static void cancel(SockLoop* loop);
+	
+protected:
+	struct Waiter {
+		SockLoop*	loop;
+		u64_t		reqId;
+	};
+	
+	struct Entry {
+		Addrs		addrs;
+		int			err = 0;
+		u64_t		expires = 0;
+		bool		pending = false;
+		std::vector<Waiter>	waiters;
+	};
+	
+	typedef std::unordered_map<std::string, Entry> Cache;
+	
+	struct AutoMutex {
+		AutoMutex(std::mutex& mutex) : _mutex(mutex) {
+			_mutex.lock();
+		}
+		~AutoMutex() {
+			_mutex.unlock();
+		}
+		
+	private:
+		AutoMutex(const AutoMutex& r);
+		AutoMutex& operator = (const AutoMutex& r);
+		
+	private:
+		std::mutex& _mutex;
+	};
+	
+	// shared by all loops and workers, never freed as workers are detached
+	struct State {
+		std::mutex	mutex;
+		std::condition_variable	cond;
+		Cache		cache;
+		std::deque<std::string>	queue;
+		u32_t		threads = 0;
+		u32_t		idle = 0;
+		u32_t		maxThreads = THREADS;
+		u32_t		ttl = TTL;
+		u32_t		negTtl = NEG_TTL;
+		u32_t		entries = ENTRIES;
+	};
+	
+	static State& state();
+	static u64_t now();
+	static int query(const std::string& host, Addrs& addrs);
+	static void store(State& st, const std::string& host, int err, const Addrs& addrs);
+	static void trim(State& st);
+	static void work();
+	static void deliver(u64_t reqId, int err, const Addrs& addrs);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// class SockLoop
+//	an event loop with its own poller, timers, posts and lua state.
+//	SockLib's static API goes to SockLoop::current(), run one loop
+//	per thread to use more cores:
+//
+//		SockLoop loop;
+//		std::thread th([&] { loop.run(); });
+//		loop.post([] { /* in loop's thread, SockLib::xxx() go to loop */ });
+//
+class SockLoop
+{
+public:
+	SockLoop();
+	~SockLoop();
+	
+	// the loop of this thread, defaultLoop() if none
+	static SockLoop* current();
+	// the loop of this thread, nullptr if none
+	static SockLoop* threadLoop() { return _current; }
+	static SockLoop* defaultLoop();
+	
+	// SockLib's API in this thread go to this loop, poll() does it too
+	void makeCurrent();
+	
+	void destroy(SockPtr ref);
+	void release(SockPtr ref);
+	
+	void add(SockPtr ref, int event);
+	void modify(SockPtr ref, int event);
+	void remove(const SockPtr ref);
+	bool found(const SockPtr ref);
+	void update(SockPtr ref);
+	void addPoll(SockPtr ref);
+	void removePoll(SockPtr ref);
+	
+	// ref->onFlush() once at the end of this pass, after timers, posts and
+	// events are handled, or before the next wait
+	void flushLater(SockPtr ref);
+	
+	void poll(u32_t usec = 10);
+	void run(u32_t usec = SockLib::POLL_FOREVER);
+	void stop();
+	void post(const std::function<void()>& func);
+	void wakeup();
+	
+	// release the poller and posts, refs are not deleted
+	void cleanup();
+	
+	u32_t count() { return _slotCount; }
+	Timer::Wheel& timers() { return _timers; }
+	SockPool& pool() { return _pool; }
+	Resolver::Waits& resolves() { return _resolves; }
+	
+#if SOCKLIB_TO_LUA
+	lua_State* luaState() { return _luaState; }
+	void setLuaState(lua_State* L) { _luaState = L; }
+#endif // SOCKLIB_TO_LUA
+	
+protected:
+	SockLoop(const SockLoop& r);
+	SockLoop& operator = (const SockLoop& r);
+	
+#if SOCKLIB_EPOLL
+	int _poll_epoll(u32_t usec = 10);
+	void _epoll_ctl(SockPtr ref);
+#else
+	int _poll_per_FD_SETSIZE(size_t& begin, u32_t usec = 10);
+#endif
+	void doPoll(u32_t usec);
+	void pend(SockPtr ref, int op);
+	void slotIn(SockPtr ref);
+	void slotOut(SockPtr ref);
+#if SOCKLIB_SLOTMAP
+	int slotOf(int fd);
+#endif // SOCKLIB_SLOTMAP
+	void beforePoll();
+	void afterPoll();
+	void dispatch();
+	void runPosts();
+	void flushAll();
+
+protected:
+	SockLib::SockSlots	_slots;
+	u32_t				_slotCount = 0;
+#if SOCKLIB_SLOTMAP
+	std::unordered_map<int, int>	_slotIds;	// fd: index in _slots
+	std::vector<int>	_slotFree;	// indices to reuse
+#endif // SOCKLIB_SLOTMAP
+	std::vector<SockPtr>	_pends;		// wait for beforePoll()
+
+#if SOCKLIB_EPOLL
+	int		_epfd = -1;
+	std::vector<epoll_event>	_epevs;
+	std::vector<SockPtr>		_upds;		// wait for update()
+#else
+	fd_set	_fdr, _fdw, _fde;
+	timeval	_tv;
+#endif
+
+	SockLib::SockEvts	_ready;		// fired in this poll
+	std::vector<SockPtr>	_polls;		// care onPoll()
+	bool		_pollsDirty = false;
+	std::vector<SockPtr>	_flushes;	// wait for flushAll()
+	
+	struct PostNode {
+		std::function<void()> func;
+		PostNode* next;
+	};
+	std::atomic<PostNode*>		_posts;		// lock-free MPSC stack
+	std::atomic<SockWakeup*>	_wakeup;	// created by the first poll
+	std::atomic<bool>			_running;
+	
+	Timer::Wheel	_timers;
+	SockPool		_pool;
+	Resolver::Waits	_resolves;	// callbacks of Resolver::resolve()
+	
+#if SOCKLIB_TO_LUA
+	lua_State*	_luaState = nullptr;
+#endif // SOCKLIB_TO_LUA
+	
+	static thread_local SockLoop* _current;
+	
+	friend SockWakeup;
+};
+
 SOCKLIB_NAMESPACE_END
 
 #endif // !__SOCKLIB_H__
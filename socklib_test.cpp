@@ -13,11 +13,224 @@ extern "C" {
 
 #include "SockLib.h"
 
+#include <assert.h>
+#include <string.h>
+
 using namespace std;
+using socklib::SockBuf;
+using socklib::SockLib;
+using socklib::Timer;
+using socklib::Util;
+
+// bytes of a..z, the offset can be told from the content
+static string test_data(size_t n, size_t from = 0)
+{
+	string s(n, 0);
+	for (size_t i = 0; i < n; ++i)
+		s[i] = (char)('a' + (from + i) % 26);
+	return s;
+}
+
+//
+// SockBuf modes are all in memory, no network
+//
+static void test_buf_chain()
+{
+	SockBuf buf;
+	buf.setChain(true);
+	
+	// across 16KB blocks
+	string data = test_data(40000);
+	assert(buf.write(data.data(), 10000) == 10000);
+	assert(buf.write(data.data() + 10000, 30000) == 30000);
+	assert(buf.len() == 40000);
+	
+	struct iovec v[8];
+	assert(buf.iov(v, 8) > 1);
+	
+	char out[5000];
+	assert(buf.read(out, sizeof(out)) == sizeof(out));
+	assert(!memcmp(out, data.data(), sizeof(out)));
+	
+	// back to flat, nothing lost
+	buf.setChain(false);
+	assert(!buf.isChain() && buf.len() == 35000);
+	assert(!memcmp(buf.pos(), data.data() + 5000, 35000));
+	
+	buf.setChain(true);
+	assert(buf.isChain() && buf.len() == 35000);
+	assert(!memcmp(buf.pullup(35000), data.data() + 5000, 35000));
+	
+	// rs() makes only the string contiguous
+	SockBuf str;
+	str.setChain(true);
+	str.write("hello", 6);
+	str.write(data.data(), 40000);
+	assert(!strcmp(str.rs(), "hello"));
+	assert(str.len() == 40000 && str.iov(v, 8) > 1);
+	
+	printf("test_buf_chain ok\n");
+}
+
+static void test_buf_ring()
+{
+	SockBuf buf;
+	assert(buf.setRing(4096) && buf.isRing());
+	
+	// 3000 in, 3000 out, the writes wrap around the end
+	char out[3000];
+	for (size_t i = 0; i < 10; ++i) {
+		string data = test_data(sizeof(out), i);
+		assert(buf.write(data.data(), sizeof(out)) == sizeof(out));
+		assert(buf.read(out, sizeof(out)) == sizeof(out));
+		assert(!memcmp(out, data.data(), sizeof(out)));
+	}
+	
+	// a full ring refuses more
+	string data = test_data(3500);
+	assert(buf.write(data.data(), 3000) == 3000);
+	assert(buf.read(out, 1000) == 1000);
+	assert(buf.write(data.data() + 3000, 500) == 500);
+	assert(buf.write(data.data(), 4096) <= 0);
+	assert(buf.len() == 2500);
+	
+	// back to flat, data kept and terminated
+	assert(buf.setRing(0) && !buf.isRing());
+	assert(buf.len() == 2500);
+	assert(!memcmp(buf.pos(), data.data() + 1000, 2500));
+	assert(buf.pos()[2500] == 0);
+	
+	assert(buf.setRing(8192) && buf.len() == 2500);
+	assert(!memcmp(buf.pullup(2500), data.data() + 1000, 2500));
+	
+	printf("test_buf_ring ok\n");
+}
+
+static void test_buf_slice()
+{
+	string data = test_data(1000);
+	
+	SockBuf parent;
+	parent.write(data.data(), 1000);
+	
+	SockBuf view;
+	assert(parent.slice(view, 100, 200) == 200);
+	assert(view.len() == 200 && !memcmp(view.pos(), data.data() + 100, 200));
+	
+	// the parent drains and refills its block, the view keeps its bytes
+	char out[1000];
+	assert(parent.read(out, 1000) == 1000);
+	string other(1000, '#');
+	parent.write(other.data(), 1000);
+	assert(!memcmp(view.pos(), data.data() + 100, 200));
+	
+	// writing the view doesn't touch the parent either
+	SockBuf view2;
+	assert(parent.slice(view2, 10, 10) == 10);
+	view2.write("xyz", 3);
+	assert(view2.len() == 13 && !memcmp(view2.pos(), other.data(), 10) && !memcmp(view2.pos() + 10, "xyz", 3));
+	assert(parent.len() == 1000 && !memcmp(parent.pos(), other.data(), 1000));
+	
+	parent.reset();
+	assert(!memcmp(view.pos(), data.data() + 100, 200));
+	
+	// a view ends before the parent's next byte, its string ends there too
+	SockBuf p3;
+	p3.write("12345", 5);
+	SockBuf v3;
+	assert(p3.slice(v3, p3.pos(), 4) == 4);
+	assert(!strcmp(v3.ps(), "1234"));
+	assert(!strcmp(v3.rs(), "1234") && v3.len() == 0);
+	assert(!strcmp(p3.ps(), "12345"));
+	
+	SockBuf v4;
+	assert(p3.slice(v4, p3.pos(), 2) == 2);
+	p3.reset();
+	assert(!strcmp(v4.rs(), "12"));
+	
+	printf("test_buf_slice ok\n");
+}
+
+//
+// a 256ms timer comes back to the slot it runs from, 255ms too once late
+//
+static void test_timer_period()
+{
+	int n256 = 0, n255 = 0;
+	
+	// a runaway stops at 1000
+	socklib::u64_t t256 = Util::setTimer(256, [&n256](Timer&) { return ++n256 < 1000; });
+	socklib::u64_t t255 = Util::setTimer(255, [&n255](Timer&) { return ++n255 < 1000; });
+	
+	socklib::u64_t end = Util::tick() + 1100;
+	while ((socklib::i64_t)(end - Util::tick()) > 0)
+		SockLib::poll(10000);
+	
+	Util::delTimer(t256);
+	Util::delTimer(t255);
+	
+	assert(n256 >= 3 && n256 <= 5);
+	assert(n255 >= 3 && n255 <= 5);
+	
+	printf("test_timer_period ok\n");
+}
+
+//
+// out of a poll, in this thread or another, tick() reads the clock
+//
+static void test_tick()
+{
+	SockLib::poll(0);
+	
+	socklib::u64_t t0 = Util::tick();
+	std::this_thread::sleep_for(std::chrono::milliseconds(30));
+	assert(Util::tick() - t0 >= 20);
+	
+	socklib::u64_t t1 = 0, t2 = 0;
+	std::thread th([&t1, &t2]() {
+		t1 = Util::tick();
+		std::this_thread::sleep_for(std::chrono::milliseconds(30));
+		t2 = Util::tick();
+	});
+	th.join();
+	assert(t2 - t1 >= 20);
+	
+	printf("test_tick ok\n");
+}
+
+//
+// a post from another thread wakes a poll that waits long
+//
+static void test_post_wakeup()
+{
+	std::atomic<bool> ran(false);
+	
+	std::thread th([&ran]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		SockLib::post([&ran]() { ran = true; });
+	});
+	
+	socklib::u64_t t0 = Util::tick();
+	while (!ran && Util::tick() - t0 < 3000)
+		SockLib::poll(2000000);
+	th.join();
+	
+	assert(ran);
+	assert(Util::tick() - t0 < 1000);
+	
+	printf("test_post_wakeup ok\n");
+}
 
 
 int main(int argc, const char * argv[])
 {
+	test_buf_chain();
+	test_buf_ring();
+	test_buf_slice();
+	test_timer_period();
+	test_tick();
+	test_post_wakeup();
+	
 	lua_State* L = luaL_newstate();
 	luaL_openlibs(L);
 	
@@ -46,9 +259,8 @@ int main(int argc, const char * argv[])
 //	socklib::SockLib::luaLoadFile(SCRIPT_DIR "Mahjong/App.lua", false);
 //	socklib::SockLib::luaLoadFile(SCRIPT_DIR "Mahjong/Net/Handler.lua", false);
 
-	while (1) {
-		socklib::SockLib::poll();
-	}
+	// block until sockets/timers/posts come, socklib.stop() to quit
+	socklib::SockLib::run();
 	
 	return 0;
 #endif
@@ -156,7 +156,9 @@ local function test_util_ipprobe()
 end
 
 local function test_util_other()
-	print( util.tick() )
+	print( util.tick() )		-- monotonic msec, cached in every socklib.poll()
+	print( util.usec() )		-- monotonic usec, not cached
+	print( util.nsec() )		-- monotonic nsec, not cached
 	print( util.urlenc("http://aa.bb.cc/dd ee.asp") )
 	print( util.urldec(util.urlenc("http://aa.bb.cc/dd ee.asp")) )
 	print( util.ips2n("192.168.0.1") )
@@ -256,6 +258,60 @@ end
 local function test_udpclient()
 end
 
+-- socklib.rudp is reliable messages over udp, and unreliable ones in the same session
+-- events: CONNECT(ok) ACCEPT(session) RECV(data, reliable) CLOSE()
+-- a listener serves many peers on one socket, keep the sessions it gives
+local function test_rudp()
+	local EVT = socklib.EVT
+	local port = 12399
+
+	-- a message of some segments, the numbers tell the order
+	local t = {}
+	for i = 1, 1000 do t[i] = string.format("%04d", i) end
+	local big = table.concat(t)
+
+	rudp_srv = socklib.rudp()
+	assert( select(2, rudp_srv:listen("127.0.0.1", port)) == nil )
+
+	rudp_srv:onevent(EVT.ACCEPT, function(s)
+		print("rudp accept " .. tostring(s))
+		rudp_session = s
+
+		s:onevent(EVT.RECV, function(data, reliable)
+			if reliable then
+				assert( data == big )
+				print("rudp reliable " .. #data .. " bytes in order")
+				s:send("pong", false)
+			else
+				assert( data == "ping" )
+				print("rudp unreliable " .. data)
+			end
+		end)
+
+		s:onevent(EVT.CLOSE, function()
+			print("rudp session closed by the peer")
+			rudp_srv:close()
+		end)
+	end)
+
+	rudp_cli = socklib.rudp()
+
+	rudp_cli:onevent(EVT.CONNECT, function(ok)
+		print("rudp connect " .. tostring(ok))
+		assert( ok )
+		rudp_cli:send("ping", false)
+		rudp_cli:send(big)
+	end)
+
+	rudp_cli:onevent(EVT.RECV, function(data, reliable)
+		assert( not reliable and data == "pong" )
+		print("rudp unreliable " .. data)
+		rudp_cli:close()
+	end)
+
+	rudp_cli:connect("127.0.0.1", port)
+end
+
 local function print_table(prefix, tbl)
 	print("@ " .. prefix)
 	for k, v in pairs(tbl) do
@@ -322,4 +378,5 @@ test_buf()
 --test_tcpclient()
 --test_udpserver()
 --test_udpclient()
+test_rudp()
 